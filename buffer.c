@@ -3,11 +3,18 @@
 #include "config.h"
 #include "se.h"
 #include "extension.h"
+#include "storage.h"
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <regex.h>
+#include <strings.h>
 
 // TODO: mark buffers as dirty and only redraw windows that have been changed
 
@@ -23,6 +30,25 @@ struct window_buffer* focused_window = &root_node.wb;
 static struct file_buffer* file_buffers;
 static int available_buffer_slots = 0;
 
+// the slots of destroyed buffers are reused, the generation of a slot
+// changes every time its buffer is destroyed so old handles stop resolving
+struct fb_slot {
+		unsigned int generation;
+		int next_free; // -1 at the end of the free list
+};
+#define FB_HANDLE_SLOT_BITS 20
+#define FB_HANDLE_GENERATION_MASK 0x7FF
+static struct fb_slot* fb_slots;
+static int fb_slots_capacity;
+static int first_free_slot = -1;
+static int live_buffers;
+
+// hash map from the path of a buffer to its slot, open addressing
+#define FB_PATH_EMPTY -1
+#define FB_PATH_REMOVED -2
+static int* fb_path_table;
+static int fb_path_table_len, fb_path_table_used;
+
 /////////////////////////////////////////////////
 // Function implementations
 //
@@ -48,6 +74,15 @@ recursive_mkdir(char *path) {
 
 // TODO: file open callback, implement as plugin
 static int open_seproj(struct file_buffer fb);
+static void fb_column_index_invalidate(struct file_buffer* fb, int offset);
+static void fb_column_index_free(struct file_buffer* fb);
+static void fb_contents_edited(struct file_buffer* fb, int offset, int removed, int inserted);
+static void fb_marks_free(struct file_buffer* fb);
+static void undo_record(struct file_buffer* fb, int offset, int removed, const char* data, int len);
+static void undo_record_from(struct file_buffer* fb, int offset, int from, int removed, const char* data, int len);
+static void undo_log_free(struct undo_log* u);
+static uint64_t undo_hash(const struct file_buffer* fb);
+static void undo_journal_saved(struct file_buffer* fb, uint64_t hash, int len);
 int
 open_seproj(struct file_buffer fb)
 {
@@ -57,19 +92,21 @@ open_seproj(struct file_buffer fb)
 		chdir(path);
 		int offset = -1;
 
+		fb_begin_transaction(&fb);
 		while((offset = fb_seek_char(&fb, offset+1, ' ')) >= 0)
 				fb_change(&fb, "\n", 1, offset, 0);
+		fb_commit_transaction(&fb, FB_CONTENT_BIG_CHANGE);
 
 		offset = -1;
+		char line[PATH_MAX];
 		while((offset = fb_seek_char(&fb, offset+1, '\n')) >= 0) {
-				char* line = fb_get_line_at_offset(&fb, offset);
-				if (strlen(line) && !is_file_type(line, ".seproj")) {
+				if (fb_span_copy(&fb, fb_span_line(&fb, offset), line, PATH_MAX) &&
+				    !is_file_type(line, ".seproj")) {
 						if (first < 0)
 								first = fb_new_entry(line);
 						else
 								fb_new_entry(line);
 				}
-				free(line);
 		}
 
 		if (first < 0)
@@ -81,45 +118,449 @@ open_seproj(struct file_buffer fb)
 		return first;
 }
 
+///////////////////////////////////
+// writes the contents with the line endings the file was loaded with
+static void
+fb_write_line_endings(const struct file_buffer* fb, FILE* file)
+{
+		const char* eol = "\n";
+		if (fb->line_endings == FB_EOL_CRLF)
+				eol = "\r\n";
+		else if (fb->line_endings == FB_EOL_CR)
+				eol = "\r";
+		int eol_len = strlen(eol);
+
+		const char* chunk;
+		for (int offset = 0, len; (chunk = fb_chunk(fb, offset, &len)); offset += len) {
+				if (*eol == '\n') {
+						fwrite(chunk, sizeof(char), len, file);
+						continue;
+				}
+				const char* end = chunk + len;
+				for (const char* c = chunk, *nl; c < end; c = nl + 1) {
+						nl = memchr(c, '\n', end - c);
+						if (!nl) {
+								fwrite(c, sizeof(char), end - c, file);
+								break;
+						}
+						fwrite(c, sizeof(char), nl - c, file);
+						fwrite(eol, sizeof(char), eol_len, file);
+				}
+		}
+}
+
+///////////////////////////////////
+// saves are written from a snapshot on a worker thread to a temporary
+// file next to the file, which is renamed over it once it is complete.
+// a single worker writes them in the order they were started so an older
+// save never replaces a newer one, fb_finish_saves reports them
+
+struct fb_save {
+		struct file_buffer* snapshot;
+		int handle; // fb_handle of the saved buffer
+		mode_t mode; // permissions of the written file
+		uid_t uid; // owner of the file that is replaced
+		gid_t gid;
+		int replaces; // the file exists, the new one gets its owner
+		int links; // the file has other hard links, they keep the old contents
+		int in_place; // written over the file, see save_in_place
+		int error; // errno of what failed, 0 once it is saved
+		uint64_t hash; // of the saved contents, see undo_journal_saved
+		int done;
+		struct fb_save* next;
+};
+
+static pthread_mutex_t fb_save_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fb_save_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t fb_save_written = PTHREAD_COND_INITIALIZER;
+static struct fb_save* fb_saves; // oldest first, done or not
+static int fb_save_worker_started;
+
+// returns an errno
+static int
+fb_save_contents(const struct file_buffer* fb, FILE* file)
+{
+		if (fb->mode & FB_UTF8_SIGNED)
+				fwrite("\xEF\xBB\xBF", 1, 3, file);
+		fb_write_line_endings(fb, file);
+		if (fflush(file) || ferror(file))
+				return errno ? errno : EIO;
+		if (save_fsync >= SAVE_FSYNC_FILE && fsync(fileno(file)))
+				return errno;
+		return 0;
+}
+
+// keeps the owner and the hard links of the file the rename would lose,
+// but a crash while writing leaves it cut short, see save_in_place
+static int
+fb_save_write_in_place(const struct fb_save* save, const char* path)
+{
+		FILE* file = fopen(path, "w");
+		if (!file)
+				return errno;
+		int error = fb_save_contents(save->snapshot, file);
+		if (fclose(file) && !error)
+				error = errno;
+		return error;
+}
+
+// returns an errno, the temporary file is removed if it fails
+static int
+fb_save_write(struct fb_save* save)
+{
+		const struct file_buffer* fb = save->snapshot;
+		// a symlink stays one, the file it points to is replaced
+		char path[PATH_MAX], temp[PATH_MAX];
+		if (!realpath(fb->file_path, path)) {
+				if (errno != ENOENT)
+						return errno;
+				if (snprintf(path, PATH_MAX, "%s", fb->file_path) >= PATH_MAX)
+						return ENAMETOOLONG;
+		}
+		if (save->in_place)
+				return fb_save_write_in_place(save, path);
+		const char* name = strrchr(path, '/');
+		name = name ? name+1 : path;
+		if (snprintf(temp, PATH_MAX, "%.*s.%s.XXXXXX", (int)(name - path), path, name) >= PATH_MAX)
+				return ENAMETOOLONG;
+		int fd = mkstemp(temp);
+		if (fd < 0)
+				return errno;
+		if (fchmod(fd, save->mode) || (save->replaces && fchown(fd, save->uid, save->gid))) {
+				int error = errno;
+				close(fd);
+				unlink(temp);
+				// a mapped file is read while it is written, it can't be written over
+				if (!save_in_place || (fb->mode & FB_MAPPED))
+						return error;
+				save->in_place = 1;
+				return fb_save_write_in_place(save, path);
+		}
+		FILE* file = fdopen(fd, "w");
+		if (!file) {
+				int error = errno;
+				close(fd);
+				unlink(temp);
+				return error;
+		}
+
+		int error = fb_save_contents(fb, file);
+		if (fclose(file) && !error)
+				error = errno;
+		if (!error && rename(temp, path))
+				error = errno;
+		if (error) {
+				unlink(temp);
+				return error;
+		}
+
+		if (save_fsync >= SAVE_FSYNC_DIRECTORY) {
+				char* dir = file_path_get_path(path);
+				int dir_fd = open(dir, O_RDONLY);
+				free(dir);
+				if (dir_fd < 0)
+						return errno;
+				if (fsync(dir_fd))
+						error = errno;
+				close(dir_fd);
+		}
+		return error;
+}
+
+static void*
+fb_save_worker(void* arg)
+{
+		pthread_mutex_lock(&fb_save_lock);
+		for (;;) {
+				struct fb_save* save = fb_saves;
+				while (save && save->done)
+						save = save->next;
+				if (!save) {
+						pthread_cond_wait(&fb_save_queued, &fb_save_lock);
+						continue;
+				}
+				pthread_mutex_unlock(&fb_save_lock);
+
+				int error = fb_save_write(save);
+				uint64_t hash = !error && undo_journal_dir ? undo_hash(save->snapshot) : 0;
+
+				pthread_mutex_lock(&fb_save_lock);
+				save->error = error;
+				save->hash = hash;
+				save->done = 1;
+				pthread_cond_broadcast(&fb_save_written);
+		}
+		return arg;
+}
+
+// saves that are still being written when the program exits are waited
+// for, only the journal hears of them, the status bar and extensions don't
+static void
+fb_wait_for_saves(void)
+{
+		pthread_mutex_lock(&fb_save_lock);
+		for (struct fb_save* save = fb_saves; save; save = save->next)
+				while (!save->done)
+						pthread_cond_wait(&fb_save_written, &fb_save_lock);
+		pthread_mutex_unlock(&fb_save_lock);
+
+		for (struct fb_save* save = fb_saves; save; save = save->next) {
+				struct file_buffer* fb = fb_from_handle(save->handle);
+				if (save->error)
+						fprintf(stderr, "failed to save %s: %s\n", save->snapshot->file_path, strerror(save->error));
+				else if (fb && fb_snapshot_is_current(fb, save->snapshot))
+						undo_journal_saved(fb, save->hash, save->snapshot->len);
+		}
+}
+
 void
 fb_write_to_filepath(struct file_buffer* fb)
 {
 		if (!fb->file_path)
 				return;
-		soft_assert(fb->contents, return;);
-		FILE* file = fopen(fb->file_path, "w");
-		soft_assert(file, return;);
+		soft_assert(fb->storage, return;);
+		if (fb->mode & FB_READ_ONLY) {
+				writef_to_status_bar("buffer is read only");
+				return;
+		}
+		// the old file stays alive while the contents are read from it,
+		// it is only renamed over
+		fb_load_all(fb);
+
+		struct fb_save* save = xmalloc(sizeof(struct fb_save));
+		*save = (struct fb_save){.snapshot = fb_snapshot_new(fb), .handle = fb_handle(fb - file_buffers)};
+		// an existing file keeps its permissions and owner, a new one gets
+		// what the umask allows. the rename would split hard links apart
+		struct stat st;
+		if (stat(fb->file_path, &st) == 0) {
+				save->mode = st.st_mode & 07777;
+				save->uid = st.st_uid;
+				save->gid = st.st_gid;
+				save->replaces = 1;
+				save->links = st.st_nlink > 1;
+				save->in_place = save_in_place && save->links && !(fb->mode & FB_MAPPED);
+		} else {
+				mode_t mask = umask(0);
+				umask(mask);
+				save->mode = 0666 & ~mask;
+		}
+
+		pthread_mutex_lock(&fb_save_lock);
+		if (!fb_save_worker_started) {
+				pthread_t thread;
+				fb_save_worker_started = pthread_create(&thread, NULL, fb_save_worker, NULL) == 0;
+				if (fb_save_worker_started) {
+						pthread_detach(thread);
+						atexit(fb_wait_for_saves);
+				}
+		}
+		struct fb_save** last = &fb_saves;
+		while (*last)
+				last = &(*last)->next;
+		*last = save;
+		if (fb_save_worker_started) {
+				pthread_cond_signal(&fb_save_queued);
+				pthread_mutex_unlock(&fb_save_lock);
+				writef_to_status_bar("saving buffer to %s", fb->file_path);
+				return;
+		}
+		pthread_mutex_unlock(&fb_save_lock);
 
-		if (fb->mode & FB_UTF8_SIGNED)
-				fwrite("\xEF\xBB\xBF", 1, 3, file);
-		fwrite(fb->contents, sizeof(char), fb->len, file);
-		writef_to_status_bar("saved buffer to %s", fb->file_path);
+		// without a worker it is written right away
+		save->error = fb_save_write(save);
+		save->hash = !save->error && undo_journal_dir ? undo_hash(save->snapshot) : 0;
+		save->done = 1;
+		fb_finish_saves();
+}
+
+int
+fb_finish_saves(void)
+{
+		int finished = 0;
+		for (;;) {
+				pthread_mutex_lock(&fb_save_lock);
+				struct fb_save* save = fb_saves;
+				if (save && save->done)
+						fb_saves = save->next;
+				else
+						save = NULL;
+				pthread_mutex_unlock(&fb_save_lock);
+				if (!save)
+						return finished;
+
+				if (save->error) {
+						writef_to_status_bar("failed to save %s: %s", save->snapshot->file_path, strerror(save->error));
+				} else {
+						if (save->in_place)
+								writef_to_status_bar("saved buffer to %s in place, not atomically", save->snapshot->file_path);
+						else if (save->links)
+								writef_to_status_bar("saved buffer to %s, its other hard links have the old contents",
+								                     save->snapshot->file_path);
+						else
+								writef_to_status_bar("saved buffer to %s", save->snapshot->file_path);
+						struct file_buffer* fb = fb_from_handle(save->handle);
+						if (fb) {
+								// the journal only knows the contents of the buffer as it is now
+								if (fb_snapshot_is_current(fb, save->snapshot))
+										undo_journal_saved(fb, save->hash, save->snapshot->len);
+								call_extension(fb_written_to_file, fb);
+						}
+				}
+				fb_snapshot_free(save->snapshot);
+				free(save);
+				finished++;
+		}
+}
+
+///////////////////////////////////
+// buffer slots
+
+static int
+fb_slot_new(void)
+{
+		int slot = first_free_slot;
+		if (slot >= 0) {
+				first_free_slot = fb_slots[slot].next_free;
+		} else {
+				if (available_buffer_slots == fb_slots_capacity) {
+						fb_slots_capacity = MAX(fb_slots_capacity * 2, 16);
+						file_buffers = xrealloc(file_buffers, sizeof(struct file_buffer) * fb_slots_capacity);
+						fb_slots = xrealloc(fb_slots, sizeof(struct fb_slot) * fb_slots_capacity);
+				}
+				slot = available_buffer_slots++;
+				fb_slots[slot].generation = 0;
+		}
+		fb_slots[slot].next_free = -1;
+		live_buffers++;
+		return slot;
+}
+
+static void
+fb_slot_free(int slot)
+{
+		fb_slots[slot].generation++;
+		fb_slots[slot].next_free = first_free_slot;
+		first_free_slot = slot;
+		live_buffers--;
+}
+
+int
+fb_handle(int fb_index)
+{
+		if (fb_index < 0 || fb_index >= available_buffer_slots || !file_buffers[fb_index].storage)
+				return -1;
+		return (fb_slots[fb_index].generation & FB_HANDLE_GENERATION_MASK) << FB_HANDLE_SLOT_BITS | fb_index;
+}
+
+struct file_buffer*
+fb_from_handle(int handle)
+{
+		if (handle < 0)
+				return NULL;
+		int slot = handle & ((1 << FB_HANDLE_SLOT_BITS) - 1);
+		unsigned int generation = handle >> FB_HANDLE_SLOT_BITS;
+		if (slot >= available_buffer_slots || !file_buffers[slot].storage ||
+		    (fb_slots[slot].generation & FB_HANDLE_GENERATION_MASK) != generation)
+				return NULL;
+		return &file_buffers[slot];
+}
+
+static unsigned int
+path_hash(const char* path)
+{
+		// FNV-1a
+		unsigned int hash = 2166136261u;
+		for (; *path; path++)
+				hash = (hash ^ (unsigned char)*path) * 16777619u;
+		return hash;
+}
+
+// returns the index in fb_path_table of path, or of the empty entry it would go in
+static int
+fb_path_find(const char* path)
+{
+		int removed = -1;
+		int mask = fb_path_table_len - 1;
+		for (int i = path_hash(path) & mask; ; i = (i + 1) & mask) {
+				int slot = fb_path_table[i];
+				if (slot == FB_PATH_EMPTY)
+						return removed >= 0 ? removed : i;
+				if (slot == FB_PATH_REMOVED) {
+						if (removed < 0)
+								removed = i;
+				} else if (strcmp(file_buffers[slot].file_path, path) == 0) {
+						return i;
+				}
+		}
+}
+
+static int
+fb_path_lookup(const char* path)
+{
+		if (!fb_path_table_len)
+				return -1;
+		int slot = fb_path_table[fb_path_find(path)];
+		return slot >= 0 ? slot : -1;
+}
 
-		fclose(file);
-		call_extension(fb_written_to_file, fb);
+static void
+fb_path_insert(int slot)
+{
+		// keep at least half of the table empty so probing stays short
+		if ((fb_path_table_used + 1) * 2 > fb_path_table_len) {
+				int* old_table = fb_path_table;
+				int old_len = fb_path_table_len;
+				fb_path_table_len = MAX(old_len * 2, 64);
+				fb_path_table = xmalloc(fb_path_table_len * sizeof(int));
+				for (int i = 0; i < fb_path_table_len; i++)
+						fb_path_table[i] = FB_PATH_EMPTY;
+				fb_path_table_used = 0;
+				for (int i = 0; i < old_len; i++) {
+						if (old_table[i] >= 0) {
+								fb_path_table[fb_path_find(file_buffers[old_table[i]].file_path)] = old_table[i];
+								fb_path_table_used++;
+						}
+				}
+				free(old_table);
+		}
+		int i = fb_path_find(file_buffers[slot].file_path);
+		if (fb_path_table[i] == FB_PATH_EMPTY)
+				fb_path_table_used++;
+		fb_path_table[i] = slot;
 }
 
+static void
+fb_path_remove(int slot)
+{
+		if (!fb_path_table_len)
+				return;
+		int i = fb_path_find(file_buffers[slot].file_path);
+		if (fb_path_table[i] == slot)
+				fb_path_table[i] = FB_PATH_REMOVED;
+}
 
 int
 destroy_fb_entry(struct window_split_node* node, struct window_split_node* root)
 {
 		// do not allow deletion of the lst file buffer
-		int n = 0;
-		for(; n < available_buffer_slots; n++)
-				if (file_buffers[n].contents && n != node->wb.fb_index)
-						break;
-		if (n >= available_buffer_slots) {
+		get_fb(&node->wb);
+		if (live_buffers <= 1) {
 				writef_to_status_bar("can't delete last buffer");
 				return 0;
 		}
 
 		if (window_other_nodes_contain_fb(node, root)) {
+				wb_clear_cursors(&node->wb);
 				node->wb.fb_index++;
 				node->wb = wb_new(node->wb.fb_index);
 				writef_to_status_bar("swapped buffer");
 				return 0;
 		}
-		fb_destroy(get_fb(&node->wb));
+		wb_clear_cursors(&node->wb);
+		int slot = node->wb.fb_index;
+		fb_path_remove(slot);
+		fb_destroy(&file_buffers[slot]);
+		fb_slot_free(slot);
 
 		node->wb = wb_new(node->wb.fb_index);
 
@@ -139,21 +580,21 @@ get_fb(struct window_buffer* wb)
 		else if (wb->fb_index >= available_buffer_slots)
 				wb->fb_index = 0;
 
-		if (!file_buffers[wb->fb_index].contents) {
+		if (!file_buffers[wb->fb_index].storage) {
 				for(int n = wb->fb_index; n < available_buffer_slots; n++) {
-						if (file_buffers[n].contents) {
+						if (file_buffers[n].storage) {
 								wb->fb_index = n;
 								return &file_buffers[n];
 						}
 				}
 				for(int n = 0; n < available_buffer_slots; n++) {
-						if (file_buffers[n].contents) {
+						if (file_buffers[n].storage) {
 								wb->fb_index = n;
 								return &file_buffers[n];
 						}
 				}
 		} else {
-				soft_assert(file_buffers[wb->fb_index].contents, );
+				soft_assert(file_buffers[wb->fb_index].storage, );
 				return &file_buffers[wb->fb_index];
 		}
 
@@ -175,6 +616,151 @@ fb_delete_selection(struct file_buffer* fb)
 		return 0;
 }
 
+///////////////////////////////////
+// turns "\r\n" and lone '\r' into '\n' in one pass, returns the new length
+// the kinds of line endings that were found are added to line_endings
+// memchr does the scanning so only the '\r' are looked at one by one
+static int
+normalize_line_endings(char* data, int len, int* line_endings)
+{
+		char* dest = data;
+		const char* src = data;
+		const char* end = data + len;
+		for (;;) {
+				const char* cr = memchr(src, '\r', end - src);
+				const char* segment_end = cr ? cr : end;
+				if (!(*line_endings & FB_EOL_LF) && memchr(src, '\n', segment_end - src))
+						*line_endings |= FB_EOL_LF;
+				if (dest != src)
+						memmove(dest, src, segment_end - src);
+				dest += segment_end - src;
+				if (!cr)
+						break;
+
+				*dest++ = '\n';
+				if (cr + 1 < end && cr[1] == '\n') {
+						*line_endings |= FB_EOL_CRLF;
+						src = cr + 2;
+				} else {
+						*line_endings |= FB_EOL_CR;
+						src = cr + 1;
+				}
+		}
+		return dest - data;
+}
+
+///////////////////////////////////
+// maps huge files instead of reading them in, the storage never writes to
+// the mapping so the file is only read when it is looked at
+// the line endings are guessed from the start of the file, a '\r' after it
+// is kept as it is and written back unchanged
+#define FB_MAP_EOL_CHECK (1 << 16)
+static struct fb_storage*
+fb_map_file(const char* file_path, long size, int* mode)
+{
+		if (size > INT_MAX)
+				return NULL;
+		int fd = open(file_path, O_RDONLY);
+		if (fd < 0)
+				return NULL;
+		char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (data == MAP_FAILED)
+				return NULL;
+		// the mapping can't be changed, files that need their line endings
+		// normalized are loaded lazily instead
+		if (memchr(data, '\r', MIN(size, FB_MAP_EOL_CHECK))) {
+				munmap(data, size);
+				return NULL;
+		}
+
+		int signed_utf8 = size >= 3 && memcmp(data, "\xEF\xBB\xBF", 3) == 0;
+		struct fb_storage* storage = storage_new_mapped(data, size);
+		*mode |= FB_MAPPED;
+		if (signed_utf8) {
+				storage_remove(storage, 0, 3);
+				*mode |= FB_UTF8_SIGNED;
+		}
+		return storage;
+}
+
+#define FB_LOAD_CHUNK (1 << 22)
+
+///////////////////////////////////
+// only reads the start of the file, the rest is read by fb_load_chunk
+static int
+fb_load_lazily(struct file_buffer* fb, long size)
+{
+		int fd = open(fb->file_path, O_RDONLY);
+		if (fd < 0)
+				return 0;
+		fb->loader = xmalloc(sizeof(struct fb_loader));
+		*fb->loader = (struct fb_loader){.fd = fd, .size = size};
+		fb->storage = storage_new(NULL, 0);
+		fb->mode |= FB_LAZY;
+		fb_load_chunk(fb);
+		return 1;
+}
+
+int
+fb_load_chunk(struct file_buffer* fb)
+{
+		struct fb_loader* loader = fb->loader;
+		if (!loader)
+				return 0;
+
+		int len = MIN(FB_LOAD_CHUNK, INT_MAX - fb->len);
+		char* chunk = xmalloc(FB_LOAD_CHUNK);
+		int read_len = len > 0 ? read(loader->fd, chunk, len) : 0;
+		if (read_len > 0) {
+				int start = 0;
+				if (loader->read == 0 && read_len >= 3 && memcmp(chunk, "\xEF\xBB\xBF", 3) == 0) {
+						fb->mode |= FB_UTF8_SIGNED;
+						start = 3;
+				}
+				loader->read += read_len;
+				// a "\r\n" split between two chunks is normalized with the next one
+				if (read_len - start > 1 && chunk[read_len-1] == '\r' && loader->read < loader->size &&
+				    lseek(loader->fd, -1, SEEK_CUR) >= 0) {
+						loader->read--;
+						read_len--;
+				}
+
+				int offset = fb->len;
+				int chunk_len = normalize_line_endings(chunk + start, read_len - start, &fb->line_endings);
+				storage_insert(fb->storage, offset, chunk + start, chunk_len);
+				fb->len = storage_len(fb->storage);
+				fb_column_index_invalidate(fb, offset);
+				fb_contents_edited(fb, offset, 0, chunk_len);
+		}
+		free(chunk);
+
+		if (read_len <= 0 || loader->read >= loader->size) {
+				if (loader->read < loader->size) {
+						writef_to_status_bar("only %ldk of %ldk could be loaded", loader->read/1000, loader->size/1000);
+						fb->mode |= FB_READ_ONLY;
+				}
+				close(loader->fd);
+				free(loader);
+				fb->loader = NULL;
+		}
+		return read_len > 0;
+}
+
+void
+fb_load_lines(struct file_buffer* fb, int lines)
+{
+		while (fb->loader && fb_line_to_offset(fb, lines) < 0 && fb_load_chunk(fb))
+				;
+}
+
+void
+fb_load_all(struct file_buffer* fb)
+{
+		while (fb_load_chunk(fb))
+				;
+}
+
 struct file_buffer
 fb_new(const char* file_path)
 {
@@ -206,18 +792,38 @@ fb_new(const char* file_path)
 						long readsize = ftell(file);
 						rewind(file);
 
-						if (readsize > (long)1.048576e+7) {
+						if (readsize > lazy_load_size && fb_load_lazily(&fb, readsize)) {
 								fclose(file);
-								die("you are opening a huge file(>10MiB), not allowed");
-								return fb;
-								// TODO: don't crash
+								fb.syntax_index = -1;
+								goto file_read;
+						}
+						if (readsize > huge_file_size) {
+								fclose(file);
+								fb.storage = fb_map_file(fb.file_path, readsize, &fb.mode);
+								if (fb.storage) {
+										fb.len = storage_len(fb.storage);
+										fb.syntax_index = -1;
+										goto file_read;
+								}
+								// it is normalized a chunk at a time as it is read
+								if (fb_load_lazily(&fb, readsize)) {
+										fb.syntax_index = -1;
+										goto file_read;
+								}
+								file = fopen(fb.file_path, "rb");
+								if (readsize > INT_MAX || !file) {
+										writef_to_status_bar("unable to open %s", fb.file_path);
+										if (file)
+												fclose(file);
+										fb.mode |= FB_READ_ONLY;
+										res = NULL;
+										goto file_read;
+								}
 						}
 
-						fb.len = readsize;
-						fb.capacity = readsize + 100;
-
-						fb.contents = xmalloc(fb.capacity);
-						fb.contents[0] = 0;
+						char* contents = NULL;
+						if (readsize > 0)
+								contents = xmalloc(readsize);
 
 						char bom[4] = {0};
 						fread(bom, 1, 3, file);
@@ -225,41 +831,35 @@ fb_new(const char* file_path)
 								rewind(file);
 						else
 								fb.mode |= FB_UTF8_SIGNED;
-						fread(fb.contents, 1, readsize, file);
+						if (contents)
+								fb.len = normalize_line_endings(contents, fread(contents, 1, readsize, file),
+								                                &fb.line_endings);
 						fclose(file);
 
+						fb.storage = storage_new(contents, fb.len);
+
 						fb.syntax_index = -1;
 				}
 		}
+file_read:
 
-		if (!fb.capacity)
-				fb.capacity = 100;
-		if (!fb.contents) {
-				fb.contents = xmalloc(fb.capacity);
-				memset(fb.contents, 0, fb.capacity);
-		}
-		fb.ub = xmalloc(sizeof(struct undo_buffer) * UNDO_BUFFERS_COUNT);
+		if (!fb.storage)
+				fb.storage = storage_new(NULL, 0);
 		fb.search_term = xmalloc(SEARCH_TERM_MAX_LEN);
 		fb.non_blocking_search_term = xmalloc(SEARCH_TERM_MAX_LEN);
-		memset(fb.ub, 0, sizeof(struct undo_buffer) * UNDO_BUFFERS_COUNT);
 		memset(fb.search_term, 0, SEARCH_TERM_MAX_LEN);
 		memset(fb.non_blocking_search_term, 0, SEARCH_TERM_MAX_LEN);
 		fb.indent_len = default_indent_len;
 
-		// change line endings
-		int offset = 0;
-		while((offset = fb_seek_string(&fb, offset, "\r\n")) >= 0)
-				fb_remove(&fb, offset, 1, 1, 1);
-		offset = 0;
-		while((offset = fb_seek_char(&fb, offset, '\r')) >= 0)
-				fb_change(&fb, "\n", 1, offset, 1);
+		if (fb.mode & FB_HUGE_MASK && huge_file_read_only)
+				fb.mode |= FB_READ_ONLY;
 
 		call_extension(fb_new_file_opened, &fb);
 
 		call_extension(fb_contents_updated, &fb, 0, FB_CONTENT_INIT);
 
 		if (res)
-				writef_to_status_bar("new fb %s", fb.file_path);
+				writef_to_status_bar("new fb %s%s", fb.file_path, fb.mode & FB_READ_ONLY ? " (read only)" : "");
 		return fb;
 }
 
@@ -271,162 +871,1670 @@ fb_new_entry(const char* file_path)
 				file_path = "./";
 		soft_assert(strlen(file_path) < PATH_MAX, file_path = "./";);
 
-		char* res = realpath(file_path, full_path);
-
-		if (available_buffer_slots) {
-				if (res) {
-						for(int n = 0; n < available_buffer_slots; n++) {
-								if (file_buffers[n].contents) {
-										if (strcmp(file_buffers[n].file_path, full_path) == 0) {
-												writef_to_status_bar("buffer exits");
-												return n;
-										}
-								}
-						}
-				} else {
-						strcpy(full_path, file_path);
-				}
-
-				for(int n = 0; n < available_buffer_slots; n++) {
-						if (!file_buffers[n].contents) {
-								if (is_file_type(full_path, ".seproj"))
-										return open_seproj(fb_new(full_path));
-								file_buffers[n] = fb_new(full_path);
-								return n;
-						}
+		if (realpath(file_path, full_path)) {
+				int slot = fb_path_lookup(full_path);
+				if (slot >= 0) {
+						writef_to_status_bar("buffer exits");
+						return slot;
 				}
+		} else {
+				strcpy(full_path, file_path);
 		}
 
 		if (is_file_type(full_path, ".seproj"))
 				return open_seproj(fb_new(full_path));
 
-		available_buffer_slots++;
-		file_buffers = xrealloc(file_buffers, sizeof(struct file_buffer) * available_buffer_slots);
-		file_buffers[available_buffer_slots-1] = fb_new(full_path);
-
-		return available_buffer_slots-1;
+		struct file_buffer fb = fb_new(full_path);
+		int slot = fb_slot_new();
+		file_buffers[slot] = fb;
+		fb_path_insert(slot);
+		return slot;
 }
 
 void
 fb_destroy(struct file_buffer* fb)
 {
-		free(fb->ub);
-		free(fb->contents);
+		undo_log_free(&fb->undo);
+		storage_free(fb->storage);
+		fb_column_index_free(fb);
+		fb_marks_free(fb);
+		if (fb->loader) {
+				close(fb->loader->fd);
+				free(fb->loader);
+		}
 		free(fb->file_path);
 		free(fb->search_term);
 		free(fb->non_blocking_search_term);
 		*fb = (struct file_buffer){0};
 }
 
+struct file_buffer*
+fb_snapshot_new(struct file_buffer* fb)
+{
+		struct file_buffer* snapshot = xmalloc(sizeof(struct file_buffer));
+		*snapshot = (struct file_buffer) {
+				.file_path = fb->file_path ? strdup(fb->file_path) : NULL,
+				.storage = storage_snapshot(fb->storage),
+				.len = fb->len,
+				.mode = fb->mode | FB_READ_ONLY,
+				.line_endings = fb->line_endings,
+				.version = fb->version,
+				.indent_len = fb->indent_len,
+				.syntax_index = fb->syntax_index,
+				.transaction_start = -1,
+				.transaction_end = -1,
+		};
+		return snapshot;
+}
+
 void
-fb_insert(struct file_buffer* fb, const char* new_content, const int len, const int offset, int do_not_callback)
+fb_snapshot_free(struct file_buffer* snapshot)
 {
-		soft_assert(fb, return;);
-		soft_assert(fb->contents, fb->capacity = 0;);
-		soft_assert(offset <= fb->len && offset >= 0,
-					fprintf(stderr, "writing past fb '%s'\n", fb->file_path);
-					return;
-				);
+		if (!snapshot)
+				return;
+		storage_free(snapshot->storage);
+		fb_column_index_free(snapshot);
+		free(snapshot->file_path);
+		free(snapshot);
+}
 
-		if (fb->len + len >= fb->capacity) {
-				fb->capacity = fb->len + len + 256;
-				fb->contents = xrealloc(fb->contents, fb->capacity);
-		}
-		if (offset < fb->len)
-				memmove(fb->contents+offset+len, fb->contents+offset, fb->len-offset);
-		fb->len += len;
+int
+fb_snapshot_is_current(const struct file_buffer* fb, const struct file_buffer* snapshot)
+{
+		return snapshot->version == fb->version;
+}
+
+///////////////////////////////////
+// Marks
+//
+
+struct fb_mark {
+		int offset;
+		int gravity; // mark_gravity, -1 if the handle isn't used
+};
+
+struct fb_marks {
+		struct fb_mark* marks; // indexed by the handle
+		int marks_len, marks_capacity; // of marks and sorted
+		int* sorted; // the used handles ordered by offset, then gravity
+		int sorted_len;
+		int free_hint; // no handle below this one is free
+};
 
-		memcpy(fb->contents+offset, new_content, len);
-		if (!do_not_callback)
-				call_extension(fb_contents_updated, fb, offset, FB_CONTENT_NORMAL_EDIT);
+static void
+fb_marks_free(struct file_buffer* fb)
+{
+		if (!fb->marks)
+				return;
+		free(fb->marks->marks);
+		free(fb->marks->sorted);
+		free(fb->marks);
+		fb->marks = NULL;
 }
 
-void
-fb_change(struct file_buffer* fb, const char* new_content, const int len, const int offset, int do_not_callback)
+///////////////////////////////////
+// where a position ends up when the removed bytes at offset are replaced
+static int
+mark_shift(int position, int gravity, int offset, int removed, int inserted)
 {
-		soft_assert(offset <= fb->len && offset >= 0, return;);
+		if (position < offset)
+				return position;
+		if (position > offset && position >= offset + removed)
+				return position - removed + inserted;
+		// in the removed text or where the text was inserted
+		return gravity == MARK_RIGHT ? offset + inserted : offset;
+}
 
-		if (offset + len > fb->len) {
-				fb->len = offset + len;
-				if (fb->len >= fb->capacity) {
-						fb->capacity = fb->len + len + 256;
-						fb->contents = xrealloc(fb->contents, fb->capacity);
-				}
+static int
+mark_is_before(const struct fb_mark* a, const struct fb_mark* b)
+{
+		return a->offset < b->offset || (a->offset == b->offset && a->gravity < b->gravity);
+}
+
+// index of the first mark in sorted that isn't before mark
+static int
+marks_search(const struct fb_marks* m, const struct fb_mark* mark)
+{
+		int low = 0, high = m->sorted_len;
+		while (low < high) {
+				int mid = low + (high - low) / 2;
+				if (mark_is_before(m->marks + m->sorted[mid], mark))
+						low = mid + 1;
+				else
+						high = mid;
 		}
+		return low;
+}
 
-		memcpy(fb->contents+offset, new_content, len);
-		if (!do_not_callback)
-				call_extension(fb_contents_updated, fb, offset, FB_CONTENT_NORMAL_EDIT);
+static void
+marks_insert_sorted(struct fb_marks* m, int handle)
+{
+		int index = marks_search(m, m->marks + handle);
+		memmove(m->sorted + index + 1, m->sorted + index, (m->sorted_len - index) * sizeof(int));
+		m->sorted[index] = handle;
+		m->sorted_len++;
 }
 
-int
-fb_remove(struct file_buffer* fb, int offset, int len, int do_not_calculate_charsize, int do_not_callback)
+// index of handle in sorted
+static int
+marks_index(const struct fb_marks* m, int handle)
 {
-		LIMIT(offset, 0, fb->len-1);
-		if (len == 0) return 0;
-		soft_assert(fb->contents, return 0;);
-		soft_assert(offset + len <= fb->len, return 0;);
+		int index = marks_search(m, m->marks + handle);
+		while (index < m->sorted_len && m->sorted[index] != handle)
+				index++;
+		return index;
+}
 
-		int removed_len = 0;
-		if (do_not_calculate_charsize) {
-				removed_len = len;
-		} else {
-				while (len--) {
-						int charsize = utf8_decode_buffer(fb->contents + offset, fb->len - offset, NULL);
-						if (fb->len - charsize < 0)
-								return 0;
-						removed_len += charsize;
+static void
+marks_remove_sorted(struct fb_marks* m, int handle)
+{
+		int index = marks_index(m, handle);
+		soft_assert(index < m->sorted_len, return;);
+		m->sorted_len--;
+		memmove(m->sorted + index, m->sorted + index + 1, (m->sorted_len - index) * sizeof(int));
+}
+
+int
+fb_mark_new(struct file_buffer* fb, int offset, enum mark_gravity gravity)
+{
+		if (!fb->marks) {
+				fb->marks = xmalloc(sizeof(struct fb_marks));
+				*fb->marks = (struct fb_marks){0};
+		}
+		struct fb_marks* m = fb->marks;
+
+		int handle = m->free_hint;
+		while (handle < m->marks_len && m->marks[handle].gravity >= 0)
+				handle++;
+		m->free_hint = handle + 1;
+		if (handle == m->marks_len) {
+				if (m->marks_len == m->marks_capacity) {
+						m->marks_capacity = MAX(m->marks_capacity * 2, 16);
+						m->marks = xrealloc(m->marks, m->marks_capacity * sizeof(struct fb_mark));
+						m->sorted = xrealloc(m->sorted, m->marks_capacity * sizeof(int));
 				}
+				m->marks_len++;
 		}
-		fb->len -= removed_len;
-		memmove(fb->contents+offset, fb->contents+offset+removed_len, fb->len-offset);
-		if (!do_not_callback)
-				call_extension(fb_contents_updated, fb, offset, FB_CONTENT_NORMAL_EDIT);
-		return removed_len;
+		LIMIT(offset, 0, fb->len);
+		m->marks[handle] = (struct fb_mark){.offset = offset, .gravity = gravity};
+		marks_insert_sorted(m, handle);
+		return handle;
 }
 
 void
-wb_copy_ub_to_current(struct window_buffer* wb)
+fb_mark_free(struct file_buffer* fb, int mark)
 {
-		struct file_buffer* fb = get_fb(wb);
-		struct undo_buffer* cub = &fb->ub[fb->current_undo_buffer];
+		soft_assert(fb->marks && mark >= 0 && mark < fb->marks->marks_len, return;);
+		marks_remove_sorted(fb->marks, mark);
+		fb->marks->marks[mark].gravity = -1;
+		fb->marks->free_hint = MIN(fb->marks->free_hint, mark);
+}
+
+int
+fb_mark_offset(const struct file_buffer* fb, int mark)
+{
+		soft_assert(fb->marks && mark >= 0 && mark < fb->marks->marks_len, return 0;);
+		return fb->marks->marks[mark].offset;
+}
 
-		fb->contents = xrealloc(fb->contents, cub->capacity);
-		memcpy(fb->contents, cub->contents, cub->capacity);
-		fb->len = cub->len;
-		fb->capacity = cub->capacity;
+void
+fb_mark_move(struct file_buffer* fb, int mark, int offset)
+{
+		soft_assert(fb->marks && mark >= 0 && mark < fb->marks->marks_len, return;);
+		struct fb_marks* m = fb->marks;
+		LIMIT(offset, 0, fb->len);
+
+		// a mark that doesn't pass any other mark keeps its place in sorted
+		struct fb_mark moved = {.offset = offset, .gravity = m->marks[mark].gravity};
+		int index = marks_index(m, mark);
+		if ((index == 0 || !mark_is_before(&moved, m->marks + m->sorted[index-1])) &&
+		    (index >= m->sorted_len-1 || !mark_is_before(m->marks + m->sorted[index+1], &moved))) {
+				m->marks[mark].offset = offset;
+				return;
+		}
+		marks_remove_sorted(m, mark);
+		m->marks[mark].offset = offset;
+		marks_insert_sorted(m, mark);
+}
 
-		wb_move_to_offset(wb, cub->cursor_offset, CURSOR_SNAPPED);
-		//TODO: remove y_scroll from undo buffer
-		wb->y_scroll = cub->y_scroll;
+static void
+window_node_shift_cursors(struct window_split_node* root, const struct file_buffer* fb,
+                          int offset, int removed, int inserted)
+{
+		if (root->mode == WINDOW_SINGULAR) {
+				struct window_buffer* wb = &root->wb;
+				if (wb != focused_window && wb->fb_index >= 0 && wb->fb_index < available_buffer_slots &&
+				    file_buffers + wb->fb_index == fb)
+						wb->cursor_offset = mark_shift(wb->cursor_offset, MARK_RIGHT, offset, removed, inserted);
+		} else {
+				window_node_shift_cursors(root->node1, fb, offset, removed, inserted);
+				window_node_shift_cursors(root->node2, fb, offset, removed, inserted);
+		}
+}
+
+static void
+fb_marks_shift(struct file_buffer* fb, int offset, int removed, int inserted)
+{
+		struct fb_marks* m = fb->marks;
+		if (m) {
+				struct fb_mark edit = {.offset = offset, .gravity = MARK_LEFT};
+				int first = marks_search(m, &edit);
+				for (int i = first; i < m->sorted_len; i++) {
+						struct fb_mark* mark = m->marks + m->sorted[i];
+						mark->offset = mark_shift(mark->offset, mark->gravity, offset, removed, inserted);
+				}
+				// only the marks that were in the removed text can be out of order
+				for (int i = first + 1; i < m->sorted_len; i++) {
+						int handle = m->sorted[i];
+						int j = i;
+						for (; j > first && mark_is_before(m->marks + handle, m->marks + m->sorted[j-1]); j--)
+								m->sorted[j] = m->sorted[j-1];
+						m->sorted[j] = handle;
+				}
+		}
+		fb->s1o = mark_shift(fb->s1o, MARK_RIGHT, offset, removed, inserted);
+		fb->s2o = mark_shift(fb->s2o, MARK_RIGHT, offset, removed, inserted);
+		window_node_shift_cursors(&root_node, fb, offset, removed, inserted);
+}
+
+///////////////////////////////////
+// where a position ends up after all of the edits, like mark_shift for each
+static int
+mark_shift_edits(int position, int gravity, const struct storage_edit* edits, int count)
+{
+		int delta = 0, i = 0;
+		for (; i < count && edits[i].offset < position && edits[i].offset + edits[i].removed <= position; i++)
+				delta += edits[i].len - edits[i].removed;
+		if (i == count || position < edits[i].offset)
+				return position + delta;
+		return mark_shift(position, gravity, edits[i].offset, edits[i].removed, edits[i].len) + delta;
+}
+
+static void
+window_node_shift_cursors_edits(struct window_split_node* root, const struct file_buffer* fb,
+                                const struct storage_edit* edits, int count)
+{
+		if (root->mode == WINDOW_SINGULAR) {
+				struct window_buffer* wb = &root->wb;
+				if (wb != focused_window && wb->fb_index >= 0 && wb->fb_index < available_buffer_slots &&
+				    file_buffers + wb->fb_index == fb)
+						wb->cursor_offset = mark_shift_edits(wb->cursor_offset, MARK_RIGHT, edits, count);
+		} else {
+				window_node_shift_cursors_edits(root->node1, fb, edits, count);
+				window_node_shift_cursors_edits(root->node2, fb, edits, count);
+		}
+}
+
+// fb_marks_shift for many edits in one pass over the marks
+static void
+fb_marks_shift_edits(struct file_buffer* fb, const struct storage_edit* edits, int count)
+{
+		struct fb_marks* m = fb->marks;
+		if (m) {
+				// the marks are sorted, so the edits before a mark only have to be summed once
+				int delta = 0, e = 0;
+				for (int i = 0; i < m->sorted_len; i++) {
+						struct fb_mark* mark = m->marks + m->sorted[i];
+						for (; e < count && edits[e].offset < mark->offset &&
+						       edits[e].offset + edits[e].removed <= mark->offset; e++)
+								delta += edits[e].len - edits[e].removed;
+						if (e < count && mark->offset >= edits[e].offset)
+								mark->offset = mark_shift(mark->offset, mark->gravity, edits[e].offset, edits[e].removed, edits[e].len);
+						mark->offset += delta;
+				}
+				for (int i = 1; i < m->sorted_len; i++) {
+						int handle = m->sorted[i];
+						int j = i;
+						for (; j > 0 && mark_is_before(m->marks + handle, m->marks + m->sorted[j-1]); j--)
+								m->sorted[j] = m->sorted[j-1];
+						m->sorted[j] = handle;
+				}
+		}
+		fb->s1o = mark_shift_edits(fb->s1o, MARK_RIGHT, edits, count);
+		fb->s2o = mark_shift_edits(fb->s2o, MARK_RIGHT, edits, count);
+		window_node_shift_cursors_edits(&root_node, fb, edits, count);
+}
+
+static void
+fb_contents_edited(struct file_buffer* fb, int offset, int removed, int inserted)
+{
+		fb->version++;
+		call_extension(fb_contents_edited, fb, offset, removed, inserted, fb->version);
+}
+
+///////////////////////////////////
+// called after every edit, fb_contents_updated is called right away
+// or when the transaction it is part of is committed
+static void
+fb_edited_range(struct file_buffer* fb, int offset, int removed, int inserted, int do_not_callback)
+{
+		fb_contents_edited(fb, offset, removed, inserted);
+		if (!fb->transaction_depth) {
+				if (!do_not_callback)
+						call_extension(fb_contents_updated, fb, offset, FB_CONTENT_NORMAL_EDIT);
+				return;
+		}
+
+		if (fb->transaction_start < 0) {
+				fb->transaction_start = offset;
+				fb->transaction_end = offset + inserted;
+				return;
+		}
+		// move the end of the range along with the text it points at
+		int end = fb->transaction_end;
+		if (end >= offset + removed)
+				end -= removed;
+		else if (end > offset)
+				end = offset;
+		if (end >= offset)
+				end += inserted;
+		fb->transaction_start = MIN(fb->transaction_start, offset);
+		fb->transaction_end = MAX(end, offset + inserted);
+}
+
+static void
+fb_edited(struct file_buffer* fb, int offset, int removed, int inserted, int do_not_callback)
+{
+		fb_marks_shift(fb, offset, removed, inserted);
+		fb_edited_range(fb, offset, removed, inserted, do_not_callback);
+}
+
+void
+fb_begin_transaction(struct file_buffer* fb)
+{
+		if (!fb->transaction_depth++)
+				fb->transaction_start = fb->transaction_end = -1;
+}
+
+void
+fb_commit_transaction(struct file_buffer* fb, enum buffer_content_reason reason)
+{
+		soft_assert(fb->transaction_depth > 0, return;);
+		if (--fb->transaction_depth || fb->transaction_start < 0)
+				return;
+		call_extension(fb_contents_updated, fb, fb->transaction_start, reason);
+}
+
+void
+fb_insert(struct file_buffer* fb, const char* new_content, const int len, const int offset, int do_not_callback)
+{
+		soft_assert(fb, return;);
+		soft_assert(fb->storage, return;);
+		soft_assert(offset <= fb->len && offset >= 0,
+					fprintf(stderr, "writing past fb '%s'\n", fb->file_path);
+					return;
+				);
+		if (fb->mode & FB_READ_ONLY) {
+				writef_to_status_bar("buffer is read only");
+				return;
+		}
+
+		undo_record(fb, offset, 0, new_content, len);
+		storage_insert(fb->storage, offset, new_content, len);
+		fb->len = storage_len(fb->storage);
+		fb_column_index_invalidate(fb, offset);
+		fb_edited(fb, offset, 0, len, do_not_callback);
+}
+
+void
+fb_change(struct file_buffer* fb, const char* new_content, const int len, const int offset, int do_not_callback)
+{
+		soft_assert(offset <= fb->len && offset >= 0, return;);
+		if (fb->mode & FB_READ_ONLY) {
+				writef_to_status_bar("buffer is read only");
+				return;
+		}
+
+		int removed = MIN(len, fb->len - offset);
+		undo_record(fb, offset, removed, new_content, len);
+		storage_remove(fb->storage, offset, removed);
+		storage_insert(fb->storage, offset, new_content, len);
+		fb->len = storage_len(fb->storage);
+		fb_column_index_invalidate(fb, offset);
+		fb_edited(fb, offset, removed, len, do_not_callback);
+}
+
+int
+fb_remove(struct file_buffer* fb, int offset, int len, int do_not_calculate_charsize, int do_not_callback)
+{
+		LIMIT(offset, 0, fb->len-1);
+		if (len <= 0 || offset < 0) return 0;
+		soft_assert(fb->storage, return 0;);
+		soft_assert(offset + len <= fb->len, return 0;);
+		if (fb->mode & FB_READ_ONLY) {
+				writef_to_status_bar("buffer is read only");
+				return 0;
+		}
+
+		int removed_len = 0;
+		if (do_not_calculate_charsize) {
+				removed_len = len;
+		} else {
+				while (len--) {
+						int charsize = fb_utf8_decode(fb, offset + removed_len, NULL);
+						if (fb->len - charsize < 0)
+								return 0;
+						removed_len += charsize;
+				}
+		}
+		undo_record(fb, offset, removed_len, NULL, 0);
+		storage_remove(fb->storage, offset, removed_len);
+		fb->len = storage_len(fb->storage);
+		fb_column_index_invalidate(fb, offset);
+		fb_edited(fb, offset, removed_len, 0, do_not_callback);
+		return removed_len;
+}
+
+void
+fb_apply_edits(struct file_buffer* fb, const struct storage_edit* edits, int count, int do_not_callback)
+{
+		if (count <= 0)
+				return;
+		soft_assert(edits[0].offset >= 0 && edits[count-1].offset + edits[count-1].removed <= fb->len, return;);
+		if (fb->mode & FB_READ_ONLY) {
+				writef_to_status_bar("buffer is read only");
+				return;
+		}
+
+		int start = edits[0].offset;
+		int end = edits[count-1].offset + edits[count-1].removed;
+		int old_len = fb->len;
+		// recorded as if applied one after another
+		for (int i = 0, shift = 0; i < count; shift += edits[i].len - edits[i].removed, i++)
+				undo_record_from(fb, edits[i].offset + shift, edits[i].offset, edits[i].removed, edits[i].data, edits[i].len);
+		storage_apply(fb->storage, edits, count);
+		fb->len = storage_len(fb->storage);
+		fb_column_index_invalidate(fb, start);
+		fb_marks_shift_edits(fb, edits, count);
+		// the callbacks see it as one change of everything between the first and last edit
+		fb_edited_range(fb, start, end - start, end - start + fb->len - old_len, do_not_callback);
+}
+
+const char*
+fb_chunk(const struct file_buffer* fb, int offset, int* len)
+{
+		return storage_chunk(fb->storage, offset, len);
+}
+
+char
+fb_char(const struct file_buffer* fb, int offset)
+{
+		int len;
+		const char* chunk = storage_chunk(fb->storage, offset, &len);
+		return chunk ? *chunk : 0;
+}
+
+int
+fb_utf8_decode(const struct file_buffer* fb, int offset, rune_t* u)
+{
+		int len;
+		const char* chunk = storage_chunk(fb->storage, offset, &len);
+		if (!chunk) {
+				if (u)
+						*u = 0;
+				return 0;
+		}
+		if (len >= UTF_SIZ)
+				return utf8_decode_buffer(chunk, len, u);
+
+		// the char might continue in the next chunk
+		char buffer[UTF_SIZ];
+		len = MIN(UTF_SIZ, fb->len - offset);
+		storage_copy(fb->storage, offset, len, buffer);
+		return utf8_decode_buffer(buffer, len, u);
+}
+
+int
+fb_memcmp(const struct file_buffer* fb, int offset, const char* string, int len)
+{
+		if (offset < 0 || offset + len > fb->len)
+				return 1;
+		while (len > 0) {
+				int chunk_len;
+				const char* chunk = storage_chunk(fb->storage, offset, &chunk_len);
+				chunk_len = MIN(chunk_len, len);
+				int res = memcmp(chunk, string, chunk_len);
+				if (res)
+						return res;
+				offset += chunk_len;
+				string += chunk_len;
+				len -= chunk_len;
+		}
+		return 0;
+}
+
+struct fb_span
+fb_span_line(const struct file_buffer* fb, int offset)
+{
+		LIMIT(offset, 0, fb->len);
+		int start = offset;
+		if (!offset || fb_char(fb, offset-1) != '\n')
+				start = MAX(fb_seek_char_backwards(fb, offset, '\n'), 0);
+		int end = fb_seek_char(fb, offset, '\n');
+		return (struct fb_span){.start = start, .end = end < 0 ? fb->len : end};
+}
+
+const char*
+fb_span_next(const struct file_buffer* fb, struct fb_span* it, int* len)
+{
+		if (it->start >= it->end)
+				return NULL;
+		const char* chunk = fb_chunk(fb, it->start, len);
+		if (!chunk)
+				return NULL;
+		*len = MIN(*len, it->end - it->start);
+		it->start += *len;
+		return chunk;
+}
+
+int
+fb_span_copy(const struct file_buffer* fb, struct fb_span span, char* dest, int dest_size)
+{
+		soft_assert(dest_size > 0, return 0;);
+		span.end = MIN(span.end, span.start + dest_size - 1);
+		int copied = 0;
+		const char* chunk;
+		for (int len; (chunk = fb_span_next(fb, &span, &len)); copied += len)
+				memcpy(dest + copied, chunk, len);
+		dest[copied] = 0;
+		return copied;
+}
+
+int
+fb_offset_to_line(const struct file_buffer* fb, int offset)
+{
+		return storage_offset_to_line(fb->storage, offset);
+}
+
+int
+fb_line_to_offset(const struct file_buffer* fb, int line)
+{
+		return storage_line_to_offset(fb->storage, line);
+}
+
+////////////////////////////////////////////////
+// Display columns
+//
+
+#define COLUMN_CHECKPOINT_INTERVAL 4096
+#define COLUMN_INDEX_LINES 16
+
+struct column_checkpoint {
+		int offset;
+		int column;
+		int max_column; // the biggest column any char before offset ended on
+};
+
+struct column_index {
+		int line_start; // -1 if unused
+		int complete;   // walked until the end of the line
+		int count, capacity;
+		struct column_checkpoint* checkpoints;
+		unsigned int last_used;
+};
+
+///////////////////////////////////
+// advances *column past the char at offset, returns the size of the char
+static int
+column_step(const struct file_buffer* fb, int offset, int* column)
+{
+		if (fb_char(fb, offset) == '\t') {
+				if (*column <= 0) *column += 1;
+				while (*column % tabspaces != 0) *column += 1;
+				*column += 1;
+				return 1;
+		}
+		rune_t u;
+		int charsize = fb_utf8_decode(fb, offset, &u);
+		*column += wcwidth(u);
+		return MAX(charsize, 1);
+}
+
+static int
+fb_line_start(const struct file_buffer* fb, int offset)
+{
+		return fb_line_to_offset(fb, fb_offset_to_line(fb, offset));
+}
+
+// only looks at the first len bytes of the line, finding where a line starts or
+// ends through the line count has to scan every line before it in the same piece
+static int
+fb_line_is_shorter_than(const struct file_buffer* fb, int line_start, int len)
+{
+		struct fb_span span = {line_start, MIN(line_start + len, fb->len)};
+		const char* chunk;
+		for (int chunk_len; (chunk = fb_span_next(fb, &span, &chunk_len));)
+				if (memchr(chunk, '\n', chunk_len))
+						return 1;
+		return line_start + len > fb->len;
+}
+
+static void
+fb_column_index_invalidate(struct file_buffer* fb, int offset)
+{
+		if (!fb->column_index)
+				return;
+		for (int i = 0; i < COLUMN_INDEX_LINES; i++) {
+				struct column_index* ci = fb->column_index + i;
+				if (ci->line_start < 0)
+						continue;
+				if (ci->line_start > offset) {
+						ci->line_start = -1;
+						continue;
+				}
+				// everything before offset stayed the same
+				while (ci->count > 1 && ci->checkpoints[ci->count-1].offset > offset)
+						ci->count--;
+				ci->complete = 0;
+		}
+}
+
+static void
+fb_column_index_free(struct file_buffer* fb)
+{
+		if (!fb->column_index)
+				return;
+		for (int i = 0; i < COLUMN_INDEX_LINES; i++)
+				free(fb->column_index[i].checkpoints);
+		free(fb->column_index);
+		fb->column_index = NULL;
+}
+
+static struct column_index*
+fb_get_column_index(struct file_buffer* fb, int line_start)
+{
+		static unsigned int uses;
+		if (!fb->column_index) {
+				fb->column_index = xmalloc(sizeof(struct column_index) * COLUMN_INDEX_LINES);
+				for (int i = 0; i < COLUMN_INDEX_LINES; i++)
+						fb->column_index[i] = (struct column_index){.line_start = -1};
+		}
+
+		struct column_index* oldest = fb->column_index;
+		for (int i = 0; i < COLUMN_INDEX_LINES; i++) {
+				struct column_index* ci = fb->column_index + i;
+				if (ci->line_start == line_start) {
+						ci->last_used = ++uses;
+						return ci;
+				}
+				if (ci->last_used < oldest->last_used)
+						oldest = ci;
+		}
+
+		if (!oldest->checkpoints) {
+				oldest->capacity = 64;
+				oldest->checkpoints = xmalloc(sizeof(struct column_checkpoint) * oldest->capacity);
+		}
+		oldest->line_start = line_start;
+		oldest->complete = 0;
+		oldest->count = 1;
+		oldest->checkpoints[0] = (struct column_checkpoint){line_start, 0, INT_MIN};
+		oldest->last_used = ++uses;
+		return oldest;
+}
+
+///////////////////////////////////
+// adds checkpoints until there is one past offset or one that has reached column
+static void
+column_index_extend(const struct file_buffer* fb, struct column_index* ci, int offset, int column)
+{
+		struct column_checkpoint last = ci->checkpoints[ci->count-1];
+		int next = last.offset + COLUMN_CHECKPOINT_INTERVAL;
+		while (!ci->complete && last.offset <= offset && last.max_column < column) {
+				if (last.offset >= fb->len || fb_char(fb, last.offset) == '\n') {
+						ci->complete = 1;
+						break;
+				}
+				last.offset += column_step(fb, last.offset, &last.column);
+				last.max_column = MAX(last.max_column, last.column);
+
+				if (last.offset >= next) {
+						if (ci->count >= ci->capacity) {
+								ci->capacity *= 2;
+								ci->checkpoints = xrealloc(ci->checkpoints, sizeof(struct column_checkpoint) * ci->capacity);
+						}
+						ci->checkpoints[ci->count++] = last;
+						next = last.offset + COLUMN_CHECKPOINT_INTERVAL;
+				}
+		}
+}
+
+///////////////////////////////////
+// the last checkpoint that is at or before offset and hasn't reached column
+static struct column_checkpoint
+column_index_find(struct file_buffer* fb, int line_start, int offset, int column)
+{
+		if (fb_line_is_shorter_than(fb, line_start, COLUMN_CHECKPOINT_INTERVAL))
+				return (struct column_checkpoint){line_start, 0, INT_MIN};
+
+		struct column_index* ci = fb_get_column_index(fb, line_start);
+		column_index_extend(fb, ci, offset, column);
+
+		int low = 0, high = ci->count - 1;
+		while (low < high) {
+				int mid = high - (high - low) / 2;
+				if (ci->checkpoints[mid].offset <= offset && ci->checkpoints[mid].max_column < column)
+						low = mid;
+				else
+						high = mid - 1;
+		}
+		return ci->checkpoints[low];
+}
+
+int
+fb_offset_to_column(struct file_buffer* fb, int offset)
+{
+		LIMIT(offset, 0, fb->len);
+		struct column_checkpoint cp = column_index_find(fb, fb_line_start(fb, offset), offset, INT_MAX);
+		int column = cp.column;
+		for (int n = cp.offset; n < offset;)
+				n += column_step(fb, n, &column);
+		return column;
+}
+
+int
+fb_column_to_offset(struct file_buffer* fb, int offset, int x)
+{
+		LIMIT(offset, 0, fb->len);
+		struct column_checkpoint cp = column_index_find(fb, fb_line_start(fb, offset), INT_MAX, x);
+
+		offset = cp.offset;
+		int x_counter = cp.column;
+		while (offset < fb->len) {
+				char c = fb_char(fb, offset);
+				if (c == '\t') {
+						offset += column_step(fb, offset, &x_counter);
+						continue;
+				} else if (c == '\n') {
+						break;
+				}
+				int next_x = x_counter;
+				int charsize = column_step(fb, offset, &next_x);
+				if (next_x > x)
+						break;
+				offset += charsize;
+				if (next_x == x)
+						break;
+				x_counter = next_x;
+		}
+		return offset;
+}
+
+int
+fb_column_checkpoint(struct file_buffer* fb, int line_start, int column, int* checkpoint_column)
+{
+		struct column_checkpoint cp = column_index_find(fb, line_start, INT_MAX, column);
+		*checkpoint_column = cp.column;
+		return cp.offset;
+}
+
+///////////////////////////////////
+// undo log, see struct undo_log
+//
+
+// set while undo and redo apply records, so they aren't recorded again
+static int undo_replaying;
+// memory used by the undo logs of all buffers, see fb_undo_memory
+static long undo_total_bytes;
+// the order the steps were made in, the oldest are dropped first
+// steps loaded from the journal count down from 0, older than all the others
+static long undo_serial, undo_loaded_serial;
+
+// the steps this close to the current one are never packed
+#define UNDO_HOT_STEPS 16
+// smaller steps aren't worth packing
+#define UNDO_PACK_MIN 4096
+
+// the data of the records of an old step, back to back and compressed by
+// a worker thread, the records point at nothing until it is unpacked
+struct undo_pack {
+		char* data;
+		int len, unpacked_len; // len == unpacked_len if it didn't get smaller
+		int counted_len; // what it adds to the bytes of its undo_log
+		int done; // set by the worker, read with undo_pack_lock held
+		struct undo_pack* next; // in the queue of the worker
+};
+static pthread_mutex_t undo_pack_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t undo_pack_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t undo_pack_packed = PTHREAD_COND_INITIALIZER;
+static struct undo_pack* undo_pack_queue;
+static struct undo_pack* undo_pack_queue_last;
+static int undo_pack_worker_started;
+
+///////////////////////////////////
+// LZ4 like compression, a sequence is a token with the amount of literals
+// in the high and the match length - 4 in the low nibble (15 meaning more
+// length bytes follow, until one isn't 255), the literals and the 2 byte
+// offset of the match. The last sequence has only literals.
+// returns the compressed length or -1 if it wouldn't be smaller than len
+#define UNDO_HASH_BITS 13
+
+static int
+undo_write_length(unsigned char* out, int o, int cap, int len)
+{
+		for (; len >= 255; len -= 255) {
+				if (o >= cap)
+						return -1;
+				out[o++] = 255;
+		}
+		if (o >= cap)
+				return -1;
+		out[o++] = len;
+		return o;
+}
+
+static int
+undo_write_sequence(unsigned char* out, int o, int cap, const unsigned char* literals, int literal_len, int offset, int match_len)
+{
+		if (o >= cap)
+				return -1;
+		int token_at = o++;
+		out[token_at] = MIN(literal_len, 15) << 4;
+		if (literal_len >= 15 && (o = undo_write_length(out, o, cap, literal_len - 15)) < 0)
+				return -1;
+		if (o + literal_len > cap)
+				return -1;
+		memcpy(out + o, literals, literal_len);
+		o += literal_len;
+		if (!match_len)
+				return o;
+
+		if (o + 2 > cap)
+				return -1;
+		out[o++] = offset & 0xFF;
+		out[o++] = offset >> 8;
+		out[token_at] |= MIN(match_len - 4, 15);
+		if (match_len - 4 >= 15 && (o = undo_write_length(out, o, cap, match_len - 4 - 15)) < 0)
+				return -1;
+		return o;
+}
+
+static int
+undo_compress(const unsigned char* in, int len, unsigned char* out)
+{
+		static int table[1 << UNDO_HASH_BITS]; // only used by the worker
+		for (int i = 0; i < LEN(table); i++)
+				table[i] = -1;
+
+		int pos = 0, literal_start = 0, o = 0, cap = len - 1;
+		while (pos + 4 <= len) {
+				uint32_t sequence;
+				memcpy(&sequence, in + pos, 4);
+				int hash = (sequence * 2654435761u) >> (32 - UNDO_HASH_BITS);
+				int candidate = table[hash];
+				table[hash] = pos;
+				if (candidate < 0 || pos - candidate > 0xFFFF || memcmp(in + candidate, in + pos, 4)) {
+						pos++;
+						continue;
+				}
+				int match_len = 4;
+				while (pos + match_len < len && in[candidate + match_len] == in[pos + match_len])
+						match_len++;
+				o = undo_write_sequence(out, o, cap, in + literal_start, pos - literal_start, pos - candidate, match_len);
+				if (o < 0)
+						return -1;
+				pos += match_len;
+				literal_start = pos;
+		}
+		return undo_write_sequence(out, o, cap, in + literal_start, len - literal_start, 0, 0);
+}
+
+static int
+undo_read_length(const unsigned char* in, int* i)
+{
+		int len = 0, byte;
+		do {
+				byte = in[(*i)++];
+				len += byte;
+		} while (byte == 255);
+		return len;
+}
+
+static void
+undo_decompress(const unsigned char* in, int len, unsigned char* out)
+{
+		int i = 0, o = 0;
+		while (i < len) {
+				int token = in[i++];
+				int literal_len = token >> 4;
+				if (literal_len == 15)
+						literal_len += undo_read_length(in, &i);
+				memcpy(out + o, in + i, literal_len);
+				i += literal_len;
+				o += literal_len;
+				if (i >= len)
+						break;
+
+				int offset = in[i] | in[i+1] << 8;
+				i += 2;
+				int match_len = token & 15;
+				if (match_len == 15)
+						match_len += undo_read_length(in, &i);
+				// the match may overlap the bytes it writes
+				for (match_len += 4; match_len > 0; match_len--, o++)
+						out[o] = out[o - offset];
+		}
+}
+
+static void*
+undo_pack_worker(void* arg)
+{
+		pthread_mutex_lock(&undo_pack_lock);
+		for (;;) {
+				while (!undo_pack_queue)
+						pthread_cond_wait(&undo_pack_queued, &undo_pack_lock);
+				struct undo_pack* p = undo_pack_queue;
+				undo_pack_queue = p->next;
+				if (!undo_pack_queue)
+						undo_pack_queue_last = NULL;
+				pthread_mutex_unlock(&undo_pack_lock);
+
+				char* packed = xmalloc(p->unpacked_len);
+				int len = undo_compress((unsigned char*)p->data, p->unpacked_len, (unsigned char*)packed);
+				if (len > 0) {
+						free(p->data);
+						p->data = xrealloc(packed, len);
+						p->len = len;
+				} else {
+						free(packed);
+				}
+
+				pthread_mutex_lock(&undo_pack_lock);
+				p->done = 1;
+				pthread_cond_broadcast(&undo_pack_packed);
+		}
+		return arg;
+}
+
+static void
+undo_pack_wait(struct undo_pack* p)
+{
+		pthread_mutex_lock(&undo_pack_lock);
+		while (!p->done)
+				pthread_cond_wait(&undo_pack_packed, &undo_pack_lock);
+		pthread_mutex_unlock(&undo_pack_lock);
+}
+
+static void
+undo_account(struct undo_log* u, long bytes)
+{
+		u->bytes += bytes;
+		undo_total_bytes += bytes;
+}
+
+static long
+undo_record_bytes(const struct undo_record* r)
+{
+		return sizeof(struct undo_record) + (r->data ? r->removed + r->inserted : 0);
+}
+
+static void
+undo_free_records(struct undo_log* u, int from, int to)
+{
+		for (int i = from; i < to; i++) {
+				undo_account(u, -undo_record_bytes(u->records + i));
+				free(u->records[i].data);
+		}
+}
+
+static void
+undo_free_pack(struct undo_log* u, struct undo_step* step)
+{
+		if (!step->pack)
+				return;
+		undo_pack_wait(step->pack);
+		undo_account(u, -step->pack->counted_len);
+		free(step->pack->data);
+		free(step->pack);
+		step->pack = NULL;
+}
+
+// the records of step s are from the end of step s-1 to its own end
+static void
+undo_pack_step(struct undo_log* u, int s)
+{
+		struct undo_step* step = u->steps + s;
+		int first = u->steps[s-1].records_end;
+		int len = 0;
+		for (int i = first; i < step->records_end; i++)
+				len += u->records[i].removed + u->records[i].inserted;
+		if (step->pack || len < UNDO_PACK_MIN)
+				return;
+
+		struct undo_pack* p = xmalloc(sizeof(struct undo_pack));
+		*p = (struct undo_pack){.data = xmalloc(len), .len = len, .unpacked_len = len, .counted_len = len};
+		for (int i = first, at = 0; i < step->records_end; i++) {
+				struct undo_record* r = u->records + i;
+				memcpy(p->data + at, r->data, r->removed + r->inserted);
+				at += r->removed + r->inserted;
+				undo_account(u, -undo_record_bytes(r));
+				free(r->data);
+				r->data = NULL;
+				undo_account(u, undo_record_bytes(r));
+		}
+		undo_account(u, len);
+		step->pack = p;
+
+		pthread_mutex_lock(&undo_pack_lock);
+		if (!undo_pack_worker_started) {
+				pthread_t thread;
+				undo_pack_worker_started = pthread_create(&thread, NULL, undo_pack_worker, NULL) == 0;
+				if (undo_pack_worker_started)
+						pthread_detach(thread);
+		}
+		if (undo_pack_worker_started) {
+				if (undo_pack_queue_last)
+						undo_pack_queue_last->next = p;
+				else
+						undo_pack_queue = p;
+				undo_pack_queue_last = p;
+				pthread_cond_signal(&undo_pack_queued);
+		} else {
+				// without a worker it just stays as it is
+				p->done = 1;
+		}
+		pthread_mutex_unlock(&undo_pack_lock);
+}
+
+static void
+undo_unpack_step(struct undo_log* u, int s)
+{
+		struct undo_step* step = u->steps + s;
+		struct undo_pack* p = step->pack;
+		if (!p)
+				return;
+		undo_pack_wait(p);
+		char* data = p->data;
+		if (p->len != p->unpacked_len) {
+				data = xmalloc(p->unpacked_len);
+				undo_decompress((unsigned char*)p->data, p->len, (unsigned char*)data);
+		}
+		for (int i = u->steps[s-1].records_end, at = 0; i < step->records_end; i++) {
+				struct undo_record* r = u->records + i;
+				undo_account(u, -undo_record_bytes(r));
+				r->data = xmalloc(r->removed + r->inserted);
+				memcpy(r->data, data + at, r->removed + r->inserted);
+				at += r->removed + r->inserted;
+				undo_account(u, undo_record_bytes(r));
+		}
+		if (data != p->data)
+				free(data);
+		undo_free_pack(u, step);
+}
+
+// counts the packs the worker is done with at their packed size
+static void
+undo_pack_collect(struct undo_log* u)
+{
+		pthread_mutex_lock(&undo_pack_lock);
+		for (; u->collect_from < u->packed_until; u->collect_from++) {
+				struct undo_pack* p = u->steps[u->collect_from].pack;
+				if (!p)
+						continue;
+				if (!p->done)
+						break;
+				undo_account(u, p->len - p->counted_len);
+				p->counted_len = p->len;
+		}
+		pthread_mutex_unlock(&undo_pack_lock);
+}
+
+static void
+undo_log_free(struct undo_log* u)
+{
+		for (int i = 0; i < u->step_count; i++)
+				undo_free_pack(u, u->steps + i);
+		if (u->step_count)
+				undo_free_records(u, u->steps[0].records_end, u->record_count);
+		free(u->records);
+		free(u->steps);
+		if (u->journal)
+				fclose(u->journal);
+		*u = (struct undo_log){0};
+}
+
+static int
+undo_has_open_records(const struct undo_log* u)
+{
+		return u->record_count > u->steps[u->step_count-1].records_end;
+}
+
+static void
+undo_drop_redo(struct undo_log* u)
+{
+		if (u->current == u->step_count-1)
+				return;
+		for (int i = u->current+1; i < u->step_count; i++)
+				undo_free_pack(u, u->steps + i);
+		undo_free_records(u, u->steps[u->current].records_end, u->record_count);
+		u->record_count = u->steps[u->current].records_end;
+		u->step_count = u->current+1;
+		u->packed_until = MIN(u->packed_until, u->step_count);
+		u->collect_from = MIN(u->collect_from, u->packed_until);
+}
+
+// forgets the oldest state, the records leading away from it with it
+static void
+undo_drop_oldest(struct undo_log* u)
+{
+		undo_free_pack(u, u->steps + 1);
+		undo_free_records(u, u->steps[0].records_end, u->steps[1].records_end);
+		memmove(u->steps, u->steps + 1, (u->step_count-1) * sizeof(struct undo_step));
+		u->step_count--;
+		u->current--;
+		u->packed_until = MAX(u->packed_until-1, 1);
+		u->collect_from = MAX(u->collect_from-1, 1);
+		// what is left doesn't start where any saved history ends
+		u->journal_limit = -1;
+
+		int first = u->steps[0].records_end;
+		if (first > u->record_count / 2) {
+				memmove(u->records, u->records + first, (u->record_count - first) * sizeof(struct undo_record));
+				u->record_count -= first;
+				for (int i = 0; i < u->step_count; i++)
+						u->steps[i].records_end -= first;
+		}
+}
+
+// the last step that was made can always be undone, even if it is bigger
+// than the budget
+static void
+undo_keep_budget(struct undo_log* u)
+{
+		undo_pack_collect(u);
+		while (u->bytes > undo_buffer_budget && u->current > 1)
+				undo_drop_oldest(u);
+
+		if (undo_total_bytes > undo_total_budget)
+				for (int i = 0; i < available_buffer_slots; i++)
+						if (file_buffers[i].undo.step_count)
+								undo_pack_collect(&file_buffers[i].undo);
+		while (undo_total_bytes > undo_total_budget) {
+				struct undo_log* oldest = NULL;
+				for (int i = 0; i < available_buffer_slots; i++) {
+						struct undo_log* other = &file_buffers[i].undo;
+						if (other->step_count && other->current > 1 &&
+						    (!oldest || other->steps[1].serial < oldest->steps[1].serial))
+								oldest = other;
+				}
+				if (u->current > 1 && (!oldest || u->steps[1].serial < oldest->steps[1].serial))
+						oldest = u;
+				if (!oldest)
+						break;
+				undo_drop_oldest(oldest);
+		}
+}
+
+///////////////////////////////////
+// undo journal, the history of a file kept across sessions in
+// undo_journal_dir, one append only file per path. Every change to the
+// undo log is written as an event: a type byte, ints and for records
+// their data
+// 'S'                                     a session starts
+// 'R' offset removed inserted data        undo_record
+// 'P' cursor                              a new step with the open records
+// 'C' cursor                              the open records join the current step
+// 'U' 'D'                                 undo and redo
+// 'W' hash(8 bytes) len                   the contents were saved
+// the history of a session is loaded once undo goes past the start of a
+// later one, from its start to where it saved what the later one opened
+enum undo_journal_event {
+		UNDO_JOURNAL_SESSION = 'S',
+		UNDO_JOURNAL_RECORD = 'R',
+		UNDO_JOURNAL_STEP = 'P',
+		UNDO_JOURNAL_JOIN = 'C',
+		UNDO_JOURNAL_UNDO = 'U',
+		UNDO_JOURNAL_REDO = 'D',
+		UNDO_JOURNAL_SAVED = 'W',
+};
+
+static uint64_t
+undo_hash(const struct file_buffer* fb)
+{
+		// FNV-1a
+		uint64_t hash = 14695981039346656037ULL;
+		for (int offset = 0; offset < fb->len;) {
+				int len;
+				const unsigned char* chunk = (const unsigned char*)fb_chunk(fb, offset, &len);
+				for (int i = 0; i < len; i++)
+						hash = (hash ^ chunk[i]) * 1099511628211ULL;
+				offset += len;
+		}
+		return hash;
+}
+
+static int
+undo_journal_path(const struct file_buffer* fb, char path[PATH_MAX])
+{
+		const char* home = getenv("HOME");
+		if (!undo_journal_dir || !fb->file_path || (*undo_journal_dir != '/' && !home))
+				return 0;
+		uint64_t hash = 14695981039346656037ULL;
+		for (const char* c = fb->file_path; *c; c++)
+				hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+		int len = *undo_journal_dir == '/' ?
+				snprintf(path, PATH_MAX, "%s/%016llx", undo_journal_dir, (unsigned long long)hash) :
+				snprintf(path, PATH_MAX, "%s/%s/%016llx", home, undo_journal_dir, (unsigned long long)hash);
+		return len < PATH_MAX;
+}
+
+// opened by the first event of a session
+static FILE*
+undo_journal_open(struct file_buffer* fb)
+{
+		struct undo_log* u = &fb->undo;
+		if (u->journal || u->journal_failed)
+				return u->journal;
+		char path[PATH_MAX];
+		if (!undo_journal_path(fb, path)) {
+				u->journal_failed = 1;
+				return NULL;
+		}
+		char* dir = file_path_get_path(path);
+		recursive_mkdir(dir);
+		free(dir);
+
+		// the old history is dropped once the journal gets too big
+		struct stat st;
+		int too_big = stat(path, &st) == 0 && st.st_size > undo_journal_max_size;
+		u->journal = fopen(path, too_big ? "wb" : "ab");
+		if (!u->journal) {
+				u->journal_failed = 1;
+				return NULL;
+		}
+		if (too_big && u->journal_limited)
+				u->journal_limit = -1;
+		if (!u->journal_limited) {
+				fseek(u->journal, 0, SEEK_END);
+				u->journal_limit = ftell(u->journal);
+				u->journal_limited = 1;
+		}
+		fputc(UNDO_JOURNAL_SESSION, u->journal);
+		return u->journal;
+}
+
+static void
+undo_journal_write(struct file_buffer* fb, enum undo_journal_event event, const int* values, int count,
+                   const char* data, int len)
+{
+		if (undo_replaying)
+				return;
+		FILE* journal = undo_journal_open(fb);
+		if (!journal)
+				return;
+		fputc(event, journal);
+		if (count)
+				fwrite(values, sizeof(int), count, journal);
+		if (len)
+				fwrite(data, 1, len, journal);
+		// a record is always followed by more
+		if (event != UNDO_JOURNAL_RECORD)
+				fflush(journal);
+}
+
+// hash and len of the contents that were saved, it has to be what fb is at now
+static void
+undo_journal_saved(struct file_buffer* fb, uint64_t hash, int len)
+{
+		if (!fb->undo.step_count)
+				return;
+		int values[3] = {0, 0, len};
+		memcpy(values, &hash, sizeof(hash));
+		undo_journal_write(fb, UNDO_JOURNAL_SAVED, values, 3, NULL, 0);
+}
+
+// like undo_record, but the removed bytes are read from the storage at from
+static void
+undo_record_from(struct file_buffer* fb, int offset, int from, int removed, const char* data, int len)
+{
+		struct undo_log* u = &fb->undo;
+		// the log is started by FB_CONTENT_INIT, without the undo extension nothing is kept
+		if (undo_replaying || !u->step_count || (!removed && !len))
+				return;
+		undo_drop_redo(u);
+
+		if (u->record_count == u->record_capacity) {
+				u->record_capacity = u->record_capacity ? u->record_capacity * 2 : 64;
+				u->records = xrealloc(u->records, u->record_capacity * sizeof(struct undo_record));
+		}
+		struct undo_record* r = u->records + u->record_count++;
+		*r = (struct undo_record) {
+				.offset = offset,
+				.removed = removed,
+				.inserted = len,
+				.data = xmalloc(removed + len),
+		};
+		if (removed)
+				storage_copy(fb->storage, from, removed, r->data);
+		if (len)
+				memcpy(r->data + removed, data, len);
+		undo_account(u, undo_record_bytes(r));
+		undo_journal_write(fb, UNDO_JOURNAL_RECORD, (int[]){offset, removed, len}, 3, r->data, removed + len);
+}
+
+static void
+undo_record(struct file_buffer* fb, int offset, int removed, const char* data, int len)
+{
+		undo_record_from(fb, offset, offset, removed, data, len);
+}
+
+// the steps that got old are packed in the background
+static void
+undo_pack_old_steps(struct undo_log* u)
+{
+		for (; u->packed_until < u->current - UNDO_HOT_STEPS; u->packed_until++)
+				undo_pack_step(u, u->packed_until);
+}
+
+static void
+undo_push_step(struct undo_log* u, int cursor_offset, int y_scroll)
+{
+		if (u->step_count == u->step_capacity) {
+				u->step_capacity = u->step_capacity ? u->step_capacity * 2 : 16;
+				u->steps = xrealloc(u->steps, u->step_capacity * sizeof(struct undo_step));
+		}
+		u->steps[u->step_count++] = (struct undo_step) {
+				.records_end = u->record_count,
+				.cursor_offset = cursor_offset,
+				.y_scroll = y_scroll,
+				.serial = undo_serial++,
+		};
+		u->current = u->step_count-1;
+		undo_pack_old_steps(u);
+}
+
+static int
+undo_journal_read(FILE* journal, void* dest, int len)
+{
+		return (int)fread(dest, 1, len, journal) == len;
+}
+
+// replays the events from the start of a session until end into a log
+// of its own, as if the session had happened right now
+static void
+undo_journal_replay_start(struct undo_log* log)
+{
+		*log = (struct undo_log){0};
+		undo_push_step(log, 0, -1);
+		log->packed_until = log->collect_from = 1;
+}
+
+static int
+undo_journal_replay(FILE* journal, long start, long end, struct undo_log* log)
+{
+		// undos into history the session loaded from an older one
+		int below = 0;
+		undo_journal_replay_start(log);
+		fseek(journal, start, SEEK_SET);
+		while (ftell(journal) < end) {
+				int event = fgetc(journal);
+				int values[3];
+				if (event == UNDO_JOURNAL_RECORD) {
+						if (!undo_journal_read(journal, values, sizeof(values)) || values[1] < 0 || values[2] < 0)
+								return 0;
+						// edits from there on start at contents older than the session
+						if (below) {
+								undo_log_free(log);
+								undo_journal_replay_start(log);
+								below = 0;
+						}
+						undo_drop_redo(log);
+						if (log->record_count == log->record_capacity) {
+								log->record_capacity = log->record_capacity ? log->record_capacity * 2 : 64;
+								log->records = xrealloc(log->records, log->record_capacity * sizeof(struct undo_record));
+						}
+						struct undo_record* r = log->records + log->record_count++;
+						*r = (struct undo_record){values[0], values[1], values[2], xmalloc(values[1] + values[2])};
+						undo_account(log, undo_record_bytes(r));
+						if (!undo_journal_read(journal, r->data, r->removed + r->inserted))
+								return 0;
+				} else if (event == UNDO_JOURNAL_STEP || event == UNDO_JOURNAL_JOIN) {
+						if (!undo_journal_read(journal, values, sizeof(int)))
+								return 0;
+						if (event == UNDO_JOURNAL_STEP || log->current == 0) {
+								undo_push_step(log, values[0], -1);
+						} else {
+								log->steps[log->current].records_end = log->record_count;
+								log->steps[log->current].cursor_offset = values[0];
+						}
+				} else if (event == UNDO_JOURNAL_UNDO) {
+						if (log->current > 0)
+								log->current--;
+						else
+								below++;
+				} else if (event == UNDO_JOURNAL_REDO) {
+						if (below)
+								below--;
+						else if (log->current < log->step_count-1)
+								log->current++;
+				} else if (event == UNDO_JOURNAL_SAVED) {
+						if (!undo_journal_read(journal, values, sizeof(values)))
+								return 0;
+				} else if (event != UNDO_JOURNAL_SESSION) {
+						return 0;
+				}
+		}
+		// the saved contents have the edits that weren't made a step yet
+		if (undo_has_open_records(log))
+				undo_push_step(log, log->steps[log->current].cursor_offset, -1);
+		undo_drop_redo(log);
+		return 1;
+}
+
+// the history that led to the contents fb is at when it is at steps[0],
+// from the last session before journal_limit that saved those contents
+static int
+undo_journal_load(struct file_buffer* fb)
+{
+		struct undo_log* u = &fb->undo;
+		char path[PATH_MAX];
+		if (u->journal_limit < 0 || !undo_journal_path(fb, path))
+				return 0;
+		FILE* journal = fopen(path, "rb");
+		if (!journal)
+				return 0;
+		if (u->journal)
+				fflush(u->journal);
+		fseek(journal, 0, SEEK_END);
+		long limit = u->journal_limited ? u->journal_limit : ftell(journal);
+		fseek(journal, 0, SEEK_SET);
+
+		uint64_t hash = undo_hash(fb);
+		long session = -1, found_session = -1, found_end = -1;
+		while (ftell(journal) < limit) {
+				long at = ftell(journal);
+				int event = fgetc(journal);
+				int values[3];
+				if (event == UNDO_JOURNAL_SESSION) {
+						session = at;
+				} else if (event == UNDO_JOURNAL_RECORD) {
+						if (!undo_journal_read(journal, values, sizeof(values)))
+								break;
+						fseek(journal, (long)values[1] + values[2], SEEK_CUR);
+				} else if (event == UNDO_JOURNAL_STEP || event == UNDO_JOURNAL_JOIN) {
+						fseek(journal, sizeof(int), SEEK_CUR);
+				} else if (event == UNDO_JOURNAL_SAVED) {
+						if (!undo_journal_read(journal, values, sizeof(values)))
+								break;
+						if (session >= 0 && !memcmp(values, &hash, sizeof(hash)) && values[2] == fb->len) {
+								found_session = session;
+								found_end = ftell(journal);
+						}
+				} else if (event != UNDO_JOURNAL_UNDO && event != UNDO_JOURNAL_REDO) {
+						break;
+				}
+		}
+
+		struct undo_log log;
+		int loaded = found_session >= 0 && undo_journal_replay(journal, found_session, found_end, &log);
+		fclose(journal);
+		if (found_session >= 0 && !loaded)
+				undo_log_free(&log);
+		if (!loaded) {
+				u->journal_limit = -1;
+				return 0;
+		}
+
+		// the steps of log come before the ones of u, its last one is the state u starts at
+		int first = u->steps[0].records_end;
+		int records = log.record_count + u->record_count - first;
+		log.records = xrealloc(log.records, MAX(records, 1) * sizeof(struct undo_record));
+		if (u->record_count > first)
+				memcpy(log.records + log.record_count, u->records + first, (u->record_count - first) * sizeof(struct undo_record));
+		int steps = log.current + u->step_count;
+		log.steps = xrealloc(log.steps, steps * sizeof(struct undo_step));
+		memcpy(log.steps + log.current, u->steps, u->step_count * sizeof(struct undo_step));
+		for (int i = log.current; i < steps; i++)
+				log.steps[i].records_end += log.record_count - first;
+		for (int i = log.current-1; i >= 0; i--)
+				log.steps[i].serial = --undo_loaded_serial;
+
+		free(u->records);
+		free(u->steps);
+		u->records = log.records;
+		u->record_count = u->record_capacity = records;
+		u->steps = log.steps;
+		u->step_count = u->step_capacity = steps;
+		// the steps of log from where it stopped packing on are packed
+		// now, the ones of u that already are are skipped
+		u->collect_from = MIN(log.collect_from, u->collect_from + log.current);
+		u->packed_until = log.packed_until;
+		u->current += log.current;
+		u->bytes += log.bytes;
+		u->journal_limit = found_session;
+		u->journal_limited = 1;
+		undo_pack_old_steps(u);
+		undo_keep_budget(u);
+		return 1;
+}
+
+// the k-th edit of replaying the records from first to end, backwards and
+// inverted when undoing
+static struct storage_edit
+undo_edit(const struct undo_log* u, int first, int end, int k, int undo)
+{
+		if (undo) {
+				const struct undo_record* r = u->records + end-1 - k;
+				return (struct storage_edit){r->offset, r->inserted, r->data, r->removed};
+		}
+		const struct undo_record* r = u->records + first + k;
+		return (struct storage_edit){r->offset, r->removed, r->data + r->removed, r->inserted};
+}
+
+static void
+undo_replay(struct file_buffer* fb, int first, int end, int undo)
+{
+		static struct storage_edit* edits;
+		static int edits_capacity;
+		static char* data;
+		static int data_capacity;
+
+		struct undo_log* u = &fb->undo;
+		int count = end - first;
+		undo_replaying = 1;
+		for (int k = 0; k < count;) {
+				// the records happen one after another, a run of them moving in one
+				// direction through the buffer is applied as one fb_apply_edits
+				struct storage_edit prev = undo_edit(u, first, end, k, undo);
+				int run_end = k+1, direction = 0, data_len = prev.len;
+				for (; run_end < count; run_end++) {
+						struct storage_edit e = undo_edit(u, first, end, run_end, undo);
+						if (direction >= 0 && e.offset >= prev.offset + prev.len)
+								direction = 1;
+						else if (direction <= 0 && e.offset + e.removed <= prev.offset)
+								direction = -1;
+						else
+								break;
+						data_len += e.len;
+						prev = e;
+				}
+				if (run_end - k > edits_capacity) {
+						edits_capacity = run_end - k;
+						edits = xrealloc(edits, edits_capacity * sizeof(struct storage_edit));
+				}
+				if (data_len > data_capacity) {
+						data_capacity = data_len;
+						data = xrealloc(data, data_capacity);
+				}
+
+				// sorted by offset, with offsets from before the run and the
+				// edits that touch merged so no two of them start at the same offset
+				int n = 0, shift = 0, data_used = 0;
+				for (int i = 0; i < run_end - k; i++) {
+						struct storage_edit e = undo_edit(u, first, end, direction < 0 ? run_end-1 - i : k + i, undo);
+						if (direction >= 0) {
+								e.offset -= shift;
+								shift += e.len - e.removed;
+						}
+						if (e.len)
+								memcpy(data + data_used, e.data, e.len);
+						if (n && e.offset == edits[n-1].offset + edits[n-1].removed) {
+								edits[n-1].removed += e.removed;
+								edits[n-1].len += e.len;
+						} else {
+								edits[n++] = (struct storage_edit){e.offset, e.removed, data + data_used, e.len};
+						}
+						data_used += e.len;
+				}
+				fb_apply_edits(fb, edits, n, 1);
+				k = run_end;
+		}
+		undo_replaying = 0;
 }
 
+static void
+undo_restore_cursor(struct file_buffer* fb)
+{
+		struct undo_step* step = fb->undo.steps + fb->undo.current;
+		if (focused_window && get_fb(focused_window) == fb) {
+				wb_move_to_offset(focused_window, step->cursor_offset, CURSOR_SNAPPED);
+				//TODO: remove y_scroll from undo step
+				// it isn't known for steps loaded from the journal
+				if (step->y_scroll >= 0)
+						focused_window->y_scroll = step->y_scroll;
+		}
+}
 
 void
 fb_undo(struct file_buffer* fb)
 {
-		if (fb->current_undo_buffer == 0) {
+		struct undo_log* u = &fb->undo;
+		if (!u->step_count)
+				return;
+		// edits no fb_contents_updated has been called for yet are undone on their own
+		if (undo_has_open_records(u)) {
+				undo_push_step(u, u->steps[u->current].cursor_offset, u->steps[u->current].y_scroll);
+				undo_journal_write(fb, UNDO_JOURNAL_STEP, &u->steps[u->current].cursor_offset, 1, NULL, 0);
+		}
+		while (u->current == 0 && undo_journal_load(fb))
+				;
+		if (u->current == 0) {
 				writef_to_status_bar("end of undo buffer");
 				return;
 		}
-		fb->current_undo_buffer--;
-		fb->available_redo_buffers++;
+		undo_unpack_step(u, u->current);
+		undo_replay(fb, u->steps[u->current-1].records_end, u->steps[u->current].records_end, 1);
+		u->current--;
+		undo_journal_write(fb, UNDO_JOURNAL_UNDO, NULL, 0, NULL, 0);
 
-		wb_copy_ub_to_current(focused_window);
+		undo_restore_cursor(fb);
 		writef_to_status_bar("undo");
 }
 
 void
 fb_redo(struct file_buffer* fb)
 {
-		if (fb->available_redo_buffers == 0) {
+		struct undo_log* u = &fb->undo;
+		if (!u->step_count || u->current == u->step_count-1) {
 				writef_to_status_bar("end of redo buffer");
 				return;
 		}
-		fb->available_redo_buffers--;
-		fb->current_undo_buffer++;
+		u->current++;
+		undo_unpack_step(u, u->current);
+		undo_replay(fb, u->steps[u->current-1].records_end, u->steps[u->current].records_end, 0);
+		undo_journal_write(fb, UNDO_JOURNAL_REDO, NULL, 0, NULL, 0);
 
-		wb_copy_ub_to_current(focused_window);
+		undo_restore_cursor(fb);
 		writef_to_status_bar("redo");
 }
 
@@ -436,13 +2544,20 @@ fb_add_to_undo(struct file_buffer* fb, int offset, enum buffer_content_reason re
 		static time_t last_normal_edit;
 		static int edits;
 
-		if (reason == FB_CONTENT_CURSOR_MOVE) {
-				struct undo_buffer* cub = &fb->ub[fb->current_undo_buffer];
-				cub->cursor_offset = offset;
-				if (focused_window)
-						cub->y_scroll = focused_window->y_scroll;
-				else
-						cub->y_scroll = 0;
+		struct undo_log* u = &fb->undo;
+		int y_scroll = focused_window ? focused_window->y_scroll : 0;
+		if (reason == FB_CONTENT_INIT) {
+				undo_log_free(u);
+				undo_push_step(u, offset, y_scroll);
+				u->packed_until = u->collect_from = 1;
+				return;
+		}
+		if (!u->step_count)
+				return;
+		struct undo_step* step = u->steps + u->current;
+		if (reason == FB_CONTENT_CURSOR_MOVE || !undo_has_open_records(u)) {
+				step->cursor_offset = offset;
+				step->y_scroll = y_scroll;
 				return;
 		}
 
@@ -450,37 +2565,36 @@ fb_add_to_undo(struct file_buffer* fb, int offset, enum buffer_content_reason re
 				time_t previous_time = last_normal_edit;
 				last_normal_edit = time(NULL);
 
-				if (last_normal_edit - previous_time < 2 && edits < 30) {
+				if (last_normal_edit - previous_time < 2 && edits < 30 && u->current > 0) {
 						edits++;
-						goto copy_undo_buffer;
+						step->records_end = u->record_count;
+						step->cursor_offset = offset;
+						step->y_scroll = y_scroll;
+						undo_journal_write(fb, UNDO_JOURNAL_JOIN, &offset, 1, NULL, 0);
+						undo_keep_budget(u);
+						return;
 				} else {
 						edits = 0;
 				}
-		} else if (reason == FB_CONTENT_INIT) {
-				goto copy_undo_buffer;
-		}
-
-		fb->available_redo_buffers = 0;
-		if (fb->current_undo_buffer == UNDO_BUFFERS_COUNT-1) {
-				char* begin_buffer = fb->ub[0].contents;
-				memmove(fb->ub, &(fb->ub[1]), (UNDO_BUFFERS_COUNT-1) * sizeof(struct undo_buffer));
-				fb->ub[fb->current_undo_buffer].contents = begin_buffer;
-		} else {
-				fb->current_undo_buffer++;
 		}
+		undo_push_step(u, offset, y_scroll);
+		undo_journal_write(fb, UNDO_JOURNAL_STEP, &offset, 1, NULL, 0);
+		undo_keep_budget(u);
+}
 
-copy_undo_buffer: ;
-		struct undo_buffer* cub = fb->ub + fb->current_undo_buffer;
+long
+fb_undo_memory(struct file_buffer* fb)
+{
+		if (!fb->undo.step_count)
+				return 0;
+		undo_pack_collect(&fb->undo);
+		return fb->undo.bytes;
+}
 
-		cub->contents = xrealloc(cub->contents, fb->capacity);
-		memcpy(cub->contents, fb->contents, fb->capacity);
-		cub->len = fb->len;
-		cub->capacity = fb->capacity;
-		cub->cursor_offset = offset;
-		if (focused_window)
-				cub->y_scroll = focused_window->y_scroll;
-		else
-				cub->y_scroll = 0;
+long
+undo_memory_total(void)
+{
+		return undo_total_bytes;
 }
 
 
@@ -490,7 +2604,7 @@ fb_get_string_between_offsets(struct file_buffer* fb, int start, int end)
 		int len = end - start;
 
 		char* string = xmalloc(len + 1);
-		memcpy(string, fb->contents+start, len);
+		storage_copy(fb->storage, start, len, string);
 		string[len] = 0;
 		return string;
 }
@@ -501,6 +2615,30 @@ fb_get_selection(struct file_buffer* fb, int* selection_len)
 		if (!(fb->mode & FB_SELECTION_ON))
 				return NULL;
 
+		if (fb->mode & FB_BLOCK_SELECT) {
+				int first_line, last_line, left, right;
+				fb_get_block(fb, &first_line, &last_line, &left, &right);
+				int len = 0, capacity = 64;
+				char* string = xmalloc(capacity);
+				int line_start = fb_line_to_offset(fb, first_line);
+				for (int line = first_line; line <= last_line; line++) {
+						struct fb_span span = fb_block_span(fb, line_start, left, right, NULL, NULL);
+						line_start = fb_seek_char(fb, span.end, '\n') + 1;
+						int needed = len + (span.end - span.start) + 2;
+						if (needed > capacity) {
+								capacity = MAX(capacity * 2, needed);
+								string = xrealloc(string, capacity);
+						}
+						len += fb_span_copy(fb, span, string + len, capacity - len);
+						if (line < last_line)
+								string[len++] = '\n';
+				}
+				string[len] = 0;
+				if (selection_len)
+						*selection_len = len;
+				return string;
+		}
+
 		int start, end;
 		if (fb_is_selection_start_top_left(fb)) {
 				start = fb->s1o;
@@ -527,6 +2665,11 @@ fb_remove_selection(struct file_buffer* buffer)
 		if (!(buffer->mode & FB_SELECTION_ON))
 				return;
 
+		if (buffer->mode & FB_BLOCK_SELECT) {
+				fb_fill_block(buffer, NULL, 0);
+				return;
+		}
+
 		int start, end, len;
 		if (fb_is_selection_start_top_left(buffer)) {
 				start = buffer->s1o;
@@ -536,8 +2679,590 @@ fb_remove_selection(struct file_buffer* buffer)
 				end = buffer->s1o+1;
 		}
 		len = end - start;
+		fb_begin_transaction(buffer);
 		fb_remove(buffer, start, len, 1, 1);
-		call_extension(fb_contents_updated, buffer, start, FB_CONTENT_BIG_CHANGE);
+		fb_commit_transaction(buffer, FB_CONTENT_BIG_CHANGE);
+}
+
+void
+fb_get_block(struct file_buffer* fb, int* first_line, int* last_line, int* left, int* right)
+{
+		int corners[2] = {fb->s1o, fb->s2o};
+		int lines[2], columns[2], ends[2];
+		for (int i = 0; i < 2; i++) {
+				int offset = corners[i];
+				LIMIT(offset, 0, fb->len);
+				lines[i] = fb_offset_to_line(fb, offset);
+				columns[i] = ends[i] = fb_offset_to_column(fb, offset);
+				if (offset < fb->len && fb_char(fb, offset) != '\n')
+						column_step(fb, offset, ends + i);
+				else
+						ends[i]++;
+		}
+		*first_line = MIN(lines[0], lines[1]);
+		*last_line = MAX(lines[0], lines[1]);
+		*left = MIN(columns[0], columns[1]);
+		*right = MAX(ends[0], ends[1]);
+}
+
+struct fb_span
+fb_block_span(struct file_buffer* fb, int line_start, int left, int right, int* span_left, int* span_right)
+{
+		int column;
+		int offset = fb_column_checkpoint(fb, line_start, left, &column);
+		struct fb_span span = {offset, offset};
+		int start_column = column;
+		while (offset < fb->len && column < right && fb_char(fb, offset) != '\n') {
+				int next = column;
+				int charsize = column_step(fb, offset, &next);
+				if (next <= left) {
+						span.start = offset + charsize;
+						start_column = next;
+				}
+				offset += charsize;
+				column = next;
+		}
+		span.end = offset;
+		if (span_left)
+				*span_left = start_column;
+		if (span_right)
+				*span_right = MAX(column, start_column);
+		return span;
+}
+
+void
+fb_fill_block(struct file_buffer* fb, const char* c, int len)
+{
+		int first_line, last_line, left, right;
+		fb_get_block(fb, &first_line, &last_line, &left, &right);
+
+		struct storage_edit* edits = xmalloc((last_line - first_line + 1) * sizeof(struct storage_edit));
+		int count = 0, widest = 0;
+		int line_start = fb_line_to_offset(fb, first_line);
+		for (int line = first_line; line <= last_line; line++) {
+				int span_left, span_right;
+				struct fb_span span = fb_block_span(fb, line_start, left, right, &span_left, &span_right);
+				line_start = fb_seek_char(fb, span.end, '\n') + 1;
+				if (span.end > span.start) {
+						// a tab or wide char becomes one c for every column it took up
+						edits[count++] = (struct storage_edit){
+								.offset = span.start, .removed = span.end - span.start,
+								.len = len > 0 ? (span_right - span_left) * len : 0,
+						};
+						widest = MAX(widest, span_right - span_left);
+				}
+		}
+
+		char* fill = NULL;
+		if (len > 0) {
+				fill = xmalloc(MAX(widest, 1) * len);
+				for (int i = 0; i < widest; i++)
+						memcpy(fill + i * len, c, len);
+				for (int i = 0; i < count; i++)
+						edits[i].data = fill;
+		}
+		fb_begin_transaction(fb);
+		fb_apply_edits(fb, edits, count, 0);
+		fb_commit_transaction(fb, FB_CONTENT_BIG_CHANGE);
+		free(edits);
+		free(fill);
+}
+
+void
+fb_text_append(struct fb_text* text, const char* data, int len)
+{
+		if (text->len + len > text->capacity) {
+				text->capacity = MAX(text->capacity * 2, text->len + len + 256);
+				text->data = xrealloc(text->data, text->capacity);
+		}
+		if (len > 0)
+				memcpy(text->data + text->len, data, len);
+		text->len += len;
+}
+
+// kept between calls so transforming doesn't allocate every time,
+// big ones are given back afterwards
+static struct fb_text transform_out, transform_line;
+#define TRANSFORM_KEEP_CAPACITY (1<<20)
+
+int
+fb_transform_lines(struct file_buffer* fb, int first_line, int last_line, fb_line_transform transform, void* data)
+{
+		if (fb->mode & FB_READ_ONLY) {
+				writef_to_status_bar("buffer is read only");
+				return 0;
+		}
+		int offset = fb_line_to_offset(fb, first_line);
+		if (offset < 0)
+				return 0;
+
+		// out only gets the lines from the first changed one and on,
+		// the unchanged lines after the last changed one are cut off at the end
+		struct fb_text* out = &transform_out;
+		out->len = 0;
+		int changed = 0, start = -1, end = -1, out_end = 0;
+		for (int line = first_line; line <= last_line; line++) {
+				int line_end = fb_seek_char(fb, offset, '\n');
+				if (line_end < 0)
+						line_end = fb->len;
+				int len = line_end - offset;
+
+				// a line inside one chunk is passed in place, others are put together first
+				int chunk_len = 0;
+				const char* text = len ? fb_chunk(fb, offset, &chunk_len) : "";
+				if (chunk_len < len) {
+						transform_line.len = 0;
+						struct fb_span it = {offset, line_end};
+						const char* part;
+						for (int n; (part = fb_span_next(fb, &it, &n)); )
+								fb_text_append(&transform_line, part, n);
+						text = transform_line.data;
+				}
+
+				int out_start = out->len;
+				int is_changed = transform(out, text, len, offset, data);
+				if (is_changed && out->len - out_start == len &&
+					(!len || !memcmp(out->data + out_start, text, len)))
+						is_changed = 0;
+
+				if (is_changed) {
+						if (start < 0)
+								start = offset;
+						end = line_end;
+						out_end = out->len;
+						changed++;
+				} else {
+						out->len = out_start;
+						if (start >= 0)
+								fb_text_append(out, text, len);
+				}
+				if (line_end >= fb->len)
+						break;
+				if (start >= 0)
+						fb_text_append(out, "\n", 1);
+				offset = line_end + 1;
+		}
+
+		if (changed) {
+				struct storage_edit edit = {.offset = start, .removed = end - start, .data = out->data, .len = out_end};
+				fb_begin_transaction(fb);
+				fb_apply_edits(fb, &edit, 1, 0);
+				fb_commit_transaction(fb, FB_CONTENT_BIG_CHANGE);
+		}
+
+		struct fb_text* scratch[2] = {&transform_out, &transform_line};
+		for (int i = 0; i < 2; i++) {
+				if (scratch[i]->capacity > TRANSFORM_KEEP_CAPACITY) {
+						free(scratch[i]->data);
+						*scratch[i] = (struct fb_text){0};
+				}
+		}
+		return changed;
+}
+
+struct sort_line {
+		int start, len; // in sort_context.text
+		int key; // where the compared part of the line starts
+		double number;
+};
+
+struct sort_context {
+		const char* text;
+		int flags;
+};
+
+// ranges with less lines than this are sorted on one thread
+#define SORT_PARALLEL_LINES (1<<16)
+#define SORT_MAX_THREADS 8
+
+static int
+sort_compare(const struct sort_context* c, const struct sort_line* a, const struct sort_line* b)
+{
+		int res = 0;
+		if (c->flags & FB_SORT_NUMERIC && a->number != b->number)
+				res = a->number < b->number ? -1 : 1;
+		if (!res) {
+				int a_len = a->len - a->key, b_len = b->len - b->key;
+				res = memcmp(c->text + a->start + a->key, c->text + b->start + b->key, MIN(a_len, b_len));
+				if (!res)
+						res = a_len - b_len;
+		}
+		return c->flags & FB_SORT_REVERSE ? -res : res;
+}
+
+// merges the sorted lines before and after mid, tmp needs room for mid lines
+static void
+sort_merge(const struct sort_context* c, struct sort_line* lines, struct sort_line* tmp, int mid, int n)
+{
+		if (mid <= 0 || mid >= n || sort_compare(c, &lines[mid-1], &lines[mid]) <= 0)
+				return;
+		memcpy(tmp, lines, mid * sizeof(struct sort_line));
+		int i = 0, j = mid, k = 0;
+		while (i < mid && j < n)
+				lines[k++] = sort_compare(c, &lines[j], &tmp[i]) < 0 ? lines[j++] : tmp[i++];
+		while (i < mid)
+				lines[k++] = tmp[i++];
+}
+
+static void
+sort_range(const struct sort_context* c, struct sort_line* lines, struct sort_line* tmp, int n)
+{
+		if (n <= 16) {
+				for (int i = 1; i < n; i++) {
+						struct sort_line line = lines[i];
+						int j = i;
+						for (; j > 0 && sort_compare(c, &line, &lines[j-1]) < 0; j--)
+								lines[j] = lines[j-1];
+						lines[j] = line;
+				}
+				return;
+		}
+		int mid = n / 2;
+		sort_range(c, lines, tmp, mid);
+		sort_range(c, lines + mid, tmp + mid, n - mid);
+		sort_merge(c, lines, tmp, mid, n);
+}
+
+// one part of the lines for a thread, sorted if mid is 0, otherwise merged at mid
+struct sort_job {
+		const struct sort_context* c;
+		struct sort_line* lines;
+		struct sort_line* tmp;
+		int mid, n;
+};
+
+static void*
+sort_job_run(void* data)
+{
+		struct sort_job* job = data;
+		if (job->mid)
+				sort_merge(job->c, job->lines, job->tmp, job->mid, job->n);
+		else
+				sort_range(job->c, job->lines, job->tmp, job->n);
+		return NULL;
+}
+
+// runs the first job on this thread and the others on their own
+static void
+sort_run_jobs(struct sort_job* jobs, int count)
+{
+		pthread_t threads[SORT_MAX_THREADS];
+		int started[SORT_MAX_THREADS] = {0};
+		for (int i = 1; i < count; i++)
+				started[i] = pthread_create(&threads[i], NULL, sort_job_run, &jobs[i]) == 0;
+		if (count)
+				sort_job_run(&jobs[0]);
+		for (int i = 1; i < count; i++) {
+				if (started[i])
+						pthread_join(threads[i], NULL);
+				else
+						sort_job_run(&jobs[i]);
+		}
+}
+
+static void
+sort_lines(const struct sort_context* c, struct sort_line* lines, int n)
+{
+		struct sort_line* tmp = xmalloc(MAX(n, 1) * sizeof(struct sort_line));
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		int parts = n < SORT_PARALLEL_LINES ? 1 : MIN(MAX(cpus, 1), SORT_MAX_THREADS);
+		int bounds[SORT_MAX_THREADS+1];
+		for (int i = 0; i <= parts; i++)
+				bounds[i] = (int)((long long)n * i / parts);
+
+		// every part is sorted on its own thread, then neighbouring
+		// parts are merged in parallel until there is only one left
+		for (int merging = 0; ; merging = 1) {
+				struct sort_job jobs[SORT_MAX_THREADS];
+				int job_count = 0, merged = 0;
+				for (int i = 0; i < parts; i += merging ? 2 : 1) {
+						int start = bounds[i];
+						bounds[merged++] = start;
+						if (merging && i+1 >= parts)
+								continue;
+						int end = bounds[i + (merging ? 2 : 1)];
+						int mid = merging ? bounds[i+1] - start : 0;
+						jobs[job_count++] = (struct sort_job){c, lines + start, tmp + start, mid, end - start};
+				}
+				bounds[merged] = n;
+				sort_run_jobs(jobs, job_count);
+				parts = merged;
+				if (parts <= 1)
+						break;
+		}
+		free(tmp);
+}
+
+static double
+sort_parse_number(const char* s, int len)
+{
+		int i = 0, negative = 0;
+		while (i < len && (s[i] == ' ' || s[i] == '\t'))
+				i++;
+		if (i < len && (s[i] == '-' || s[i] == '+'))
+				negative = s[i++] == '-';
+		double number = 0, scale = 0;
+		for (; i < len; i++) {
+				if (s[i] == '.' && !scale) {
+						scale = 1;
+				} else if (s[i] >= '0' && s[i] <= '9') {
+						number = number * 10 + (s[i] - '0');
+						if (scale)
+								scale *= 10;
+				} else {
+						break;
+				}
+		}
+		if (scale)
+				number /= scale;
+		return negative ? -number : number;
+}
+
+// the offset of the column'th blank separated field of the line, or its length if it has less
+static int
+sort_line_key(const char* line, int len, int column)
+{
+		int i = 0;
+		for (int field = 1; field < column && i < len; field++) {
+				while (i < len && (line[i] == ' ' || line[i] == '\t'))
+						i++;
+				while (i < len && line[i] != ' ' && line[i] != '\t')
+						i++;
+		}
+		if (column > 1)
+				while (i < len && (line[i] == ' ' || line[i] == '\t'))
+						i++;
+		return i;
+}
+
+int
+fb_sort_lines(struct file_buffer* fb, int first_line, int last_line, int flags, int column)
+{
+		if (fb->mode & FB_READ_ONLY) {
+				writef_to_status_bar("buffer is read only");
+				return 0;
+		}
+		int start = fb_line_to_offset(fb, first_line);
+		if (start < 0)
+				return 0;
+		int end = fb_line_to_offset(fb, last_line + 1);
+		end = end < 0 ? fb->len : end - 1;
+		int len = end - start;
+
+		// the lines are only looked at in place, the range is copied once if it is in many chunks
+		int chunk_len = 0;
+		const char* text = len ? fb_chunk(fb, start, &chunk_len) : "";
+		char* copy = NULL;
+		if (chunk_len < len) {
+				copy = xmalloc(len);
+				storage_copy(fb->storage, start, len, copy);
+				text = copy;
+		}
+
+		int n = 1;
+		for (const char* p = text; (p = memchr(p, '\n', text + len - p)); p++)
+				n++;
+		struct sort_line* lines = xmalloc(n * sizeof(struct sort_line));
+		for (int i = 0, line_start = 0; i < n; i++) {
+				const char* nl = memchr(text + line_start, '\n', len - line_start);
+				int line_len = nl ? nl - (text + line_start) : len - line_start;
+				struct sort_line* line = lines + i;
+				*line = (struct sort_line){.start = line_start, .len = line_len};
+				line->key = sort_line_key(text + line_start, line_len, column);
+				if (flags & FB_SORT_NUMERIC)
+						line->number = sort_parse_number(text + line_start + line->key, line_len - line->key);
+				line_start += line_len + 1;
+		}
+
+		struct sort_context c = {.text = text, .flags = flags};
+		if (!(flags & FB_SORT_KEEP_ORDER))
+				sort_lines(&c, lines, n);
+		int kept = n;
+		if (flags & FB_SORT_UNIQUE) {
+				kept = 1;
+				for (int i = 1; i < n; i++)
+						if (sort_compare(&c, &lines[kept-1], &lines[i]) != 0)
+								lines[kept++] = lines[i];
+		}
+
+		char* out = xmalloc(MAX(len, 1));
+		int out_len = 0;
+		for (int i = 0; i < kept; i++) {
+				if (i)
+						out[out_len++] = '\n';
+				memcpy(out + out_len, text + lines[i].start, lines[i].len);
+				out_len += lines[i].len;
+		}
+		if (out_len != len || memcmp(out, text, len) != 0) {
+				struct storage_edit edit = {.offset = start, .removed = len, .data = out, .len = out_len};
+				fb_begin_transaction(fb);
+				fb_apply_edits(fb, &edit, 1, 0);
+				fb_commit_transaction(fb, FB_CONTENT_BIG_CHANGE);
+		}
+		free(out);
+		free(lines);
+		free(copy);
+		return kept;
+}
+
+#define REPLACE_GROUPS 10
+
+// finds the first match in text at or after pos, literally or with re
+static int
+replace_find(const char* text, int len, int pos, const char* pattern, int pattern_len,
+			 regex_t* re, int flags, regmatch_t* groups)
+{
+		if (flags & FB_REPLACE_REGEX) {
+#ifdef REG_STARTEND
+				// the text isn't searched for its end every time and ^ sees the char before pos
+				groups[0].rm_so = pos;
+				groups[0].rm_eo = len;
+				if (regexec(re, text, REPLACE_GROUPS, groups, REG_STARTEND) != 0)
+						return -1;
+#else
+				int eflags = 0;
+				if (pos > 0 && text[pos-1] != '\n')
+						eflags |= REG_NOTBOL;
+				if (regexec(re, text + pos, REPLACE_GROUPS, groups, eflags) != 0)
+						return -1;
+				for (int i = 0; i < REPLACE_GROUPS; i++) {
+						if (groups[i].rm_so >= 0) {
+								groups[i].rm_so += pos;
+								groups[i].rm_eo += pos;
+						}
+				}
+#endif
+				return groups[0].rm_so;
+		}
+
+		for (; pos + pattern_len <= len; pos++) {
+				if (flags & FB_REPLACE_IGNORE_CASE) {
+						if (strncasecmp(text + pos, pattern, pattern_len) != 0)
+								continue;
+				} else {
+						const char* p = memchr(text + pos, pattern[0], len - pos - pattern_len + 1);
+						if (!p)
+								return -1;
+						pos = p - text;
+						if (memcmp(p, pattern, pattern_len) != 0)
+								continue;
+				}
+				groups[0].rm_so = pos;
+				groups[0].rm_eo = pos + pattern_len;
+				for (int i = 1; i < REPLACE_GROUPS; i++)
+						groups[i].rm_so = groups[i].rm_eo = -1;
+				return pos;
+		}
+		return -1;
+}
+
+static void
+replace_expand(struct fb_text* out, const char* text, const char* replacement, const regmatch_t* groups)
+{
+		for (const char* r = replacement; *r; r++) {
+				int group = -1;
+				if (*r == '&') {
+						group = 0;
+				} else if (*r == '\\' && r[1]) {
+						r++;
+						if (*r >= '0' && *r <= '9')
+								group = *r - '0';
+						else if (*r == 'n')
+								fb_text_append(out, "\n", 1);
+						else if (*r == 't')
+								fb_text_append(out, "\t", 1);
+						else
+								fb_text_append(out, r, 1);
+				} else {
+						fb_text_append(out, r, 1);
+				}
+				if (group >= 0 && groups[group].rm_so >= 0)
+						fb_text_append(out, text + groups[group].rm_so, groups[group].rm_eo - groups[group].rm_so);
+		}
+}
+
+int
+fb_replace(struct file_buffer* fb, int start, int end, const char* pattern, const char* replacement, int flags, int* last_match)
+{
+		LIMIT(start, 0, fb->len);
+		LIMIT(end, start, fb->len);
+		int pattern_len = strlen(pattern);
+		if (!pattern_len)
+				return 0;
+		if (fb->mode & FB_READ_ONLY) {
+				writef_to_status_bar("buffer is read only");
+				return 0;
+		}
+		regex_t re;
+		if (flags & FB_REPLACE_REGEX) {
+				int res = regcomp(&re, pattern, REG_EXTENDED | REG_NEWLINE |
+								  (flags & FB_REPLACE_IGNORE_CASE ? REG_ICASE : 0));
+				if (res != 0) {
+						char error[128];
+						regerror(res, &re, error, sizeof(error));
+						writef_to_status_bar("invalid regex: %s", error);
+						return -1;
+				}
+		}
+
+		// regexec needs the range in one null terminated piece
+		int len = end - start;
+		char* text = xmalloc(len + 1);
+		storage_copy(fb->storage, start, len, text);
+		text[len] = 0;
+
+		// out starts at the first match, the text after the last one stays as it is
+		struct fb_text* out = &transform_out;
+		out->len = 0;
+		int count = 0, first = -1, copied = 0, last = 0;
+		regmatch_t groups[REPLACE_GROUPS];
+		for (int pos = 0; pos <= len; ) {
+				int match = replace_find(text, len, pos, pattern, pattern_len, &re, flags, groups);
+				if (match < 0)
+						break;
+				int match_end = groups[0].rm_eo;
+				if (match_end == match && count && match == copied) {
+						// like sed an empty match right after the last match doesn't count
+						pos = match + 1;
+						continue;
+				}
+				if (first < 0)
+						first = copied = match;
+				fb_text_append(out, text + copied, match - copied);
+				last = out->len;
+				replace_expand(out, text, replacement, groups);
+				copied = match_end;
+				count++;
+
+				if (flags & FB_REPLACE_ONCE_PER_LINE) {
+						// go on at the line after the one the match started on
+						const char* nl = memchr(text + match, '\n', len - match);
+						if (!nl)
+								break;
+						pos = MAX(nl - text + 1, match_end);
+				} else {
+						// an empty match would be found again at the same place
+						pos = match_end > match ? match_end : match_end + 1;
+				}
+		}
+
+		if (count) {
+				struct storage_edit edit = {.offset = start + first, .removed = copied - first, .data = out->data, .len = out->len};
+				fb_begin_transaction(fb);
+				fb_apply_edits(fb, &edit, 1, 0);
+				fb_commit_transaction(fb, FB_CONTENT_BIG_CHANGE);
+				if (last_match)
+						*last_match = start + first + last;
+		}
+
+		if (flags & FB_REPLACE_REGEX)
+				regfree(&re);
+		free(text);
+		if (out->capacity > TRANSFORM_KEEP_CAPACITY) {
+				free(out->data);
+				*out = (struct fb_text){0};
+		}
+		return count;
 }
 
 char*
@@ -552,7 +3277,7 @@ fb_get_line_at_offset(const struct file_buffer* fb, int offset)
 
 		char* res = xmalloc(len + 1);
 		if (len > 0)
-				memcpy(res, fb->contents+start, len);
+				storage_copy(fb->storage, start, len, res);
 		res[len] = 0;
 		return res;
 }
@@ -567,43 +3292,32 @@ fb_offset_to_xy(struct file_buffer* fb, int offset, int maxx, int y_scroll, int*
 				return;
 		LIMIT(offset, 0, fb->len);
 
-		char* repl = fb->contents;
-		char* last = repl + offset;
+		const int line = fb_offset_to_line(fb, offset);
 
-		char* new_repl;
 		if (wrap_buffer && maxx > 0) {
-				int yscroll = 0;
-				while ((new_repl = memchr(repl, '\n', last - repl))) {
-						if (++yscroll >= y_scroll)
-								break;
-						repl = new_repl+1;
-				}
-				*cy = yscroll - y_scroll;
-		} else {
-				while ((new_repl = memchr(repl, '\n', last - repl))) {
-						repl = new_repl+1;
-						*cy += 1;
+				// start counting from the line at y_scroll, the wrapped lines above don't matter
+				int first_line = MAX(y_scroll, 1);
+				int repl;
+				if (line >= first_line) {
+						repl = fb_line_to_offset(fb, first_line-1);
+						*cy = first_line - y_scroll;
+				} else {
+						repl = fb_line_to_offset(fb, line);
+						*cy = line - y_scroll;
 				}
-				*cy -= y_scroll;
-		}
 
-		while (repl < last) {
-				if (wrap_buffer && maxx > 0 && (*repl == '\n' || *cx >= maxx)) {
-						*cy += 1;
-						*cx = 0;
-						repl++;
-						continue;
-				}
-				if (*repl == '\t') {
-						repl++;
-						if (*cx <= 0) *cx += 1;
-						while (*cx % tabspaces != 0) *cx += 1;
-						*cx += 1;
-						continue;
+				while (repl < offset) {
+						if (fb_char(fb, repl) == '\n' || *cx >= maxx) {
+								*cy += 1;
+								*cx = 0;
+								repl++;
+								continue;
+						}
+						repl += column_step(fb, repl, cx);
 				}
-				rune_t u;
-				repl += utf8_decode_buffer(repl, last - repl, &u);
-				*cx += wcwidth(u);
+		} else {
+				*cy = line - y_scroll;
+				*cx = fb_offset_to_column(fb, offset);
 		}
 
 		// TODO: make customizable
@@ -639,19 +3353,19 @@ wb_move_on_line(struct window_buffer* wb, int amount, enum cursor_reason callbac
 				return;
 
 		if (amount < 0) {
-				while (wb->cursor_offset > 0 && fb->contents[wb->cursor_offset - 1] != '\n' && amount < 0) {
+				while (wb->cursor_offset > 0 && fb_char(fb, wb->cursor_offset - 1) != '\n' && amount < 0) {
 						wb->cursor_offset--;
-						if ((fb->contents[wb->cursor_offset] & 0xC0) == 0x80) // if byte starts with 0b10
+						if ((fb_char(fb, wb->cursor_offset) & 0xC0) == 0x80) // if byte starts with 0b10
 								continue; // byte is UTF-8 extender
 						amount++;
 				}
 				LIMIT(wb->cursor_offset, 0, fb->len);
 		} else if (amount > 0) {
 				for (int charsize = 0;
-					 wb->cursor_offset < fb->len && amount > 0 && fb->contents[wb->cursor_offset + charsize] != '\n';
+					 wb->cursor_offset < fb->len && amount > 0 && fb_char(fb, wb->cursor_offset + charsize) != '\n';
 					 wb->cursor_offset += charsize, amount--) {
 						rune_t u;
-						charsize = utf8_decode_buffer(fb->contents + wb->cursor_offset, fb->len - wb->cursor_offset, &u);
+						charsize = fb_utf8_decode(fb, wb->cursor_offset, &u);
 						if (u != '\n' && u != '\t')
 								if (wcwidth(u) <= 0)
 										amount++;
@@ -681,22 +3395,20 @@ wb_move_offset_relative(struct window_buffer* wb, int amount, enum cursor_reason
 void
 wb_move_lines(struct window_buffer* wb, int amount, enum cursor_reason callback_reason)
 {
-		const struct file_buffer* fb = get_fb((wb));
+		struct file_buffer* fb = get_fb((wb));
 		if (fb->len <= 0)
 				return;
 		int offset = wb->cursor_offset;
+		int line = fb_offset_to_line(fb, offset) + amount;
 		if (amount > 0) {
-				while (amount-- && offset >= 0) {
-						int new_offset = fb_seek_char(fb, offset, '\n');
-						if (new_offset < 0) {
-								offset = fb->len;
-								break;
-						}
-						offset = new_offset+1;
-				}
+				fb_load_lines(fb, line + 1);
+				// start of the line
+				offset = fb_line_to_offset(fb, line);
+				if (offset < 0)
+						offset = fb->len;
 		} else if (amount < 0) {
-				while (amount++ && offset >= 0)
-						offset = fb_seek_char_backwards(fb, offset, '\n')-1;
+				// end of the line
+				offset = line >= 0 ? fb_line_to_offset(fb, line+1)-1 : 0;
 		}
 		wb_move_to_offset(wb, offset, callback_reason);
 }
@@ -721,35 +3433,148 @@ wb_move_to_x(struct window_buffer* wb, int x, enum cursor_reason callback_reason
 		soft_assert(wb, return;);
 		struct file_buffer* fb = get_fb(wb);
 
-		int offset = fb_seek_char_backwards(fb, wb->cursor_offset, '\n');
-		if (offset < 0)
-				offset = 0;
-		wb_move_to_offset(wb, offset, 0);
+		wb_move_to_offset(wb, fb_column_to_offset(fb, wb->cursor_offset, x), callback_reason);
+}
 
-		int x_counter = 0;
+///////////////////////////////////
+// Multiple cursors
+//
 
-		while (offset < fb->len) {
-				if (fb->contents[offset] == '\t') {
-						offset++;
-						if (x_counter <= 0) x_counter += 1;
-						while (x_counter % tabspaces != 0) x_counter += 1;
-						x_counter += 1;
+// returns NULL and drops the cursors if the window moved to another buffer
+static struct file_buffer*
+wb_cursors_fb(struct window_buffer* wb)
+{
+		if (!wb->cursor_count)
+				return NULL;
+		struct file_buffer* fb = fb_from_handle(wb->cursors_fb);
+		if (fb && fb == get_fb(wb))
+				return fb;
+		wb_clear_cursors(wb);
+		return NULL;
+}
+
+int
+wb_add_cursor(struct window_buffer* wb, int offset)
+{
+		struct file_buffer* fb = get_fb(wb);
+		if (!wb_cursors_fb(wb))
+				wb->cursors_fb = fb_handle(wb->fb_index);
+		LIMIT(offset, 0, fb->len);
+		if (offset == wb->cursor_offset)
+				return 0;
+		// only the marks sitting on the offset can be cursors already there
+		if (fb->marks) {
+				struct fb_marks* m = fb->marks;
+				for (int index = marks_search(m, &(struct fb_mark){.offset = offset, .gravity = MARK_LEFT});
+				     index < m->sorted_len && m->marks[m->sorted[index]].offset == offset; index++)
+						for (int i = 0; i < wb->cursor_count; i++)
+								if (wb->cursors[i] == m->sorted[index])
+										return 0;
+		}
+
+		if (wb->cursor_count >= wb->cursor_capacity) {
+				wb->cursor_capacity = MAX(wb->cursor_capacity * 2, 16);
+				wb->cursors = xrealloc(wb->cursors, wb->cursor_capacity * sizeof(int));
+		}
+		wb->cursors[wb->cursor_count++] = fb_mark_new(fb, offset, MARK_RIGHT);
+		return 1;
+}
+
+void
+wb_clear_cursors(struct window_buffer* wb)
+{
+		struct file_buffer* fb = fb_from_handle(wb->cursors_fb);
+		if (fb)
+				for (int i = 0; i < wb->cursor_count; i++)
+						fb_mark_free(fb, wb->cursors[i]);
+		free(wb->cursors);
+		wb->cursors = NULL;
+		wb->cursor_count = wb->cursor_capacity = 0;
+}
+
+int
+wb_cursor_count(struct window_buffer* wb)
+{
+		wb_cursors_fb(wb);
+		return wb->cursor_count;
+}
+
+int
+wb_cursor_offset(struct window_buffer* wb, int index)
+{
+		struct file_buffer* fb = wb_cursors_fb(wb);
+		soft_assert(fb && index >= 0 && index < wb->cursor_count, return wb->cursor_offset;);
+		return fb_mark_offset(fb, wb->cursors[index]);
+}
+
+struct cursor_position {
+		int offset;
+		int mark; // -1 for the main cursor
+};
+
+static int
+cursor_position_compare(const void* a, const void* b)
+{
+		return ((const struct cursor_position*)a)->offset - ((const struct cursor_position*)b)->offset;
+}
+
+void
+wb_edit_at_cursors(struct window_buffer* wb, int before, int after, const char* data, int len)
+{
+		struct file_buffer* fb = get_fb(wb);
+		if (fb->mode & FB_READ_ONLY) {
+				writef_to_status_bar("buffer is read only");
+				return;
+		}
+		int count = wb_cursor_count(wb) + 1;
+		struct cursor_position* cursors = xmalloc(count * sizeof(struct cursor_position));
+		cursors[0] = (struct cursor_position){.offset = wb->cursor_offset, .mark = -1};
+		for (int i = 1; i < count; i++)
+				cursors[i] = (struct cursor_position){.offset = fb_mark_offset(fb, wb->cursors[i-1]), .mark = wb->cursors[i-1]};
+		qsort(cursors, count, sizeof(struct cursor_position), cursor_position_compare);
+
+		struct storage_edit* edits = xmalloc(count * sizeof(struct storage_edit));
+		int edit_count = 0, prev_end = 0;
+		for (int i = 0; i < count; i++) {
+				if (i > 0 && cursors[i].offset == cursors[i-1].offset)
 						continue;
-				} else if (fb->contents[offset] == '\n') {
-						break;
+				int start = cursors[i].offset, end = cursors[i].offset;
+				for (int n = before; n > 0 && start > 0; n--) {
+						start--;
+						while (start > 0 && (fb_char(fb, start) & 0xC0) == 0x80) // if byte starts with 0b10
+								start--;
 				}
-				rune_t u = 0;
-				int charsize = utf8_decode_buffer(fb->contents + offset, fb->len - offset, &u);
-				x_counter += wcwidth(u);
-				if (x_counter <= x) {
-						offset += charsize;
-						if (x_counter == x)
-								break;
+				for (int n = after; n > 0 && end < fb->len && fb_char(fb, end) != '\n'; n--)
+						end += fb_utf8_decode(fb, end, NULL);
+				// two cursors eating into the same text only remove it once
+				start = MAX(start, prev_end);
+				end = MAX(end, start);
+				edits[edit_count++] = (struct storage_edit){.offset = start, .removed = end - start, .data = data, .len = len};
+				prev_end = end;
+		}
+
+		int cursor = mark_shift_edits(wb->cursor_offset, MARK_RIGHT, edits, edit_count);
+		fb_begin_transaction(fb);
+		fb_apply_edits(fb, edits, edit_count, 0);
+		fb_commit_transaction(fb, FB_CONTENT_NORMAL_EDIT);
+		free(edits);
+
+		// the edits keep the order, so cursors that ended up on top of each other are next to each other
+		int kept = 0, last = -1;
+		for (int i = 0; i < count; i++) {
+				if (cursors[i].mark < 0)
+						continue;
+				int offset = fb_mark_offset(fb, cursors[i].mark);
+				if (offset == cursor || offset == last) {
+						fb_mark_free(fb, cursors[i].mark);
 				} else {
-						break;
+						wb->cursors[kept++] = cursors[i].mark;
+						last = offset;
 				}
 		}
-		wb_move_to_offset(wb, offset, callback_reason);
+		wb->cursor_count = kept;
+		free(cursors);
+		wb_move_to_offset(wb, cursor, CURSOR_COMMAND_MOVEMENT);
 }
 
 ////////////////////////////////////////////////
@@ -791,6 +3616,11 @@ window_node_split(struct window_split_node* parent, float ratio, enum window_spl
 		parent->node2->parent = parent;
 		parent->node2->node1 = NULL;
 		parent->node2->node2 = NULL;
+		// the extra cursors stay with node1
+		parent->node2->wb.cursors = NULL;
+		parent->node2->wb.cursor_count = parent->node2->wb.cursor_capacity = 0;
+		parent->wb.cursors = NULL;
+		parent->wb.cursor_count = parent->wb.cursor_capacity = 0;
 
 		if (parent->mode == WINDOW_HORISONTAL) {
 				// NOTE: if the window resizing is changed, change in draw tree function as well
@@ -831,6 +3661,7 @@ window_node_delete(struct window_split_node* node)
 		struct window_split_node* old = node;
 		node = node->parent;
 		struct window_split_node* other = (node->node1 == old) ? node->node2 : node->node1;
+		wb_clear_cursors(&old->wb);
 		free(old->search);
 		free(old);
 
@@ -892,20 +3723,6 @@ window_node_draw_tree_to_screen(struct window_split_node* root, int minx, int mi
 		}
 }
 
-void
-window_node_move_all_cursors_on_same_fb(struct window_split_node* root, struct window_split_node* excluded, int fb_index, int offset,
-										void(movement)(struct window_buffer*, int, enum cursor_reason),
-										int move, enum cursor_reason reason)
-{
-		if (root->mode == WINDOW_SINGULAR) {
-				if (root->wb.fb_index == fb_index && root->wb.cursor_offset >= offset && root != excluded)
-						movement(&root->wb, move, reason);
-		} else {
-				window_node_move_all_cursors_on_same_fb(root->node1, excluded, fb_index, offset, movement, move, reason);
-				window_node_move_all_cursors_on_same_fb(root->node2, excluded, fb_index, offset, movement, move, reason);
-		}
-}
-
 void
 window_node_move_all_yscrolls(struct window_split_node* root, struct window_split_node* excluded, int fb_index, int offset, int move)
 {
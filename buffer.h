@@ -1,6 +1,8 @@
 #ifndef BUFFER_H_
 #define BUFFER_H_
 
+#include "utf8.h"
+
 /* fb: file_buffer
 ** wb: window_buffer
 ** wn: window_split_node
@@ -22,12 +24,37 @@ extern struct window_buffer* focused_window;
 // File buffer
 //
 
-#define UNDO_BUFFERS_COUNT 128
-struct undo_buffer {
-		char* contents; // not null terminated
-		int len, capacity;
+// undo history is a log of the edits, not copies of the buffer
+// a record replaced removed bytes at offset with inserted bytes, its offset
+// is from right before it was applied and data holds the removed bytes
+// followed by the inserted ones
+struct undo_record {
+		int offset, removed, inserted;
+		char* data;
+};
+// a step is what one undo reverts, the records before records_end that
+// the previous step doesn't have, steps[0] is the oldest state kept
+struct undo_step {
+		int records_end;
 		int cursor_offset;
 		int y_scroll;
+		long serial; // the oldest steps of all buffers are dropped first
+		struct undo_pack* pack; // the data of the records once the step got old
+};
+// the history is kept under undo_buffer_budget and undo_total_budget bytes
+struct undo_log {
+		struct undo_record* records; // the ones before steps[0].records_end are freed
+		int record_count, record_capacity;
+		struct undo_step* steps;
+		int step_count, step_capacity;
+		int current; // the step the contents are at, the ones after it can be redone
+		long bytes; // of the records and their data, packed or not
+		int packed_until, collect_from; // see undo_pack_step and undo_pack_collect
+
+		// see undo_journal_load, the journal is opened by the first edit
+		FILE* journal;
+		long journal_limit; // older history is searched before it, -1 if there is none
+		int journal_limited, journal_failed;
 };
 
 enum buffer_flags {
@@ -44,18 +71,49 @@ enum buffer_flags {
 		FB_SEARCH_NON_BLOCKING   = 1 << 7,
 		FB_SEARCH_BLOCKING_BACKWARDS   = 1 << 8,
 		FB_SEARCH_NON_BLOCKING_BACKWARDS   = 1 << 9,
+		FB_MAPPED       = 1 << 10, // a huge file, see huge_file_size
+		FB_LAZY         = 1 << 11, // a huge file, see lazy_load_size
+		FB_HUGE_MASK = (FB_MAPPED | FB_LAZY),
+};
+
+// the line endings found when loading a file, the buffer itself only has '\n'
+// if more than one kind was found the file is written with '\n'
+enum line_ending {
+		FB_EOL_LF   = 1 << 0,
+		FB_EOL_CRLF = 1 << 1,
+		FB_EOL_CR   = 1 << 2,
+};
+
+// where a mark ends up when text is inserted at its offset
+enum mark_gravity {
+		MARK_LEFT,  // stays in front of the text
+		MARK_RIGHT, // moves with the char it is on
+};
+
+struct fb_storage;
+struct column_index;
+struct fb_marks;
+
+// reads the rest of a file that isn't fully loaded yet, see fb_load_chunk
+struct fb_loader {
+		int fd;
+		long size, read; // in bytes of the file
 };
 
 struct file_buffer {
 		char* file_path;
-		char* contents; // !! NOT NULL TERMINATED !!
+		// the contents, see storage.h
+		// read them with fb_char, fb_chunk and friends, not directly
+		struct fb_storage* storage;
 		int len;
-		int capacity;
+		// NULL once the whole file is loaded
+		struct fb_loader* loader;
 		int mode; // buffer_flags
-		struct undo_buffer* ub;
-		int current_undo_buffer;
-		int available_redo_buffers;
-		int s1o, s2o; // selection start offset and end offset
+		int line_endings; // line_ending flags
+		unsigned int version; // incremented on every change, see fb_contents_edited in extension.h
+		struct undo_log undo;
+		int s1o, s2o; // selection start offset and end offset, moved by edits like MARK_RIGHT marks
+		struct fb_marks* marks; // see fb_mark_new
 
 		// used for "ctrl+f" searches
 		char* search_term;
@@ -64,6 +122,13 @@ struct file_buffer {
 
 		unsigned int indent_len; // amount of spaces, if 0 tab is used
 
+		// display column checkpoints of recently used long lines
+		struct column_index* column_index;
+
+		// see fb_begin_transaction
+		int transaction_depth;
+		int transaction_start, transaction_end; // the changed range, -1 if nothing changed yet
+
 		// required by syntax.h, not used by anything else
 		int syntax_index;
 };
@@ -80,19 +145,137 @@ enum buffer_content_reason {
 struct file_buffer* get_fb(struct window_buffer* wb);
 int fb_new_entry(const char* file_path);
 int destroy_fb_entry(struct window_split_node* node, struct window_split_node* root);
+
+///////////////////////////////////
+// a handle refers to an open buffer like an fb_index, but it stops resolving
+// when that buffer is destroyed, even if the slot is reused by another one
+// fb_handle returns -1 if there is no buffer at fb_index
+int fb_handle(int fb_index);
+struct file_buffer* fb_from_handle(int handle);
 int fb_delete_selection(struct file_buffer* fb);
 
 struct file_buffer fb_new(const char* file_path);
+// the buffer is saved in the background, see fb_finish_saves
 void fb_write_to_filepath(struct file_buffer* fb);
+// reports the saves that have been written since it was last called and
+// calls fb_written_to_file for them, returns how many there were
+int  fb_finish_saves(void);
+
+// how long a save waits for the disk before it replaces the file
+enum save_fsync {
+		SAVE_FSYNC_NONE, // left to the system, a crash can lose the new contents
+		SAVE_FSYNC_FILE, // the new contents are on disk before they replace the old
+		SAVE_FSYNC_DIRECTORY, // and so is the rename
+};
+
 void fb_destroy(struct file_buffer* fb);
 
 void fb_insert(struct file_buffer* fb, const char* new_content, const int len, const int offset, int do_not_callback);
 void fb_change(struct file_buffer* fb, const char* new_content, const int len, const int offset, int do_not_callback);
 int  fb_remove(struct file_buffer* fb, const int offset, int len, int do_not_calculate_charsize, int do_not_callback);
+// many replacements in one pass, see storage_apply in storage.h
+// marks are moved by each of them, the callbacks get one change covering all
+struct storage_edit;
+void fb_apply_edits(struct file_buffer* fb, const struct storage_edit* edits, int count, int do_not_callback);
+
+///////////////////////////////////
+// edits between these don't call fb_contents_updated, instead it is called
+// once on commit with the start of everything that was changed, so the undo
+// extension records the whole operation as one step
+// transactions can be nested, only the outermost commit calls back
+void fb_begin_transaction(struct file_buffer* fb);
+void fb_commit_transaction(struct file_buffer* fb, enum buffer_content_reason reason);
+
+///////////////////////////////////
+// reading the contents
+// the contents may be split up in many chunks (see storage.h)
+// fb_chunk returns a pointer to the byte at offset and sets *len to the
+// amount of contiguous bytes from there, use it to iterate the buffer:
+//   for (int n; offset < end && (p = fb_chunk(fb, offset, &n)); offset += n)
+// the pointer is only valid until the buffer is modified
+const char* fb_chunk(const struct file_buffer* fb, int offset, int* len);
+// returns 0 if the offset is outside of the buffer
+char fb_char(const struct file_buffer* fb, int offset);
+// decodes an utf8 char that may cross chunks, returns the size in bytes
+int  fb_utf8_decode(const struct file_buffer* fb, int offset, rune_t* u);
+// memcmp that may cross chunks, anything past the end of the buffer does not match
+int  fb_memcmp(const struct file_buffer* fb, int offset, const char* string, int len);
+
+///////////////////////////////////
+// a range of the buffer that is read in place instead of being copied out
+// go through its contiguous parts with fb_span_next:
+//   for (struct fb_span it = span; (p = fb_span_next(fb, &it, &n)); )
+// like fb_chunk the pointers are only valid until the buffer is modified
+struct fb_span {
+		int start, end; // end is not included
+};
+// the line offset is on, without the '\n'
+struct fb_span fb_span_line(const struct file_buffer* fb, int offset);
+// returns the next part of *it and moves it->start past it, NULL at the end
+const char* fb_span_next(const struct file_buffer* fb, struct fb_span* it, int* len);
+// copies as much of the span as fits in dest and null terminates it, returns the length
+int fb_span_copy(const struct file_buffer* fb, struct fb_span span, char* dest, int dest_size);
+
+///////////////////////////////////
+// snapshots are read only copies of a buffer as it was at fb->version
+// taking one doesn't copy the contents, see storage_snapshot
+// everything that reads a buffer works on a snapshot, on any thread and
+// without locking while the buffer keeps being edited, but one thread at a
+// time per snapshot. they have to be taken and freed on the main thread
+// only the contents, file_path, mode, line_endings, version, indent_len
+// and syntax_index are copied
+// results made from a snapshot are stale once fb_snapshot_is_current fails,
+// throw them away or move them with the fb_contents_edited callback
+struct file_buffer* fb_snapshot_new(struct file_buffer* fb);
+void fb_snapshot_free(struct file_buffer* snapshot);
+int  fb_snapshot_is_current(const struct file_buffer* fb, const struct file_buffer* snapshot);
+
+///////////////////////////////////
+// files bigger than lazy_load_size are read in as they are needed,
+// anything looking past the end of the buffer should load more first
+// fb_load_chunk returns 0 if there is nothing more to load
+// fb_load_lines loads until the buffer has that many lines
+int  fb_load_chunk(struct file_buffer* fb);
+void fb_load_lines(struct file_buffer* fb, int lines);
+void fb_load_all(struct file_buffer* fb);
+
+///////////////////////////////////
+// lines are counted from 0, both are O(log n)
+// the line of an offset is the amount of '\n' before it
+// fb_line_to_offset returns the offset of the first byte of the line,
+// or -1 if the buffer doesn't have that many lines
+int  fb_offset_to_line(const struct file_buffer* fb, int offset);
+int  fb_line_to_offset(const struct file_buffer* fb, int line);
+
+///////////////////////////////////
+// display columns, tabs and wide chars included
+// long lines get checkpoints every COLUMN_CHECKPOINT_INTERVAL bytes, so these
+// only walk from the closest checkpoint instead of from the start of the line
+int  fb_offset_to_column(struct file_buffer* fb, int offset);
+// the offset on the line of offset where the cursor ends up when moving to column x
+int  fb_column_to_offset(struct file_buffer* fb, int offset, int x);
+// returns an offset on the line starting at line_start where walking the line
+// can be resumed from, every char before it ends before column
+// *checkpoint_column is set to the column of the returned offset
+int  fb_column_checkpoint(struct file_buffer* fb, int line_start, int column, int* checkpoint_column);
+
+///////////////////////////////////
+// marks are offsets that every edit of the buffer keeps pointing at the same
+// text, a mark in text that is removed ends up where the text was
+// the marks are kept sorted, so an edit only looks at the marks after it
+// fb_mark_new returns a handle that stays valid until fb_mark_free
+// the cursors of the windows that aren't focused are moved the same way
+int  fb_mark_new(struct file_buffer* fb, int offset, enum mark_gravity gravity);
+void fb_mark_free(struct file_buffer* fb, int mark);
+int  fb_mark_offset(const struct file_buffer* fb, int mark);
+void fb_mark_move(struct file_buffer* fb, int mark, int offset);
 
 void fb_undo(struct file_buffer* fb);
 void fb_redo(struct file_buffer* fb);
 void fb_add_to_undo(struct file_buffer* fb, int offset, enum buffer_content_reason reason);
+// memory used by the undo history of fb and of all buffers together
+long fb_undo_memory(struct file_buffer* fb);
+long undo_memory_total(void);
 
 ///////////////////////////////////
 // returns a null terminated string containing the selection
@@ -105,6 +288,60 @@ char* fb_get_selection(struct file_buffer* fb, int* selection_len);
 int   fb_is_selection_start_top_left(const struct file_buffer* fb);
 void  fb_remove_selection(struct file_buffer* fb);
 
+///////////////////////////////////
+// FB_BLOCK_SELECT selections cover the display columns left to right (exclusive)
+// on every line between s1o and s2o, the chars under both corners included
+// yanking joins the lines with '\n', removing and filling are one batched edit
+void fb_get_block(struct file_buffer* fb, int* first_line, int* last_line, int* left, int* right);
+// the part of the line starting at line_start that is inside the columns,
+// chars that only stick partly into them are included whole
+// span_left and span_right get the columns the span covers and may be NULL
+struct fb_span fb_block_span(struct file_buffer* fb, int line_start, int left, int right, int* span_left, int* span_right);
+// replaces every column of the block with the char c of len bytes, a len of 0 removes it
+void fb_fill_block(struct file_buffer* fb, const char* c, int len);
+
+///////////////////////////////////
+// rewrites lines in one pass, transform is called with every line from
+// first_line to last_line (without the '\n') and the offset it starts at
+// it either appends the new line to out and returns 1, or returns 0 to keep it
+// the lines between the first and last changed one are put back as one edit
+// returns the amount of lines that changed
+struct fb_text {
+		char* data;
+		int len, capacity;
+};
+void fb_text_append(struct fb_text* text, const char* data, int len);
+typedef int (*fb_line_transform)(struct fb_text* out, const char* line, int len, int offset, void* data);
+int fb_transform_lines(struct file_buffer* fb, int first_line, int last_line, fb_line_transform transform, void* data);
+
+///////////////////////////////////
+// sorts the lines as spans of one copy of the range, big ranges are sorted
+// on several threads, the sort is stable and the result is put back as one edit
+// column is the blank separated field lines are compared by, counted from 1,
+// 0 compares the whole line
+// returns the amount of lines left
+enum fb_sort_flags {
+		FB_SORT_NUMERIC    = 1<<0, // by the number the field starts with
+		FB_SORT_REVERSE    = 1<<1,
+		FB_SORT_UNIQUE     = 1<<2, // only keeps the first of the lines that compare equal
+		FB_SORT_KEEP_ORDER = 1<<3, // with FB_SORT_UNIQUE, only drops lines that are equal to the one before them
+};
+int fb_sort_lines(struct file_buffer* fb, int first_line, int last_line, int flags, int column);
+
+///////////////////////////////////
+// replaces the matches of pattern between start and end in one pass over a copy
+// of the range, the text from the first to the last match is put back as one edit
+// in the replacement & and \0 are the match, \1-\9 the groups of a regex,
+// \n and \t a newline and tab and \ escapes anything else
+// *last_match gets where the last replacement starts, it may be NULL
+// returns the amount of replacements, or -1 if the regex is invalid
+enum fb_replace_flags {
+		FB_REPLACE_REGEX         = 1<<0, // POSIX extended regex, ^ and $ match at every line
+		FB_REPLACE_IGNORE_CASE   = 1<<1,
+		FB_REPLACE_ONCE_PER_LINE = 1<<2, // only the first match of every line
+};
+int fb_replace(struct file_buffer* fb, int start, int end, const char* pattern, const char* replacement, int flags, int* last_match);
+
 ///////////////////////////////////
 // returns a null terminated string containing the current line
 // the returned value must be freed by the reciever
@@ -137,6 +374,11 @@ struct window_buffer {
 		// TODO:↑
 		// see extensions/window_modes for other modes
 		unsigned int mode; // WB_NORMAL = 0
+
+		// extra cursors, see wb_add_cursor
+		int* cursors; // mark handles
+		int cursor_count, cursor_capacity;
+		int cursors_fb; // fb_handle of the buffer the marks are in
 };
 
 enum cursor_reason {
@@ -190,13 +432,27 @@ void wb_move_to_offset(struct window_buffer* wb, int offset, enum cursor_reason
 void wb_move_offset_relative(struct window_buffer* wb, int amount, enum cursor_reason callback_reason);
 void wb_move_to_x(struct window_buffer* wb, int x, enum cursor_reason callback_reason);
 
+///////////////////////////////////
+// extra cursors, wb_edit_at_cursors edits the text at all of them and the
+// main cursor at once. they are MARK_RIGHT marks so edits from anywhere move
+// them, and they are dropped when the window shows another buffer
+// clear them before a window is overwritten or freed
+// wb_add_cursor returns 0 if there already is a cursor at offset
+int  wb_add_cursor(struct window_buffer* wb, int offset);
+void wb_clear_cursors(struct window_buffer* wb);
+int  wb_cursor_count(struct window_buffer* wb);
+int  wb_cursor_offset(struct window_buffer* wb, int index);
+// replaces the before chars in front of and after chars behind every cursor
+// with data, all in one pass over the buffer and as one undo step
+// the chars behind a cursor stop at the end of its line, like x
+void wb_edit_at_cursors(struct window_buffer* wb, int before, int after, const char* data, int len);
+
 // window split node
 
 void window_node_split(struct window_split_node* parent, float ratio, enum window_split_mode mode);
 struct window_split_node* window_node_delete(struct window_split_node* node);
 // uses focused_window to draw the cursor
 void window_node_draw_tree_to_screen(struct window_split_node* root, int minx, int miny, int maxx, int maxy);
-void window_node_move_all_cursors_on_same_fb(struct window_split_node* root, struct window_split_node* excluded, int buf_index, int offset, void(movement)(struct window_buffer*, int, enum cursor_reason), int move, enum cursor_reason reason);
 void window_node_move_all_yscrolls(struct window_split_node* root, struct window_split_node* excluded, int buf_index, int offset, int move);
 int  window_other_nodes_contain_fb(struct window_split_node* node, struct window_split_node* root);
 
@@ -1,6 +1,9 @@
 #include "config.h"
 #include "extension.h"
+#include "storage.h"
 #include <ctype.h>
+#include <wctype.h>
+#include <time.h>
 
 #define MODKEY Mod1Mask
 
@@ -31,6 +34,32 @@ int wrap_buffer = 0;
 unsigned int tabspaces = 8;
 unsigned int default_indent_len = 0; // 0 means tab
 
+// files bigger than this (in bytes) are mapped instead of read in,
+// edits don't copy the file
+long huge_file_size = 10 * 1024 * 1024;
+// open those files read only, toggle it with "SPC b r"
+int huge_file_read_only = 1;
+// files bigger than this are read in chunks as they are scrolled through
+// or searched, instead of all at once (or mapped)
+long lazy_load_size = 256 * 1024 * 1024;
+// bytes of undo history kept for each buffer and for all of them together,
+// the oldest steps are dropped first when one of them is exceeded
+long undo_buffer_budget = 32 * 1024 * 1024;
+long undo_total_budget = 128 * 1024 * 1024;
+// undo history is kept across sessions in this directory, relative to
+// $HOME if it doesn't start with '/', NULL to not keep it
+const char* undo_journal_dir = ".cache/se/undo";
+// a journal bigger than this is started over when a file is edited again
+long undo_journal_max_size = 64 * 1024 * 1024;
+// see enum save_fsync
+enum save_fsync save_fsync = SAVE_FSYNC_FILE;
+// saves write a new file and rename it over the old one. with this set,
+// files that have other hard links or whose owner the new file can't get
+// are written over instead, which keeps both but a crash while saving
+// leaves them cut short. otherwise the links keep the old contents and
+// the save fails if the owner can't be kept
+int save_in_place = 0;
+
 // Default shape of cursor
 // 2: block ("█")
 // 4: underline ("_")
@@ -70,9 +99,9 @@ enum window_modes {
 #include "extensions/syntax/c.h"
 
 const struct syntax_scheme syntax[] = {
-		{".c", c_word_seperators, c_syntax, LEN(c_syntax), c_indent, LEN(c_indent)},
-		{".h", c_word_seperators, c_syntax, LEN(c_syntax), c_indent, LEN(c_indent)},
-		{".gd", gd_word_seperators, gd_syntax, LEN(gd_syntax), gd_indent, LEN(gd_indent)},
+		{".c", c_word_seperators, c_syntax, LEN(c_syntax), c_indent, LEN(c_indent), "//"},
+		{".h", c_word_seperators, c_syntax, LEN(c_syntax), c_indent, LEN(c_indent), "//"},
+		{".gd", gd_word_seperators, gd_syntax, LEN(gd_syntax), gd_indent, LEN(gd_indent), "#"},
 
 		{0},
 };
@@ -341,7 +370,7 @@ vim_get_delimiter(int delimiter_type, int offset, int* start, int* end)
 
 		switch(delimiter_type) {
 		case VIM_CURRENT_WORD:
-				if (isspace(fb->contents[offset])) {
+				if (isspace(fb_char(fb, offset))) {
 						int not_whitespace = fb_seek_not_whitespace_backwards(fb, offset);
 						if (not_whitespace >= 0)
 								not_whitespace += 1;
@@ -391,7 +420,7 @@ vim_get_delimiter(int delimiter_type, int offset, int* start, int* end)
 				*start = fb_seek_char_backwards(fb, offset, '\n');
 				if (*start < 0)
 						*start = 0;
-				if (*start + 1 < fb->len-1 && isspace(fb->contents[*start + 1])) {
+				if (*start + 1 < fb->len-1 && isspace(fb_char(fb, *start + 1))) {
 						int not_whitespace = fb_seek_not_whitespace(fb, *start + 1);
 						int line_end = fb_seek_char(fb, *start + 1, '\n');
 						if (line_end < not_whitespace)
@@ -429,6 +458,7 @@ vim_get_delimiter(int delimiter_type, int offset, int* start, int* end)
 				}
 				return 1;
 		case VIM_TO_END_OF_FILE:
+				fb_load_all(fb);
 				count = vim_chain_parse_count_raw();
 				if (count) {
 						count--;
@@ -464,7 +494,7 @@ vim_get_delimiter(int delimiter_type, int offset, int* start, int* end)
 		case VIM_PREV_STRING_START:
 				*end = offset;
 				offset--;
-				if (isspace(fb->contents[offset]))
+				if (isspace(fb_char(fb, offset)))
 						offset = fb_seek_not_whitespace_backwards(fb, offset);
 				*start = fb_seek_whitespace_backwards(fb, offset-1);
 				if (*start < 0)
@@ -479,7 +509,7 @@ vim_get_delimiter(int delimiter_type, int offset, int* start, int* end)
 				return 1;
 		case VIM_TO_START_OF_STRING:
 				*start = offset;
-				if (!isspace(fb->contents[offset]))
+				if (!isspace(fb_char(fb, offset)))
 						offset = fb_seek_whitespace(fb, offset);
 				*end = fb_seek_not_whitespace(fb, offset);
 				if (*end < 0)
@@ -487,7 +517,7 @@ vim_get_delimiter(int delimiter_type, int offset, int* start, int* end)
 				return 1;
 		case VIM_TO_END_OF_STRING:
 				*start = offset;
-				if (isspace(fb->contents[offset]))
+				if (isspace(fb_char(fb, offset)))
 						offset = fb_seek_not_whitespace(fb, offset);
 				*end = fb_seek_whitespace(fb, offset);
 				if (*end < 0)
@@ -513,9 +543,15 @@ vim_change_mode(int custom_mode)
 		int previous_mode = vim_mode;
 
 		if (custom_mode == VIM_NORMAL) {
-				if (vim_mode == VIM_INSERT)
-						wb_move_on_line(focused_window, -1, CURSOR_COMMAND_MOVEMENT);
 				struct file_buffer* fb = get_fb(focused_window);
+				if (vim_mode == VIM_INSERT) {
+						wb_move_on_line(focused_window, -1, CURSOR_COMMAND_MOVEMENT);
+						for (int i = 0; i < wb_cursor_count(focused_window); i++) {
+								int offset = wb_cursor_offset(focused_window, i);
+								if (offset > 0 && fb_char(fb, offset-1) != '\n')
+										fb_mark_move(fb, focused_window->cursors[i], offset-1);
+						}
+				}
 				cursor_shape = 2;
 				fb->mode &= ~FB_SELECT_MASK;
 				fb->mode &= ~FB_SEARCH_BLOCKING_MASK;
@@ -528,10 +564,20 @@ vim_change_mode(int custom_mode)
 				writef_to_status_bar("-- INSERT --");
 		} else if (custom_mode == VIM_REPLACE) {
 				cursor_shape = 4;
-		} else if (custom_mode == VIM_VISUAL || VIM_VISUAL_LINE) {
+		} else if (custom_mode == VIM_VISUAL || custom_mode == VIM_VISUAL_LINE || custom_mode == VIM_VISUAL_BLOCK) {
 				struct file_buffer* fb = get_fb(focused_window);
 				fb->mode |= FB_SELECTION_ON;
-				if (custom_mode == VIM_VISUAL) {
+				if (custom_mode == VIM_VISUAL_BLOCK) {
+						// switching from another visual mode keeps where the selection started
+						if (previous_mode != VIM_VISUAL)
+								fb->s1o = focused_window->cursor_offset;
+						fb->s2o = focused_window->cursor_offset;
+						fb->mode &= ~FB_LINE_SELECT;
+						fb->mode |= FB_BLOCK_SELECT;
+						writef_to_status_bar("-- VISUAL BLOCK --");
+
+						custom_mode = VIM_VISUAL;
+				} else if (custom_mode == VIM_VISUAL) {
 						fb->s1o = fb->s2o = focused_window->cursor_offset;
 						writef_to_status_bar("-- VISUAL --");
 				} else if (custom_mode == VIM_VISUAL_LINE) {
@@ -549,6 +595,14 @@ vim_change_mode(int custom_mode)
 		return -1;
 }
 
+static int
+vim_escape(int custom_mode)
+{
+		if (vim_mode == VIM_NORMAL)
+				wb_clear_cursors(focused_window);
+		return vim_change_mode(VIM_NORMAL);
+}
+
 static int
 vim_exit(int custom_mode) {
 		exit(0);
@@ -647,6 +701,15 @@ vim_save_buffer(int custom_mode)
 		return -2;
 }
 
+static int
+vim_toggle_read_only(int custom_mode)
+{
+		struct file_buffer* fb = get_fb(focused_window);
+		fb->mode ^= FB_READ_ONLY;
+		writef_to_status_bar(fb->mode & FB_READ_ONLY ? "read only" : "editable");
+		return -2;
+}
+
 static int
 vim_zoomabs(int custom_mode)
 {
@@ -680,6 +743,472 @@ vim_zero(int custom_mode)
 		return 2;
 }
 
+enum vim_block_insert_modes {
+		VIM_BLOCK_INSERT,
+		VIM_BLOCK_APPEND,
+		VIM_BLOCK_CHANGE,
+};
+
+static int vim_move(int custom_mode);
+
+// the offset of the top left corner of the block selection,
+// edits of the block don't move it
+static int
+vim_block_start(void)
+{
+		struct file_buffer* fb = get_fb(focused_window);
+		int first_line, last_line, left, right;
+		fb_get_block(fb, &first_line, &last_line, &left, &right);
+		return fb_block_span(fb, fb_line_to_offset(fb, first_line), left, right, NULL, NULL).start;
+}
+
+// puts the main cursor on the first line of the block and an extra cursor on every
+// other line that reaches the left edge, at the left or right edge of the block
+static void
+vim_block_cursors(int first_line, int last_line, int left, int right, int to_right)
+{
+		struct file_buffer* fb = get_fb(focused_window);
+		wb_clear_cursors(focused_window);
+		int main_cursor = 0;
+		int line_start = fb_line_to_offset(fb, first_line);
+		for (int line = first_line; line <= last_line; line++) {
+				int span_left;
+				struct fb_span span = fb_block_span(fb, line_start, left, right, &span_left, NULL);
+				line_start = fb_seek_char(fb, span.end, '\n') + 1;
+				if (span.end == span.start && span_left < left)
+						continue;
+				int offset = to_right ? span.end : span.start;
+				if (!main_cursor) {
+						wb_move_to_offset(focused_window, offset, CURSOR_COMMAND_MOVEMENT);
+						main_cursor = 1;
+				} else {
+						wb_add_cursor(focused_window, offset);
+				}
+		}
+}
+
+// I and A on a block selection insert on every line of it, c replaces it
+static int
+vim_block_insert(int custom_mode)
+{
+		struct file_buffer* fb = get_fb(focused_window);
+		if (!(fb->mode & FB_BLOCK_SELECT)) {
+				if (custom_mode == VIM_BLOCK_APPEND)
+						return vim_move(VIM_TO_END_OF_LINE);
+				return -1;
+		}
+		int first_line, last_line, left, right;
+		fb_get_block(fb, &first_line, &last_line, &left, &right);
+		if (custom_mode == VIM_BLOCK_CHANGE)
+				fb_fill_block(fb, NULL, 0);
+		fb->mode &= ~FB_SELECT_MASK;
+		vim_block_cursors(first_line, last_line, left, right, custom_mode == VIM_BLOCK_APPEND);
+		vim_change_mode(VIM_INSERT);
+		return -1;
+}
+
+// the next typed char replaces every char of a block selection
+static int vim_block_replace_pending = 0;
+
+static int
+vim_block_replace(int custom_mode)
+{
+		if (!(get_fb(focused_window)->mode & FB_BLOCK_SELECT)) {
+				writef_to_status_bar("r only works on block selections");
+				return -2;
+		}
+		vim_block_replace_pending = 1;
+		writef_to_status_bar("r-");
+		return -2;
+}
+
+// the lines of the selection in visual mode, otherwise every line of the
+// buffer but the empty one after the last '\n'
+static void
+vim_line_range(int* first_line, int* last_line)
+{
+		struct file_buffer* fb = get_fb(focused_window);
+		if (fb->mode & FB_SELECTION_ON) {
+				int s1 = fb->s1o, s2 = fb->s2o;
+				LIMIT(s1, 0, fb->len);
+				LIMIT(s2, 0, fb->len);
+				*first_line = fb_offset_to_line(fb, MIN(s1, s2));
+				*last_line = fb_offset_to_line(fb, MAX(s1, s2));
+		} else {
+				fb_load_all(fb);
+				*first_line = 0;
+				*last_line = fb_offset_to_line(fb, fb->len);
+				if (*last_line > 0 && fb_char(fb, fb->len-1) == '\n')
+						*last_line -= 1;
+		}
+}
+
+// line transforms, each is one pass over the lines and one edit
+enum vim_transforms {
+		VIM_INDENT,
+		VIM_OUTDENT,
+		VIM_COMMENT,
+		VIM_LOWER_CASE,
+		VIM_UPPER_CASE,
+		VIM_TOGGLE_CASE,
+		// done by the indent scheme of the syntax extension
+		VIM_REINDENT,
+		// these work on the whole buffer outside of visual mode
+		VIM_TRIM_WHITESPACE,
+		VIM_TABS_TO_SPACES,
+		VIM_SPACES_TO_TABS,
+		VIM_REINDENT_BUFFER,
+};
+
+struct vim_transform_data {
+		struct file_buffer* fb;
+		int mode;
+		// the case of the chars between from and to is changed,
+		// or of the chars between the left and right columns for blocks
+		int from, to;
+		int block, left, right;
+		const char* comment;
+		int uncomment, comment_indent;
+};
+
+static int
+vim_leading_whitespace(const char* line, int len)
+{
+		int i = 0;
+		while (i < len && (line[i] == ' ' || line[i] == '\t'))
+				i++;
+		return i;
+}
+
+static void
+vim_append_spaces(struct fb_text* out, int count)
+{
+		static const char spaces[] = "                ";
+		for (int n; count > 0; count -= n) {
+				n = MIN(count, (int)sizeof(spaces) - 1);
+				fb_text_append(out, spaces, n);
+		}
+}
+
+static rune_t
+vim_change_case(rune_t u, int mode)
+{
+		if (mode == VIM_UPPER_CASE || (mode == VIM_TOGGLE_CASE && iswlower(u)))
+				return towupper(u);
+		if (mode == VIM_LOWER_CASE || (mode == VIM_TOGGLE_CASE && iswupper(u)))
+				return towlower(u);
+		return u;
+}
+
+// the lines are only uncommented if every line that isn't blank is commented,
+// otherwise the comments go at the smallest indent
+static int
+vim_comment_scan(struct fb_text* out, const char* line, int len, int offset, void* data)
+{
+		struct vim_transform_data* t = data;
+		int indent = vim_leading_whitespace(line, len);
+		if (indent == len)
+				return 0;
+		int comment_len = strlen(t->comment);
+		if (len - indent < comment_len || memcmp(line + indent, t->comment, comment_len) != 0)
+				t->uncomment = 0;
+		t->comment_indent = MIN(t->comment_indent, indent);
+		return 0;
+}
+
+static int
+vim_transform_line(struct fb_text* out, const char* line, int len, int offset, void* data)
+{
+		struct vim_transform_data* t = data;
+		int indent = vim_leading_whitespace(line, len);
+		switch (t->mode) {
+		case VIM_INDENT:
+				if (!len)
+						return 0;
+				if (t->fb->indent_len)
+						vim_append_spaces(out, t->fb->indent_len);
+				else
+						fb_text_append(out, "\t", 1);
+				fb_text_append(out, line, len);
+				return 1;
+		case VIM_OUTDENT: {
+				int removed = 0;
+				if (len && line[0] == '\t') {
+						removed = 1;
+				} else {
+						int width = t->fb->indent_len ? t->fb->indent_len : tabspaces;
+						while (removed < width && removed < len && line[removed] == ' ')
+								removed++;
+				}
+				if (!removed)
+						return 0;
+				fb_text_append(out, line + removed, len - removed);
+				return 1;
+		}
+		case VIM_COMMENT: {
+				if (indent == len)
+						return 0;
+				int comment_len = strlen(t->comment);
+				if (t->uncomment) {
+						int end = indent + comment_len;
+						if (end < len && line[end] == ' ')
+								end++;
+						fb_text_append(out, line, indent);
+						fb_text_append(out, line + end, len - end);
+				} else {
+						fb_text_append(out, line, t->comment_indent);
+						fb_text_append(out, t->comment, comment_len);
+						fb_text_append(out, " ", 1);
+						fb_text_append(out, line + t->comment_indent, len - t->comment_indent);
+				}
+				return 1;
+		}
+		case VIM_LOWER_CASE:
+		case VIM_UPPER_CASE:
+		case VIM_TOGGLE_CASE: {
+				int start, end;
+				if (t->block) {
+						struct fb_span span = fb_block_span(t->fb, offset, t->left, t->right, NULL, NULL);
+						start = span.start - offset;
+						end = span.end - offset;
+				} else {
+						start = MAX(t->from - offset, 0);
+						end = MIN(t->to - offset, len);
+				}
+				if (start >= end)
+						return 0;
+				fb_text_append(out, line, start);
+				for (int i = start, charsize; i < end; i += charsize) {
+						rune_t u;
+						charsize = MAX(utf8_decode_buffer(line + i, end - i, &u), 1);
+						rune_t changed = u == UTF_INVALID ? u : vim_change_case(u, t->mode);
+						if (changed == u) {
+								fb_text_append(out, line + i, charsize);
+						} else {
+								char encoded[UTF_SIZ];
+								fb_text_append(out, encoded, utf8_encode(changed, encoded));
+						}
+				}
+				fb_text_append(out, line + end, len - end);
+				return 1;
+		}
+		case VIM_TRIM_WHITESPACE: {
+				int end = len;
+				while (end > 0 && (line[end-1] == ' ' || line[end-1] == '\t'))
+						end--;
+				fb_text_append(out, line, end);
+				return 1;
+		}
+		case VIM_TABS_TO_SPACES:
+		case VIM_SPACES_TO_TABS: {
+				// only the indent is converted, with tab stops every tabspaces columns
+				int column = 0;
+				for (int i = 0; i < indent; i++)
+						column = line[i] == '\t' ? (column / (int)tabspaces + 1) * tabspaces : column + 1;
+				if (t->mode == VIM_SPACES_TO_TABS) {
+						for (int i = 0; i < column / (int)tabspaces; i++)
+								fb_text_append(out, "\t", 1);
+						vim_append_spaces(out, column % tabspaces);
+				} else {
+						vim_append_spaces(out, column);
+				}
+				fb_text_append(out, line + indent, len - indent);
+				return 1;
+		}
+		}
+		return 0;
+}
+
+static int
+vim_transform(int custom_mode)
+{
+		struct file_buffer* fb = get_fb(focused_window);
+		struct vim_transform_data t = {.fb = fb, .mode = custom_mode, .from = 0, .to = fb->len};
+		int is_case = custom_mode == VIM_LOWER_CASE || custom_mode == VIM_UPPER_CASE || custom_mode == VIM_TOGGLE_CASE;
+		int selection = fb->mode & FB_SELECTION_ON;
+		int first_line, last_line, cursor = -1;
+		if (selection && fb->mode & FB_BLOCK_SELECT) {
+				fb_get_block(fb, &first_line, &last_line, &t.left, &t.right);
+				t.block = 1;
+				cursor = vim_block_start();
+		} else if (selection || custom_mode >= VIM_TRIM_WHITESPACE) {
+				vim_line_range(&first_line, &last_line);
+				if (selection && !(fb->mode & FB_LINE_SELECT)) {
+						t.from = cursor = MIN(fb->s1o, fb->s2o);
+						// the selection ends with the whole char it is on
+						t.to = MAX(fb->s1o, fb->s2o);
+						if (t.to < fb->len)
+								t.to += MAX(fb_utf8_decode(fb, t.to, NULL), 1);
+				}
+		} else {
+				int count = vim_chain_parse_count(0);
+				first_line = fb_offset_to_line(fb, focused_window->cursor_offset);
+				last_line = first_line + count - 1;
+				if (is_case) {
+						// like vim ~ only changes count chars from the cursor
+						t.from = focused_window->cursor_offset;
+						t.to = t.from;
+						while (count-- && t.to < fb->len && fb_char(fb, t.to) != '\n')
+								t.to += MAX(fb_utf8_decode(fb, t.to, NULL), 1);
+						last_line = first_line;
+						cursor = t.to;
+				}
+		}
+
+		if (custom_mode == VIM_COMMENT) {
+#ifdef SYNTAX_H_
+				const struct syntax_scheme* cs = fb_get_syntax_scheme(fb);
+				t.comment = cs ? cs->line_comment : NULL;
+#endif
+				if (!t.comment) {
+						writef_to_status_bar("no line comment known for this file type");
+						return -1;
+				}
+				t.uncomment = 1;
+				t.comment_indent = fb->len;
+				fb_transform_lines(fb, first_line, last_line, vim_comment_scan, &t);
+		}
+		int changed;
+		if (custom_mode == VIM_REINDENT || custom_mode == VIM_REINDENT_BUFFER) {
+#ifdef SYNTAX_H_
+				changed = fb_reindent_lines(fb, first_line, last_line);
+#else
+				writef_to_status_bar("no indent scheme for this file type");
+				return -1;
+#endif
+		} else {
+				changed = fb_transform_lines(fb, first_line, last_line, vim_transform_line, &t);
+		}
+
+		if (selection)
+				vim_change_mode(VIM_NORMAL);
+		if (!is_case || cursor < 0) {
+				// the start of the first line, after the indent
+				cursor = fb_line_to_offset(fb, first_line);
+				while (cursor >= 0 && cursor < fb->len && (fb_char(fb, cursor) == ' ' || fb_char(fb, cursor) == '\t'))
+						cursor++;
+		}
+		if (cursor >= 0)
+				wb_move_to_offset(focused_window, MIN(cursor, fb->len), CURSOR_COMMAND_MOVEMENT);
+		writef_to_status_bar("%d line%s changed", changed, changed == 1 ? "" : "s");
+		return -1;
+}
+
+// sorts the lines of the selection or of the whole buffer, custom_mode has the fb_sort_flags
+// with a count the lines are compared by that blank separated field
+static int
+vim_sort(int custom_mode)
+{
+		struct file_buffer* fb = get_fb(focused_window);
+		int first_line, last_line;
+		vim_line_range(&first_line, &last_line);
+		int column = vim_chain_parse_count_raw();
+		int lines = fb_sort_lines(fb, first_line, last_line, custom_mode, column);
+		if (!lines)
+				return -1;
+		if (fb->mode & FB_SELECTION_ON)
+				vim_change_mode(VIM_NORMAL);
+		wb_move_to_offset(focused_window, fb_line_to_offset(fb, first_line), CURSOR_COMMAND_MOVEMENT);
+		int removed = last_line - first_line + 1 - lines;
+		if (custom_mode & FB_SORT_KEEP_ORDER)
+				writef_to_status_bar("%d duplicate line%s removed", removed, removed == 1 ? "" : "s");
+		else if (custom_mode & FB_SORT_UNIQUE)
+				writef_to_status_bar("%d lines sorted, %d duplicates removed", lines, removed);
+		else
+				writef_to_status_bar("%d lines sorted", lines);
+		return -1;
+}
+
+// the next typed char is the delimiter to align the lines of the selection
+// or of the whole buffer on
+static int vim_align_pending = 0;
+
+static int
+vim_align(int custom_mode)
+{
+		vim_align_pending = 1;
+		writef_to_status_bar("align on-");
+		return -2;
+}
+
+struct vim_align_data {
+		const char* delimiter;
+		int delimiter_len;
+		int column;
+};
+
+// where the first delimiter of the line is, and in *column the width of the
+// text before it without the blanks in front of the delimiter
+static int
+vim_align_find(struct vim_align_data* a, const char* line, int len, int* column, int* text_end)
+{
+		int at = 0;
+		for (;;) {
+				const char* p = memchr(line + at, a->delimiter[0], len - at);
+				if (!p || p - line + a->delimiter_len > len)
+						return -1;
+				at = p - line;
+				if (!memcmp(p, a->delimiter, a->delimiter_len))
+						break;
+				at++;
+		}
+		*text_end = at;
+		while (*text_end > 0 && (line[*text_end-1] == ' ' || line[*text_end-1] == '\t'))
+				*text_end -= 1;
+		*column = 0;
+		for (int i = 0, charsize; i < *text_end; i += charsize) {
+				rune_t u;
+				charsize = MAX(utf8_decode_buffer(line + i, *text_end - i, &u), 1);
+				if (u == '\t')
+						*column = (*column / (int)tabspaces + 1) * tabspaces;
+				else
+						*column += MAX(wcwidth(u), 0);
+		}
+		return at;
+}
+
+// the delimiters go one column after the widest text in front of them,
+// or right after it if none of them had a blank in front
+static int
+vim_align_scan(struct fb_text* out, const char* line, int len, int offset, void* data)
+{
+		struct vim_align_data* a = data;
+		int column, text_end;
+		int at = vim_align_find(a, line, len, &column, &text_end);
+		if (at >= 0)
+				a->column = MAX(a->column, column + (text_end < at));
+		return 0;
+}
+
+static int
+vim_align_line(struct fb_text* out, const char* line, int len, int offset, void* data)
+{
+		struct vim_align_data* a = data;
+		int column, text_end;
+		int at = vim_align_find(a, line, len, &column, &text_end);
+		if (at < 0)
+				return 0;
+		fb_text_append(out, line, text_end);
+		vim_append_spaces(out, a->column - column);
+		fb_text_append(out, line + at, len - at);
+		return 1;
+}
+
+static void
+vim_align_lines(const char* delimiter, int len)
+{
+		struct file_buffer* fb = get_fb(focused_window);
+		int first_line, last_line;
+		vim_line_range(&first_line, &last_line);
+		struct vim_align_data a = {.delimiter = delimiter, .delimiter_len = len};
+		fb_transform_lines(fb, first_line, last_line, vim_align_scan, &a);
+		int changed = fb_transform_lines(fb, first_line, last_line, vim_align_line, &a);
+		if (fb->mode & FB_SELECTION_ON)
+				vim_change_mode(VIM_NORMAL);
+		wb_move_to_offset(focused_window, fb_line_to_offset(fb, first_line), CURSOR_COMMAND_MOVEMENT);
+		writef_to_status_bar("%d line%s aligned", changed, changed == 1 ? "" : "s");
+}
+
 static int
 vim_yank(int custom_mode)
 {
@@ -688,7 +1217,10 @@ vim_yank(int custom_mode)
 		int len;
 		if (custom_mode == VIM_CURRENT_SELECTION || fb->mode & FB_SELECTION_ON) {
 				buf = fb_get_selection(fb, &len);
-				wb_move_cursor_to_selection_start(focused_window);
+				if (fb->mode & FB_BLOCK_SELECT)
+						wb_move_to_offset(focused_window, vim_block_start(), CURSOR_COMMAND_MOVEMENT);
+				else
+						wb_move_cursor_to_selection_start(focused_window);
 				fb->mode &= ~FB_SELECT_MASK;
 				vim_change_mode(VIM_NORMAL);
 		} else {
@@ -720,13 +1252,11 @@ vim_auto_indent_current_line(int custom_mode)
 {
 		struct file_buffer* fb = get_fb(focused_window);
 		focused_window->cursor_offset = fb_seek_char_backwards(fb, focused_window->cursor_offset, '\n');
-		int indent_size = fb_auto_indent(fb, focused_window->cursor_offset);
+		fb_auto_indent(fb, focused_window->cursor_offset);
 
 		focused_window->cursor_offset = MIN(fb_seek_not_whitespace(fb, focused_window->cursor_offset),
 											fb_seek_char(fb, focused_window->cursor_offset, '\n'));
 
-		window_node_move_all_cursors_on_same_fb(&root_node, focused_node, focused_window->fb_index, focused_window->cursor_offset,
-												wb_move_offset_relative, indent_size, CURSOR_COMMAND_MOVEMENT);
 		return -2;
 }
 
@@ -737,6 +1267,7 @@ vim_open_file_browser(int custom_mode)
 		struct file_buffer* fb = get_fb(focused_window);
 
 		char* path = file_path_get_path(fb->file_path);
+		wb_clear_cursors(focused_window);
 		*focused_window = wb_new(fb_new_entry(path));
 		focused_window->cursor_col = last_fb;
 		free(path);
@@ -765,54 +1296,83 @@ vim_search_keyword_in_buffers(int custom_mode)
 		return -2;
 }
 
+// the range count repeats of a motion from the cursor cover, found before
+// anything is removed so it can be removed in one go
+// only the word motions and lines continue where the last one ended,
+// the other motions are only done once
 static int
-vim_delete(int custom_mode)
+vim_count_range(int delimiter_type, int count, int* start, int* end)
 {
-		int count = vim_chain_parse_count(custom_mode);
-		while (count--) {
-				int start, end;
-				if (!vim_get_delimiter(custom_mode, focused_window->cursor_offset, &start, &end)) {
-						writef_to_status_bar("unable to find section to delete");
-						return -1;
+		struct file_buffer* fb = get_fb(focused_window);
+		if (!vim_get_delimiter(delimiter_type, focused_window->cursor_offset, start, end))
+				return 0;
+		int forward = delimiter_type == VIM_CURRENT_LINE ||
+				delimiter_type == VIM_TO_START_OF_WORD || delimiter_type == VIM_TO_END_OF_WORD ||
+				delimiter_type == VIM_TO_START_OF_STRING || delimiter_type == VIM_TO_END_OF_STRING;
+		int backward = delimiter_type == VIM_PREV_WORD_START || delimiter_type == VIM_PREV_STRING_START;
+		for (int i = 1; i < count && (forward || backward); i++) {
+				int next_start, next_end;
+				if (forward) {
+						if (*end >= fb->len || !vim_get_delimiter(delimiter_type, *end, &next_start, &next_end) ||
+							next_end <= *end)
+								break;
+						*end = next_end;
+				} else {
+						if (*start <= 0 || !vim_get_delimiter(delimiter_type, *start, &next_start, &next_end) ||
+							next_start >= *start)
+								break;
+						*start = next_start;
 				}
-				if (start - end == 0)
-						return -2;
-				struct file_buffer* fb = get_fb(focused_window);
-				fb_remove(fb, start, end - start, 1, 1);
-				call_extension(fb_contents_updated, fb, focused_window->cursor_offset, FB_CONTENT_BIG_CHANGE);
+		}
+		return 1;
+}
+
+static int
+vim_delete(int custom_mode)
+{
+		if (custom_mode == VIM_CURRENT_SELECTION && get_fb(focused_window)->mode & FB_BLOCK_SELECT) {
+				int start = vim_block_start();
+				fb_remove_selection(get_fb(focused_window));
+				vim_change_mode(VIM_NORMAL);
 				wb_move_to_offset(focused_window, start, CURSOR_COMMAND_MOVEMENT);
-				window_node_move_all_cursors_on_same_fb(&root_node, focused_node, focused_window->fb_index, end,
-														wb_move_offset_relative, end - start, CURSOR_COMMAND_MOVEMENT);
-				if (custom_mode == VIM_CURRENT_SELECTION) {
-						vim_change_mode(VIM_NORMAL);
-						break;
-				}
+				return -1;
+		}
+		int count = vim_chain_parse_count(custom_mode);
+		int start, end;
+		if (!vim_count_range(custom_mode, count, &start, &end)) {
+				writef_to_status_bar("unable to find section to delete");
+				return -1;
 		}
+		if (start - end == 0)
+				return -2;
+		struct file_buffer* fb = get_fb(focused_window);
+		fb_begin_transaction(fb);
+		fb_remove(fb, start, end - start, 1, 0);
+		fb_commit_transaction(fb, FB_CONTENT_BIG_CHANGE);
+		wb_move_to_offset(focused_window, start, CURSOR_COMMAND_MOVEMENT);
+		if (custom_mode == VIM_CURRENT_SELECTION)
+				vim_change_mode(VIM_NORMAL);
 		return -1;
 }
 
 static int
 vim_change(int custom_mode)
 {
+		if (custom_mode == VIM_CURRENT_SELECTION && get_fb(focused_window)->mode & FB_BLOCK_SELECT)
+				return vim_block_insert(VIM_BLOCK_CHANGE);
 		int count = vim_chain_parse_count(custom_mode);
-		while (count--) {
-				int start, end;
-				if (!vim_get_delimiter(custom_mode, focused_window->cursor_offset, &start, &end)) {
-						writef_to_status_bar("unable to find section to change");
-						return -1;
-				}
-				if (start - end == 0)
-						return -2;
-				struct file_buffer* fb = get_fb(focused_window);
-				fb_remove(fb, start, end - start, 1, 1);
-				call_extension(fb_contents_updated, fb, focused_window->cursor_offset, FB_CONTENT_BIG_CHANGE);
-				wb_move_to_offset(focused_window, start, CURSOR_COMMAND_MOVEMENT);
-				window_node_move_all_cursors_on_same_fb(&root_node, focused_node, focused_window->fb_index, end,
-														wb_move_offset_relative, end - start, CURSOR_COMMAND_MOVEMENT);
-				if (custom_mode == VIM_CURRENT_SELECTION)
-						break;
-
+		int start, end;
+		if (!vim_count_range(custom_mode, count, &start, &end)) {
+				writef_to_status_bar("unable to find section to change");
+				return -1;
 		}
+		if (start - end == 0)
+				return -2;
+		struct file_buffer* fb = get_fb(focused_window);
+		fb_begin_transaction(fb);
+		fb_remove(fb, start, end - start, 1, 0);
+		fb_commit_transaction(fb, FB_CONTENT_BIG_CHANGE);
+		wb_move_to_offset(focused_window, start, CURSOR_COMMAND_MOVEMENT);
 		vim_change_mode(VIM_INSERT);
 		return -1;
 }
@@ -849,11 +1409,29 @@ vim_visual_delimit(int custom_mode)
 
 static int vim_enter(int custom_mode) {return 1;}
 
+// moves the extra cursors to the start or end of a delimiter, like the main cursor
+static void
+vim_move_extra_cursors(int delimiter_type, int to_end)
+{
+		struct file_buffer* fb = get_fb(focused_window);
+		for (int i = 0; i < wb_cursor_count(focused_window); i++) {
+				int start, end;
+				if (vim_get_delimiter(delimiter_type, wb_cursor_offset(focused_window, i), &start, &end))
+						fb_mark_move(fb, focused_window->cursors[i], to_end ? end : start);
+		}
+}
+
 static int
 vim_append(int custom_mode)
 {
 		vim_change_mode(VIM_INSERT);
 		wb_move_on_line(focused_window, 1, CURSOR_COMMAND_MOVEMENT);
+		struct file_buffer* fb = get_fb(focused_window);
+		for (int i = 0; i < wb_cursor_count(focused_window); i++) {
+				int offset = wb_cursor_offset(focused_window, i);
+				if (offset < fb->len && fb_char(fb, offset) != '\n')
+						fb_mark_move(fb, focused_window->cursors[i], offset+1);
+		}
 		return -1;
 }
 
@@ -864,6 +1442,7 @@ vim_insert_start(int custom_mode)
 		int start, tmp;
 		if (vim_get_delimiter(VIM_TO_END_OF_INDENT, focused_window->cursor_offset, &start, &tmp))
 				wb_move_to_offset(focused_window, start, CURSOR_COMMAND_MOVEMENT);
+		vim_move_extra_cursors(VIM_TO_END_OF_INDENT, 0);
 		return -1;
 }
 
@@ -874,6 +1453,7 @@ vim_insert_end(int custom_mode)
 		int end, tmp;
 		if (vim_get_delimiter(VIM_TO_END_OF_LINE, focused_window->cursor_offset, &tmp, &end))
 				wb_move_to_offset(focused_window, end, CURSOR_COMMAND_MOVEMENT);
+		vim_move_extra_cursors(VIM_TO_END_OF_LINE, 1);
 		return -1;
 }
 
@@ -890,56 +1470,59 @@ vim_insert_new_line(int custom_mode)
 		focused_window->cursor_offset = offset;
 		wb_move_offset_relative(focused_window, 1, CURSOR_COMMAND_MOVEMENT);
 
+		fb_begin_transaction(fb);
 		fb_insert(fb, "\n", 1, offset, 0);
-		window_node_move_all_cursors_on_same_fb(&root_node, focused_node, focused_window->fb_index, focused_window->cursor_offset,
-												wb_move_offset_relative, 1, CURSOR_COMMAND_MOVEMENT);
 		vim_auto_indent_current_line(0);
+		fb_commit_transaction(fb, FB_CONTENT_NORMAL_EDIT);
 
 		return -1;
 }
 
+// joins count lines to the cursor line as one batch of edits, the whitespace
+// around the joined '\n' becomes one space, joining an empty line adds nothing
 static int
 vim_remove_newline_at_end(int custom_mode)
 {
 		int count = vim_chain_parse_count(0);
 		struct file_buffer* fb = get_fb(focused_window);
-		while (count--) {
-				int offset = fb_seek_char(fb, focused_window->cursor_offset, '\n');
-				fb_remove(fb, offset, 1, 1, 0);
-				wb_move_to_offset(focused_window, offset, CURSOR_COMMAND_MOVEMENT);
-				window_node_move_all_cursors_on_same_fb(&root_node, focused_node, focused_window->fb_index, offset,
-														wb_move_offset_relative, -1, CURSOR_COMMAND_MOVEMENT);
-
-				LIMIT(offset, 0, fb->len);
-				if (isspace(fb->contents[offset])) {
-						int start, end;
-						int not_whitespace = fb_seek_not_whitespace_backwards(fb, offset);
-						if (not_whitespace >= 0)
-								not_whitespace += 1;
-						int line_start = fb_seek_char_backwards(fb, offset, '\n');
-						start = MAX(not_whitespace, line_start);
-
-						not_whitespace = fb_seek_not_whitespace(fb, offset);
-						line_start = fb_seek_char(fb, offset, '\n');
-						end = MIN(not_whitespace, line_start);
-						if (end < 0)
-								end = MAX(not_whitespace, line_start);
-
-						if (end < 0 || start < 0)
-								return -1;
-
-						if (fb->contents[offset] != '\n') {
-								fb_remove(fb, start, end - start, 1, 0);
-								fb_insert(fb, " ", 1, start, 1);
-								start++;
-								wb_move_to_offset(focused_window, start, CURSOR_COMMAND_MOVEMENT);
-								window_node_move_all_cursors_on_same_fb(&root_node, focused_node, focused_window->fb_index, end,
-																		wb_move_offset_relative, end - start, CURSOR_COMMAND_MOVEMENT);
+		struct storage_edit* edits = xmalloc(count * sizeof(struct storage_edit));
+		int edit_count = 0, cursor = -1, shift = 0;
+		int line_start = fb_line_to_offset(fb, fb_offset_to_line(fb, focused_window->cursor_offset));
+		int newline = fb_seek_char(fb, focused_window->cursor_offset, '\n');
+		for (int i = 0; i < count && newline >= 0 && newline + 1 < fb->len; i++, newline = fb_seek_char(fb, newline + 1, '\n')) {
+				struct storage_edit edit = {.offset = newline, .removed = 1, .data = " ", .len = 1};
+				int next = newline + 1, after_space = 0;
+				if (fb_char(fb, next) == '\n') {
+						edit.len = 0;
+				} else if (isspace(fb_char(fb, next))) {
+						after_space = 1;
+						while (edit.offset > line_start && isspace(fb_char(fb, edit.offset - 1)))
+								edit.offset--;
+						int end = next;
+						while (end < fb->len && fb_char(fb, end) != '\n' && isspace(fb_char(fb, end)))
+								end++;
+						edit.removed = end - edit.offset;
+						// a line of only whitespace left a space that this one replaces
+						struct storage_edit* last = edit_count ? edits + edit_count - 1 : NULL;
+						if (last && last->len && edit.offset == last->offset + last->removed) {
+								shift -= last->len - last->removed;
+								edit.removed += edit.offset - last->offset;
+								edit.offset = last->offset;
+								edit_count--;
 						}
-				} else {
-						fb_insert(fb, " ", 1, offset, 1);
 				}
+				// where the cursor ends up after the edits before it
+				cursor = edit.offset + shift + after_space;
+				shift += edit.len - edit.removed;
+				line_start = edit.offset + edit.removed;
+				edits[edit_count++] = edit;
 		}
+		fb_begin_transaction(fb);
+		fb_apply_edits(fb, edits, edit_count, 0);
+		fb_commit_transaction(fb, FB_CONTENT_BIG_CHANGE);
+		free(edits);
+		if (cursor >= 0)
+				wb_move_to_offset(focused_window, cursor, CURSOR_COMMAND_MOVEMENT);
 		return -1;
 }
 
@@ -1013,6 +1596,155 @@ vim_search(int custom_mode)
 		return -2;
 }
 
+// the command line opened with ':', the typed keys go to vim_command_line_key
+static char vim_command[SEARCH_TERM_MAX_LEN];
+static int vim_command_open = 0;
+// the lines a command without a range works on,
+// the selection the command line was opened on or the cursor line
+static int vim_command_first_line, vim_command_last_line;
+
+static int
+vim_open_command_line(int custom_mode)
+{
+		struct file_buffer* fb = get_fb(focused_window);
+		if (fb->mode & FB_SELECTION_ON) {
+				vim_line_range(&vim_command_first_line, &vim_command_last_line);
+				vim_change_mode(VIM_NORMAL);
+		} else {
+				vim_command_first_line = fb_offset_to_line(fb, focused_window->cursor_offset);
+				vim_command_last_line = vim_command_first_line;
+		}
+		vim_command_open = 1;
+		*vim_command = 0;
+		writef_to_status_bar(":");
+		return -1;
+}
+
+// :[%]s/pattern/replacement/[flags]
+// % is the whole buffer, any char that isn't a letter, digit or blank can be
+// used instead of /, and is escaped with \ inside the pattern and replacement
+// flags: g replaces every match on a line instead of the first,
+// i ignores case and l takes the pattern literally instead of as a regex
+// an empty pattern is the last search term
+static void
+vim_substitute(const char* command, int first_line, int last_line)
+{
+		struct file_buffer* fb = get_fb(focused_window);
+		char delimiter = command[0];
+		if (!delimiter || isalnum(delimiter) || isspace(delimiter) || delimiter == '\\') {
+				writef_to_status_bar("usage: [%%]s/pattern/replacement/[gil]");
+				return;
+		}
+
+		// pattern, replacement and flags
+		static char parts[3][SEARCH_TERM_MAX_LEN];
+		int part = 0, len = 0;
+		for (const char* c = command + 1; *c && len < SEARCH_TERM_MAX_LEN - 2; c++) {
+				if (*c == delimiter && part < 2) {
+						parts[part++][len] = 0;
+						len = 0;
+						continue;
+				}
+				if (*c == '\\' && c[1] == delimiter)
+						c++;
+				else if (*c == '\\' && c[1])
+						parts[part][len++] = *c++;
+				parts[part][len++] = *c;
+		}
+		parts[part][len] = 0;
+		for (part++; part < 3; part++)
+				*parts[part] = 0;
+
+		int flags = FB_REPLACE_REGEX | FB_REPLACE_ONCE_PER_LINE;
+		for (const char* f = parts[2]; *f; f++) {
+				if (*f == 'g') {
+						flags &= ~FB_REPLACE_ONCE_PER_LINE;
+				} else if (*f == 'i') {
+						flags |= FB_REPLACE_IGNORE_CASE;
+				} else if (*f == 'l') {
+						flags &= ~FB_REPLACE_REGEX;
+				} else {
+						writef_to_status_bar("unknown flag '%c', the flags are g, i and l", *f);
+						return;
+				}
+		}
+		const char* pattern = parts[0];
+		if (!*pattern) {
+				// the search term isn't a regex
+				pattern = fb->search_term;
+				flags &= ~FB_REPLACE_REGEX;
+				if (!pattern || !*pattern) {
+						writef_to_status_bar("no previous search term");
+						return;
+				}
+		}
+
+		int start = fb_line_to_offset(fb, first_line);
+		int end = fb_line_to_offset(fb, last_line + 1);
+		end = end < 0 ? fb->len : end - 1;
+
+		struct timespec t0, t1;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		int last_match = -1;
+		int count = fb_replace(fb, start, end, pattern, parts[1], flags, &last_match);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		// the status bar already says why
+		if (count < 0 || (!count && fb->mode & FB_READ_ONLY))
+				return;
+
+		if (last_match >= 0)
+				wb_move_to_offset(focused_window, fb_line_to_offset(fb, fb_offset_to_line(fb, last_match)), CURSOR_COMMAND_MOVEMENT);
+		double ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+		writef_to_status_bar("%d substitution%s in %.1f ms", count, count == 1 ? "" : "s", ms);
+}
+
+static void
+vim_run_command(const char* command)
+{
+		int first_line = vim_command_first_line, last_line = vim_command_last_line;
+		while (*command == ' ')
+				command++;
+		if (*command == '%') {
+				vim_line_range(&first_line, &last_line);
+				command++;
+		}
+		if (*command == 's')
+				vim_substitute(command + 1, first_line, last_line);
+		else if (*command)
+				writef_to_status_bar("unknown command \"%s\"", command);
+		else
+				writef_to_status_bar("Escape");
+}
+
+// returns 1 if the key went to the command line
+static int
+vim_command_line_key(KeySym keycode, const char* buf, int len)
+{
+		if (!vim_command_open)
+				return 0;
+		if (keycode == XK_Escape || (keycode == XK_BackSpace && !*vim_command)) {
+				vim_command_open = 0;
+				writef_to_status_bar("Escape");
+				return 1;
+		}
+		if (keycode == XK_Return) {
+				vim_command_open = 0;
+				vim_run_command(vim_command);
+				return 1;
+		}
+		if (keycode == XK_BackSpace) {
+				utf8_remove_string_end(vim_command);
+		} else if (len > 0 && (buf[0] >= 32 || len > 1)) {
+				int command_len = strlen(vim_command);
+				if (command_len + len < SEARCH_TERM_MAX_LEN) {
+						memcpy(vim_command + command_len, buf, len);
+						vim_command[command_len + len] = 0;
+				}
+		}
+		writef_to_status_bar(":%s", vim_command);
+		return 1;
+}
+
 static int
 vim_home(int custom_mode)
 {
@@ -1070,20 +1802,33 @@ vim_center_scroll(int custom_mode)
 static int
 vim_remove_one_char(int custom_mode)
 {
-		struct window_split_node* excluded = (custom_mode == 0) ? focused_node : NULL;
+		int times = vim_chain_parse_count(0);
+		struct file_buffer* fb = get_fb(focused_window);
+		if (!custom_mode && wb_cursor_count(focused_window)) {
+				wb_edit_at_cursors(focused_window, 0, times, NULL, 0);
+				return -1;
+		}
 
+		// the chars are counted first and removed as one edit,
+		// backwards from the cursor or forwards from custom_mode chars after it
 		int old_offset = focused_window->cursor_offset;
-		if (custom_mode)
-				wb_move_on_line(focused_window, custom_mode, CURSOR_DO_NOT_CALLBACK);
-		int offset = focused_window->cursor_offset;
+		int start, end;
+		if (custom_mode < 0) {
+				wb_move_on_line(focused_window, custom_mode * times, CURSOR_DO_NOT_CALLBACK);
+				start = focused_window->cursor_offset;
+				end = old_offset;
+		} else {
+				if (custom_mode)
+						wb_move_on_line(focused_window, custom_mode, CURSOR_DO_NOT_CALLBACK);
+				start = end = focused_window->cursor_offset;
+				while (times-- && end < fb->len && fb_char(fb, end) != '\n')
+						end += MAX(fb_utf8_decode(fb, end, NULL), 1);
+		}
 		focused_window->cursor_offset = old_offset;
-
-		int times = vim_chain_parse_count(0);
-		struct file_buffer* fb = get_fb(focused_window);
-		while (times-- && fb->contents[offset] != '\n') {
-				int len = fb_remove(fb, offset, 1, 0, 0);
-				window_node_move_all_cursors_on_same_fb(&root_node, excluded, focused_window->fb_index, offset,
-														wb_move_offset_relative, -len, CURSOR_COMMAND_MOVEMENT);
+		if (end > start) {
+				fb_remove(fb, start, end - start, 1, 0);
+				if (custom_mode < 0)
+						wb_move_to_offset(focused_window, start, CURSOR_COMMAND_MOVEMENT);
 		}
 		return -1;
 }
@@ -1092,13 +1837,16 @@ static int
 vim_backspace(int custom_mode)
 {
 		struct file_buffer* fb = get_fb(focused_window);
+		if (wb_cursor_count(focused_window)) {
+				wb_edit_at_cursors(focused_window, 1, 0, NULL, 0);
+				return -1;
+		}
 		int offset = focused_window->cursor_offset-1;
 		if (offset <= 0 || offset >= fb->len)
 				return -1;
-		if (fb->contents[offset] == '\n') {
+		if (fb_char(fb, offset) == '\n') {
 				fb_remove(fb, offset, 1, 1, 0);
-				window_node_move_all_cursors_on_same_fb(&root_node, NULL, focused_window->fb_index, offset,
-														wb_move_offset_relative, -1, CURSOR_COMMAND_MOVEMENT);
+				wb_move_offset_relative(focused_window, -1, CURSOR_COMMAND_MOVEMENT);
 		} else {
 				vim_remove_one_char(-1);
 		}
@@ -1110,14 +1858,18 @@ vim_insert_return(int custom_mode)
 {
 		struct file_buffer* fb = get_fb(focused_window);
 		int offset = focused_window->cursor_offset;
+		if (wb_cursor_count(focused_window)) {
+				wb_edit_at_cursors(focused_window, 0, 0, "\n", 1);
+				return -1;
+		}
 
+		fb_begin_transaction(fb);
 		fb_insert(fb, "\n", 1, offset, 0);
 		int indent_size = fb_auto_indent(fb, offset);
-		window_node_move_all_cursors_on_same_fb(&root_node, NULL, focused_window->fb_index, offset,
-												wb_move_offset_relative, indent_size + 1, 0);
+		wb_move_offset_relative(focused_window, indent_size + 1, 0);
 		indent_size = fb_auto_indent(fb, offset + 1 + indent_size);
-		window_node_move_all_cursors_on_same_fb(&root_node, NULL, focused_window->fb_index, offset,
-												wb_move_offset_relative, indent_size, CURSOR_COMMAND_MOVEMENT);
+		fb_commit_transaction(fb, FB_CONTENT_NORMAL_EDIT);
+		wb_move_offset_relative(focused_window, indent_size, CURSOR_COMMAND_MOVEMENT);
 		window_node_move_all_yscrolls(&root_node, focused_node, focused_window->fb_index, focused_window->cursor_offset, 1);
 		return -1;
 }
@@ -1127,10 +1879,71 @@ vim_insert_tab(int custom_mode)
 {
 		int offset = focused_window->cursor_offset;
 		struct file_buffer* fb = get_fb(focused_window);
+		if (wb_cursor_count(focused_window)) {
+				wb_edit_at_cursors(focused_window, 0, 0, "\t", 1);
+				return -1;
+		}
 
 		fb_insert(fb, "\t", 1, offset, 0);
-		window_node_move_all_cursors_on_same_fb(&root_node, NULL, focused_window->fb_index, offset,
-												wb_move_on_line, 1, CURSOR_COMMAND_MOVEMENT);
+		wb_move_on_line(focused_window, 1, CURSOR_COMMAND_MOVEMENT);
+		return -1;
+}
+
+// adds a cursor at the next match of the word under the cursor,
+// after the last cursor, at the same place in the word
+static int
+vim_add_cursor_next_match(int custom_mode)
+{
+		struct file_buffer* fb = get_fb(focused_window);
+		int start, end;
+		if (!vim_get_delimiter(VIM_CURRENT_WORD, focused_window->cursor_offset, &start, &end) || end <= start) {
+				writef_to_status_bar("no word under the cursor");
+				return -1;
+		}
+		char* word = fb_get_string_between_offsets(fb, start, end);
+		int relative = focused_window->cursor_offset - start;
+
+		int last = focused_window->cursor_offset;
+		for (int i = 0; i < wb_cursor_count(focused_window); i++)
+				last = MAX(last, wb_cursor_offset(focused_window, i));
+
+		int count = vim_chain_parse_count(0);
+		while (count--) {
+				int match = fb_seek_string(fb, last - relative + 1, word);
+				if (match < 0)
+						match = fb_seek_string(fb, 0, word);
+				if (match < 0 || !wb_add_cursor(focused_window, match + relative))
+						break;
+				last = match + relative;
+		}
+		free(word);
+		writef_to_status_bar("%d cursors", wb_cursor_count(focused_window) + 1);
+		return -1;
+}
+
+// adds a cursor at the same column on the line below (or above) the last cursor
+static int
+vim_add_cursor_line(int custom_mode)
+{
+		struct file_buffer* fb = get_fb(focused_window);
+		int column = fb_offset_to_column(fb, focused_window->cursor_offset);
+
+		int last = focused_window->cursor_offset;
+		for (int i = 0; i < wb_cursor_count(focused_window); i++) {
+				int offset = wb_cursor_offset(focused_window, i);
+				last = custom_mode > 0 ? MAX(last, offset) : MIN(last, offset);
+		}
+
+		int line = fb_offset_to_line(fb, last);
+		int count = vim_chain_parse_count(0);
+		while (count--) {
+				line += custom_mode;
+				int line_start = line < 0 ? -1 : fb_line_to_offset(fb, line);
+				if (line_start < 0)
+						break;
+				wb_add_cursor(focused_window, fb_column_to_offset(fb, line_start, column));
+		}
+		writef_to_status_bar("%d cursors", wb_cursor_count(focused_window) + 1);
 		return -1;
 }
 
@@ -1157,6 +1970,8 @@ vim_move(int custom_mode)
 }
 
 static int vim_repeat_last_command(int custom_mode);
+static int vim_macro_record(int custom_mode);
+static int vim_macro_play(int custom_mode);
 
 #define numbers()								\
 		{0, XK_0, vim_zero},					\
@@ -1194,6 +2009,27 @@ static int vim_repeat_last_command(int custom_mode);
 
 #define CHAIN_COUNT(_x) (_x)
 
+// work on the selected lines in visual mode and on the whole buffer otherwise
+// a count sorts by that blank separated field
+#define VIM_LINE_COMMANDS()												\
+		{0, XK_t, vim_enter, 0, "transform lines [...]", (struct chained_keybind[]) { \
+						{0, XK_w, vim_transform, VIM_TRIM_WHITESPACE},			\
+						{0, XK_s, vim_transform, VIM_TABS_TO_SPACES},			\
+						{0, XK_t, vim_transform, VIM_SPACES_TO_TABS},			\
+						{0, XK_i, vim_transform, VIM_REINDENT_BUFFER},			\
+				}, CHAIN_COUNT(4),												\
+		},																		\
+		{0, XK_o, vim_enter, 0, "order lines [...]", (struct chained_keybind[]) { \
+						{0, XK_s, vim_sort, 0},									\
+						{XK_ANY_MOD, XK_S, vim_sort, FB_SORT_REVERSE},			\
+						{0, XK_n, vim_sort, FB_SORT_NUMERIC},					\
+						{XK_ANY_MOD, XK_N, vim_sort, FB_SORT_NUMERIC | FB_SORT_REVERSE}, \
+						{0, XK_u, vim_sort, FB_SORT_UNIQUE},					\
+						{0, XK_d, vim_sort, FB_SORT_UNIQUE | FB_SORT_KEEP_ORDER}, \
+						{0, XK_a, vim_align},									\
+				}, CHAIN_COUNT(7),												\
+		}
+
 struct chained_keybind normal_mode_keybinds[]  = {
 		numbers(),
 		// se specific keybinds, all followed by SPC, inspired by Emacs evil-mode
@@ -1222,8 +2058,9 @@ struct chained_keybind normal_mode_keybinds[]  = {
 										{0, XK_s, vim_search_for_buffer},
 										{0, XK_w, vim_save_buffer},
 										{0, XK_space, vim_search_for_buffer},
+										{0, XK_r, vim_toggle_read_only},
 										{XK_ANY_MOD, XK_slash, vim_search_keyword_in_buffers},
-								}, CHAIN_COUNT(5),
+								}, CHAIN_COUNT(6),
 						},
 						{0, XK_space, vim_open_file_browser},
 						{ControlMask, XK_space, vim_search_for_buffer},
@@ -1232,8 +2069,9 @@ struct chained_keybind normal_mode_keybinds[]  = {
 						{XK_ANY_MOD, XK_plus, vim_zoom,  +1},
 						{XK_ANY_MOD, XK_minus, vim_zoom, -1},
 						{XK_ANY_MOD, XK_Home, vim_zoomreset},
+						VIM_LINE_COMMANDS(),
 						numbers(),
-				}, CHAIN_COUNT(36),
+				}, CHAIN_COUNT(38),
 		},
 
 		// movement
@@ -1261,7 +2099,11 @@ struct chained_keybind normal_mode_keybinds[]  = {
 		{XK_ANY_MOD, XK_G, vim_move, VIM_TO_END_OF_FILE},
 		{0, XK_g, vim_enter, 0, "goto", (struct chained_keybind[]) {
 						{0, XK_g, vim_move, VIM_TO_START_OF_FILE},
-				}, CHAIN_COUNT(1),
+						{0, XK_c, vim_enter, 0, "comment", (struct chained_keybind[]) {
+										{0, XK_c, vim_transform, VIM_COMMENT},
+								}, CHAIN_COUNT(1),
+						},
+				}, CHAIN_COUNT(2),
 		},
 
 		// scroll
@@ -1279,14 +2121,33 @@ struct chained_keybind normal_mode_keybinds[]  = {
 		},
 
 		// misc
-		{XK_ANY_MOD, XK_Escape, vim_change_mode, VIM_NORMAL},
+		{XK_ANY_MOD, XK_Escape, vim_escape},
+		{ControlMask, XK_n, vim_add_cursor_next_match},
+		{ControlMask, XK_j, vim_add_cursor_line, +1},
+		{ControlMask, XK_k, vim_add_cursor_line, -1},
 		{0, XK_Tab, vim_auto_indent_current_line},
 		{0, XK_q, vim_exit},
 		{0, XK_u, vim_undo},
 		{0, XK_period, vim_repeat_last_command},
+		{XK_ANY_MOD, XK_Q, vim_macro_record},
+		{XK_ANY_MOD, XK_at, vim_macro_play},
 		{ControlMask, XK_r, vim_redo},
+		{XK_ANY_MOD, XK_asciitilde, vim_transform, VIM_TOGGLE_CASE},
+		{XK_ANY_MOD, XK_greater, vim_enter, 0, "indent", (struct chained_keybind[]) {
+						{XK_ANY_MOD, XK_greater, vim_transform, VIM_INDENT},
+				}, CHAIN_COUNT(1),
+		},
+		{XK_ANY_MOD, XK_less, vim_enter, 0, "outdent", (struct chained_keybind[]) {
+						{XK_ANY_MOD, XK_less, vim_transform, VIM_OUTDENT},
+				}, CHAIN_COUNT(1),
+		},
+		{0, XK_equal, vim_enter, 0, "reindent", (struct chained_keybind[]) {
+						{0, XK_equal, vim_transform, VIM_REINDENT},
+				}, CHAIN_COUNT(1),
+		},
 		{XK_ANY_MOD, XK_slash, vim_search},
 		{XK_ANY_MOD, XK_question, vim_search, 1},
+		{XK_ANY_MOD, XK_colon, vim_open_command_line},
 		{0, XK_n, vim_next},
 		{ShiftMask, XK_N, vim_prev},
 		// copy / yank
@@ -1330,7 +2191,7 @@ struct chained_keybind normal_mode_keybinds[]  = {
 		// visual
 		{0, XK_v, vim_change_mode, VIM_VISUAL},
 		{ShiftMask, XK_V, vim_change_mode, VIM_VISUAL_LINE},
-		//{ControlMask, XK_v, vim_change_mode, VIM_VISUAL},
+		{ControlMask, XK_v, vim_change_mode, VIM_VISUAL_BLOCK},
 
 		// deleting
 		{XK_ANY_MOD, XK_J, vim_remove_newline_at_end},
@@ -1430,7 +2291,8 @@ struct chained_keybind visual_mode_keybinds[]  = {
 		{ShiftMask, XK_B, vim_move, VIM_PREV_STRING_START},
 
 		{XK_ANY_MOD, XK_0, vim_move, VIM_TO_START_OF_LINE},
-		{XK_ANY_MOD, XK_A, vim_move, VIM_TO_END_OF_LINE},
+		{XK_ANY_MOD, XK_A, vim_block_insert, VIM_BLOCK_APPEND},
+		{XK_ANY_MOD, XK_I, vim_block_insert, VIM_BLOCK_INSERT},
 		{XK_ANY_MOD, XK_G, vim_move, VIM_TO_END_OF_FILE},
 		{XK_ANY_MOD, XK_w, vim_move, VIM_TO_START_OF_WORD},
 		{XK_ANY_MOD, XK_W, vim_move, VIM_TO_START_OF_STRING},
@@ -1452,6 +2314,25 @@ struct chained_keybind visual_mode_keybinds[]  = {
 		{0, XK_x, vim_delete, VIM_CURRENT_SELECTION},
 		{XK_ANY_MOD, XK_X, vim_delete, VIM_CURRENT_SELECTION},
 		{0, XK_y, vim_yank, VIM_CURRENT_SELECTION},
+		{0, XK_c, vim_change, VIM_CURRENT_SELECTION},
+		{0, XK_r, vim_block_replace},
+		{ControlMask, XK_v, vim_change_mode, VIM_VISUAL_BLOCK},
+
+		{XK_ANY_MOD, XK_colon, vim_open_command_line},
+		{XK_ANY_MOD, XK_greater, vim_transform, VIM_INDENT},
+		{XK_ANY_MOD, XK_less, vim_transform, VIM_OUTDENT},
+		{0, XK_equal, vim_transform, VIM_REINDENT},
+		{0, XK_u, vim_transform, VIM_LOWER_CASE},
+		{XK_ANY_MOD, XK_U, vim_transform, VIM_UPPER_CASE},
+		{XK_ANY_MOD, XK_asciitilde, vim_transform, VIM_TOGGLE_CASE},
+		{0, XK_g, vim_enter, 0, NULL, (struct chained_keybind[]) {
+						{0, XK_c, vim_transform, VIM_COMMENT},
+				}, CHAIN_COUNT(1),
+		},
+		{0, XK_space, vim_enter, 0, "se commands [...]", (struct chained_keybind[]) {
+						VIM_LINE_COMMANDS(),
+				}, CHAIN_COUNT(2),
+		},
 };
 
 struct chained_keybind insert_mode_keybinds[]  = {
@@ -1697,8 +2578,8 @@ vim_paste_callback(struct file_buffer* fb, char* data, int len)
 				offset = MAX(offset - 1, 0);
 		}
 		fb_insert(fb, data, len, offset, 1);
-		window_node_move_all_cursors_on_same_fb(&root_node, (paste_behind) ? NULL : focused_node, focused_window->fb_index, offset,
-												wb_move_offset_relative, len, CURSOR_COMMAND_MOVEMENT);
+		if (paste_behind && focused_window->cursor_offset >= offset)
+				wb_move_offset_relative(focused_window, len, CURSOR_COMMAND_MOVEMENT);
 		paste_behind = 0;
 		return 0;
 }
@@ -1728,15 +2609,192 @@ vim_repeat_last_command(int custom_mode)
 		return -2;
 }
 
+///////////////////////////////////
+// macros
+// Q followed by a-z records the keys typed into that register until the
+// next Q, @ followed by the register plays them count times and @@ plays
+// the last played macro again.
+// While a macro plays the status bar is muted and all of its edits are
+// one transaction, so undo and the other extensions see it as one change.
+// It stops early when a run neither edits nor moves the cursor.
+
+#define VIM_MACRO_REGISTERS 26
+#define VIM_MACRO_MAX_DEPTH 16
+
+enum vim_macro_pending {
+		VIM_MACRO_NONE,
+		VIM_MACRO_RECORD,
+		VIM_MACRO_PLAY,
+};
+
+struct vim_macro {
+		struct keypress_logg* keys;
+		int len;
+};
+
+static struct vim_macro vim_macros[VIM_MACRO_REGISTERS];
+static struct keypress_logg* vim_recording;
+static int vim_recording_len, vim_recording_capacity;
+static int vim_recording_register = -1;
+static int vim_last_played_register = -1;
+static int vim_macro_depth;
+static enum vim_macro_pending vim_macro_pending;
+static int vim_macro_count;
+
+static void
+vim_macro_log_key(KeySym ksym, unsigned int modkey, const char* buf, int len)
+{
+		if (vim_recording_len >= vim_recording_capacity) {
+				vim_recording_capacity = vim_recording_capacity ? vim_recording_capacity * 2 : 64;
+				vim_recording = xrealloc(vim_recording, vim_recording_capacity * sizeof(struct keypress_logg));
+		}
+		struct keypress_logg* key = vim_recording + vim_recording_len++;
+		key->ksym = ksym;
+		key->modkey = modkey;
+		key->len = len;
+		key->buf = xmalloc(len + 1);
+		memcpy(key->buf, buf, len);
+}
+
+static void
+vim_macro_stop_recording(int drop_last)
+{
+		drop_last = MIN(drop_last, vim_recording_len);
+		vim_recording_len -= drop_last;
+		for (int i = vim_recording_len; i < vim_recording_len + drop_last; i++)
+				free(vim_recording[i].buf);
+
+		struct vim_macro* macro = vim_macros + vim_recording_register;
+		if (vim_recording_len) {
+				vim_copy_log(&macro->keys, macro->len, vim_recording, vim_recording_len);
+		} else if (macro->len) {
+				free(macro->keys->buf);
+				free(macro->keys);
+				macro->keys = NULL;
+		}
+		macro->len = vim_recording_len;
+		for (int i = 0; i < vim_recording_len; i++)
+				free(vim_recording[i].buf);
+		writef_to_status_bar("recorded %d keys to @%c", vim_recording_len, 'a' + vim_recording_register);
+		vim_recording_len = 0;
+		vim_recording_register = -1;
+}
+
+static int
+vim_macro_record(int custom_mode)
+{
+		if (vim_macro_depth)
+				return -2;
+		if (vim_recording_register >= 0) {
+				// the keys of this command were logged too
+				vim_macro_stop_recording(chain_len);
+				return -2;
+		}
+		vim_macro_pending = VIM_MACRO_RECORD;
+		writef_to_status_bar("record to-");
+		return -2;
+}
+
+static int
+vim_macro_play(int custom_mode)
+{
+		vim_macro_count = vim_chain_parse_count(0);
+		vim_macro_pending = VIM_MACRO_PLAY;
+		if (!vim_macro_depth)
+				writef_to_status_bar("play-");
+		return -2;
+}
+
+static void
+vim_macro_run(int reg, int count)
+{
+		struct vim_macro* macro = vim_macros + reg;
+		if (!macro->len) {
+				writef_to_status_bar("@%c is empty", 'a' + reg);
+				return;
+		}
+		if (vim_macro_depth >= VIM_MACRO_MAX_DEPTH) {
+				writef_to_status_bar("macros nested more than %d deep", VIM_MACRO_MAX_DEPTH);
+				return;
+		}
+		vim_last_played_register = reg;
+
+		struct timespec t0, t1;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		int fb_index = focused_window->fb_index;
+		fb_begin_transaction(get_fb(focused_window));
+		vim_macro_depth++;
+		status_bar_muted++;
+
+		int runs = 0;
+		while (runs < count) {
+				struct file_buffer* fb = get_fb(focused_window);
+				unsigned int version = fb->version;
+				int cursor = focused_window->cursor_offset;
+
+				chain_len = 0;
+				last_used_command_index = 0;
+				for (int i = 0; i < macro->len; i++) {
+						struct keypress_logg key = macro->keys[i];
+						keypress_actions(key.ksym, key.modkey, key.buf, key.len);
+				}
+				runs++;
+				if (fb == get_fb(focused_window) && fb->version == version &&
+					focused_window->cursor_offset == cursor)
+						break;
+		}
+
+		status_bar_muted--;
+		vim_macro_depth--;
+		// the macro may have switched to another file
+		int current_fb_index = focused_window->fb_index;
+		focused_window->fb_index = fb_index;
+		fb_commit_transaction(get_fb(focused_window), FB_CONTENT_BIG_CHANGE);
+		focused_window->fb_index = current_fb_index;
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		double ms = (t1.tv_sec - t0.tv_sec) * 1000.0 + (t1.tv_nsec - t0.tv_nsec) / 1000000.0;
+		writef_to_status_bar("played @%c %d time%s in %.1f ms", 'a' + reg, runs, runs == 1 ? "" : "s", ms);
+}
+
+// handles the register key after Q or @, returns 1 if the key was used
+static int
+vim_macro_key(const char* buf, int len)
+{
+		enum vim_macro_pending pending = vim_macro_pending;
+		if (pending == VIM_MACRO_NONE)
+				return 0;
+		vim_macro_pending = VIM_MACRO_NONE;
+
+		int reg = len == 1 && buf[0] >= 'a' && buf[0] <= 'z' ? buf[0] - 'a' : -1;
+		if (pending == VIM_MACRO_PLAY && len == 1 && buf[0] == '@')
+				reg = vim_last_played_register;
+		if (reg < 0) {
+				if (!vim_macro_depth)
+						writef_to_status_bar("no register, use a-z");
+				return 1;
+		}
+
+		if (pending == VIM_MACRO_RECORD) {
+				vim_recording_register = reg;
+				writef_to_status_bar("recording @%c", 'a' + reg);
+		} else {
+				vim_macro_run(reg, vim_macro_count);
+		}
+		return 1;
+}
+
 void insert_string(const char* buf, int len)
 {
 		struct file_buffer* fb = get_fb(focused_window);
 
 		if (buf[0] >= 32 || len > 1) {
+				if (wb_cursor_count(focused_window)) {
+						wb_edit_at_cursors(focused_window, 0, 0, buf, len);
+						return;
+				}
 				fb_delete_selection(fb);
 				fb_insert(fb, buf, len, focused_window->cursor_offset, 0);
-				window_node_move_all_cursors_on_same_fb(&root_node, NULL, focused_window->fb_index, focused_window->cursor_offset,
-														wb_move_offset_relative, len, CURSOR_COMMAND_MOVEMENT);
+				wb_move_offset_relative(focused_window, len, CURSOR_COMMAND_MOVEMENT);
 		} else {
 				writef_to_status_bar("unhandled control character 0x%x\n", buf[0]);
 		}
@@ -1745,6 +2803,31 @@ void insert_string(const char* buf, int len)
 int
 keypress_actions(KeySym keycode, int modkey, const char* buf, int len)
 {
+		if (vim_recording_register >= 0 && !vim_macro_depth)
+				vim_macro_log_key(keycode, modkey, buf, len);
+		if (vim_macro_key(buf, len))
+				return 0;
+		if (vim_command_line_key(keycode, buf, len))
+				return 0;
+		if (vim_align_pending) {
+				vim_align_pending = 0;
+				if (len > 0 && (buf[0] >= 32 || len > 1)) {
+						vim_align_lines(buf, len);
+						return 0;
+				}
+		}
+		if (vim_block_replace_pending) {
+				vim_block_replace_pending = 0;
+				struct file_buffer* fb = get_fb(focused_window);
+				if (len > 0 && (buf[0] >= 32 || len > 1) && fb->mode & FB_BLOCK_SELECT) {
+						int start = vim_block_start();
+						fb_fill_block(fb, buf, len);
+						vim_change_mode(VIM_NORMAL);
+						wb_move_to_offset(focused_window, start, CURSOR_COMMAND_MOVEMENT);
+						return 0;
+				}
+		}
+
 		// current keybind that is set
 		static struct chained_keybind* keybinds;
 		static int keybind_len;
@@ -1766,12 +2849,13 @@ keypress_actions(KeySym keycode, int modkey, const char* buf, int len)
 		}
 
 		char tmp_status_bar[STATUS_BAR_MAX_LEN];
-		memcpy(tmp_status_bar, status_bar_contents, STATUS_BAR_MAX_LEN);
+		if (!status_bar_muted)
+				memcpy(tmp_status_bar, status_bar_contents, STATUS_BAR_MAX_LEN);
 
 		int last_mode = vim_mode;
 		int res = do_chained_keybinds(&keybinds, &keybind_len, keycode, modkey, buf, len);
 
-		int status_bar_changed = strcmp(tmp_status_bar, status_bar_contents) != 0;
+		int status_bar_changed = !status_bar_muted && strcmp(tmp_status_bar, status_bar_contents) != 0;
 
 		if (res == 3)
 				return 0;
@@ -1794,7 +2878,7 @@ keypress_actions(KeySym keycode, int modkey, const char* buf, int len)
 				}
 		} else if ((res == 2 || res == 4) && vim_mode == VIM_NORMAL) {
 				// reset chain
-				if (chain_len > 1 && !status_bar_changed && last_mode == vim_mode) {
+				if (chain_len > 1 && !status_bar_muted && !status_bar_changed && last_mode == vim_mode) {
 						const char* chain_str = current_key_chain_string(1);
 						if (chain_str)
 								writef_to_status_bar("%s", chain_str);
@@ -1805,6 +2889,8 @@ keypress_actions(KeySym keycode, int modkey, const char* buf, int len)
 				}
 				chain_len = 0;
 				last_used_command_index = 0;
+		} else if (status_bar_muted) {
+				return 0;
 		} else if (vim_mode == VIM_NORMAL) {
 				const char* chain_str = current_key_chain_string(0);
 				const char* options = current_keybind_options(keybinds, keybind_len);
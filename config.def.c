@@ -24,6 +24,32 @@ int wrap_buffer = 0;
 // spaces per tab (tabs will self align)
 unsigned int tabspaces = 8;
 
+// files bigger than this (in bytes) are mapped instead of read in,
+// edits don't copy the file
+long huge_file_size = 10 * 1024 * 1024;
+// open those files read only
+int huge_file_read_only = 1;
+// files bigger than this are read in chunks as they are scrolled through
+// or searched, instead of all at once (or mapped)
+long lazy_load_size = 256 * 1024 * 1024;
+// bytes of undo history kept for each buffer and for all of them together,
+// the oldest steps are dropped first when one of them is exceeded
+long undo_buffer_budget = 32 * 1024 * 1024;
+long undo_total_budget = 128 * 1024 * 1024;
+// undo history is kept across sessions in this directory, relative to
+// $HOME if it doesn't start with '/', NULL to not keep it
+const char* undo_journal_dir = ".cache/se/undo";
+// a journal bigger than this is started over when a file is edited again
+long undo_journal_max_size = 64 * 1024 * 1024;
+// see enum save_fsync
+enum save_fsync save_fsync = SAVE_FSYNC_FILE;
+// saves write a new file and rename it over the old one. with this set,
+// files that have other hard links or whose owner the new file can't get
+// are written over instead, which keeps both but a crash while saving
+// leaves them cut short. otherwise the links keep the old contents and
+// the save fails if the owner can't be kept
+int save_in_place = 0;
+
 // Default shape of cursor
 // 2: Block ("█")
 // 4: Underline ("_")
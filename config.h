@@ -45,6 +45,15 @@ extern unsigned int default_rows;
 extern unsigned int tabspaces;
 extern unsigned int default_indent_len; // 0 means tab
 extern int wrap_buffer;
+extern long huge_file_size;
+extern int huge_file_read_only;
+extern long lazy_load_size;
+extern long undo_buffer_budget;
+extern long undo_total_budget;
+extern const char* undo_journal_dir;
+extern long undo_journal_max_size;
+extern enum save_fsync save_fsync;
+extern int save_in_place;
 
 // see extension.h and extension.c
 extern struct extension_meta* extensions;
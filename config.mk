@@ -12,11 +12,17 @@ X11LIB = /usr/X11R6/lib
 
 PKG_CONFIG = pkg-config
 
+# how the contents of file buffers are stored, see storage.h
+# flat:  one array, simple but every edit moves the rest of the file
+# piece: piece table, edits don't depend on the file size
+# rope:  b-tree of small chunks that also counts lines, for huge files
+STORAGE = piece
+
 # includes and libs
 INCS = -I$(X11INC) \
        `$(PKG_CONFIG) --cflags fontconfig` \
        `$(PKG_CONFIG) --cflags freetype2`
-LIBS = -L$(X11LIB) -lm -lrt -lX11 -lutil -lXft \
+LIBS = -L$(X11LIB) -lm -lrt -lpthread -lX11 -lutil -lXft \
        `$(PKG_CONFIG) --libs fontconfig` \
        `$(PKG_CONFIG) --libs freetype2`
 
@@ -50,6 +50,14 @@ struct extension {
         // see buffer.h/buffer.c fb_add_to_undo()
         int(*fb_contents_updated)(struct file_buffer* fb, int offset, enum buffer_content_reason reason);
 
+        ///////////////////////////////////
+        // Called after every change to the contents, also inside transactions
+        // and for edits that don't call fb_contents_updated.
+        // inserted_len bytes replaced removed_len bytes at offset, version is
+        // fb->version after the change. If it isn't one more than the last
+        // version that was seen a change was missed and caches must be rebuilt
+        int(*fb_contents_edited)(struct file_buffer* fb, int offset, int removed_len, int inserted_len, unsigned int version);
+
 
 // window node
         int(*wn_custom_window_draw)(struct window_split_node* wn);
@@ -3,11 +3,120 @@
 extern struct window_buffer* focused_window;
 
 static int default_status_bar_callback(int* write_again, struct window_buffer* buf, int minx, int maxx, int cx, int cy, char line[LINE_MAX_LEN], struct glyph* g);
+static int search_results_edited(struct file_buffer* fb, int offset, int removed_len, int inserted_len, unsigned int version);
 
 static const struct extension default_status_bar = {
-	.wb_write_status_bar = default_status_bar_callback
+	.wb_write_status_bar = default_status_bar_callback,
+	.fb_contents_edited = search_results_edited,
 };
 
+// the offsets of the search results in one buffer, counted like
+// fb_count_string_instances does. They are patched on every edit
+// so the status bar doesn't search the whole buffer each frame
+static struct {
+	const struct file_buffer* fb;
+	unsigned int version;
+	char term[SEARCH_TERM_MAX_LEN];
+	int* offsets;
+	int len, capacity;
+} search_results;
+
+// amount of results before offset
+static int
+search_results_index(int offset)
+{
+	int low = 0, high = search_results.len;
+	while (low < high) {
+		int mid = low + (high - low) / 2;
+		if (search_results.offsets[mid] < offset)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+static int
+search_results_skip(const struct file_buffer* fb, int pos)
+{
+	return pos > 0 && fb_char(fb, pos-2) == '\\';
+}
+
+static void
+search_results_add(int index, const int* offsets, int len)
+{
+	if (search_results.len + len > search_results.capacity) {
+		search_results.capacity = (search_results.len + len) * 2;
+		search_results.offsets = xrealloc(search_results.offsets, search_results.capacity * sizeof(int));
+	}
+	int* at = search_results.offsets + index;
+	memmove(at + len, at, (search_results.len - index) * sizeof(int));
+	memcpy(at, offsets, len * sizeof(int));
+	search_results.len += len;
+}
+
+// adds the results that start between start and end
+static void
+search_results_find(const struct file_buffer* fb, int start, int end)
+{
+	int term_len = strlen(search_results.term);
+	start = MAX(start, 0);
+	end = MIN(end, fb->len - term_len + 1);
+	int index = search_results_index(start);
+	for (int pos = start; pos < end; pos++) {
+		if (fb_char(fb, pos) != *search_results.term ||
+		    fb_memcmp(fb, pos, search_results.term, term_len) ||
+		    search_results_skip(fb, pos))
+			continue;
+		search_results_add(index++, &pos, 1);
+	}
+}
+
+static void
+search_results_update(const struct file_buffer* fb)
+{
+	if (search_results.fb == fb && search_results.version == fb->version &&
+	    strcmp(search_results.term, fb->search_term) == 0)
+		return;
+	search_results.fb = fb;
+	search_results.version = fb->version;
+	strcpy(search_results.term, fb->search_term);
+	search_results.len = 0;
+	if (!*search_results.term)
+		return;
+	for (int pos = -1; (pos = fb_seek_string(fb, pos+1, search_results.term)) >= 0; )
+		if (!search_results_skip(fb, pos))
+			search_results_add(search_results.len, &pos, 1);
+}
+
+int
+search_results_edited(struct file_buffer* fb, int offset, int removed_len, int inserted_len, unsigned int version)
+{
+	if (fb != search_results.fb)
+		return 0;
+	if (version != search_results.version + 1) {
+		search_results.fb = NULL;
+		return 0;
+	}
+	search_results.version = version;
+	int term_len = strlen(search_results.term);
+	if (!term_len)
+		return 0;
+
+	// a result depends on the chars it covers and the one two before it
+	int start = search_results_index(offset - term_len + 1);
+	int end = search_results_index(offset + removed_len + 2);
+	if (end > start) {
+		memmove(search_results.offsets + start, search_results.offsets + end, (search_results.len - end) * sizeof(int));
+		search_results.len -= end - start;
+	}
+	for (int i = start; i < search_results.len; i++)
+		search_results.offsets[i] += inserted_len - removed_len;
+
+	search_results_find(fb, offset - term_len + 1, offset + inserted_len + 2);
+	return 0;
+}
+
 int
 default_status_bar_callback(int* write_again, struct window_buffer* buf, int minx, int maxx, int cx, int cy, char line[LINE_MAX_LEN], struct glyph* g)
 {
@@ -20,16 +129,27 @@ default_status_bar_callback(int* write_again, struct window_buffer* buf, int min
 	struct file_buffer* fb = get_fb(buf);
 	switch (count) {
 		const char* name;
+		const char* eol;
 		int percent;
+		long undo;
 	case 0:
 		if (fb->mode & FB_SEARCH_BLOCKING_IDLE) {
-			int before;
-			int search_count = fb_count_string_instances(fb, fb->search_term, focused_window->cursor_offset, &before);
-			snprintf(line, LINE_MAX_LEN, " %d/%d", before, search_count);
+			search_results_update(fb);
+			int before = search_results_index(focused_window->cursor_offset + 1);
+			// there may be more in the part that isn't loaded
+			snprintf(line, LINE_MAX_LEN, " %d/%d%s", before, search_results.len, fb->loader ? "+" : "");
 		}
 		break;
 	case 1:
-		snprintf(line, LINE_MAX_LEN, " %dk ", fb->len/1000);
+		// more than one bit set means mixed line endings
+		eol = fb->line_endings == FB_EOL_CRLF ? " [CRLF]" :
+		      fb->line_endings == FB_EOL_CR ? " [CR]" :
+		      fb->line_endings & (fb->line_endings - 1) ? " [mixed]" : "";
+		if (fb->loader)
+			snprintf(line, LINE_MAX_LEN, " %dk (%ld%% loaded)%s%s ", fb->len/1000,
+			         fb->loader->read * 100 / fb->loader->size, eol, fb->mode & FB_READ_ONLY ? " [RO]" : "");
+		else
+			snprintf(line, LINE_MAX_LEN, " %dk%s%s ", fb->len/1000, eol, fb->mode & FB_READ_ONLY ? " [RO]" : "");
 		break;
 	case 2:
 		g->fg = path_color;
@@ -48,6 +168,16 @@ default_status_bar_callback(int* write_again, struct window_buffer* buf, int min
 		snprintf(line, LINE_MAX_LEN, "  %d:%d %d%%" , cy+1, cx, percent);
 		break;
 	case 5:
+		undo = fb_undo_memory(fb);
+		if (!undo)
+			break;
+		// all buffers only when others have history too
+		if (undo_memory_total() != undo)
+			snprintf(line, LINE_MAX_LEN, "  undo %ldk/%ldk", (undo+999)/1000, (undo_memory_total()+999)/1000);
+		else
+			snprintf(line, LINE_MAX_LEN, "  undo %ldk", (undo+999)/1000);
+		break;
+	case 6:
 		count = 0;
 		*write_again = 0;
 		return 0;
@@ -102,15 +102,19 @@ struct syntax_scheme {
 
 		const struct indent_scheme_entry* indents;
 		const int indent_count;
+
+		// what line comments start with, used to toggle comments
+		const char* line_comment;
 };
 
 
 static int fb_auto_indent(struct file_buffer* fb, int offset);
+static int fb_reindent_lines(struct file_buffer* fb, int first_line, int last_line);
 
 static void do_syntax_scheme(struct file_buffer* fb, const struct syntax_scheme* cs, int offset);
 
 static void whitespace_count_to_indent_amount(int indent_len, int count, int* indent_count, int* extra_spaces);
-static int  get_line_leading_whitespace_count(const char* line);
+static int  get_line_leading_whitespace_count(const struct file_buffer* fb, struct fb_span line);
 static int  get_line_relative_offset(struct file_buffer* fb, int offset, int count);
 
 static const struct syntax_scheme*
@@ -182,18 +186,34 @@ apply_syntax(struct window_split_node* wn, const int offset_start, const int off
 				screen_set_attr(x, y)->fg = global_attr.fg;
 				screen_set_attr(x, y)->bg = global_attr.bg;
 
+				rune_t u;
+				charsize = fb_utf8_decode(fb, i, &u);
+				if (charsize == 0)
+						charsize = 1;
+
 				uint8_t amount = move_buffer[move_buffer_index];
-				if (amount & (1<<7)) {
+				if (amount == MOVE_BUFFER_SKIP) {
+						// the skipped chars weren't drawn, but they still change the syntax state
+						struct move_buffer_skip skip;
+						memcpy(&skip, move_buffer + move_buffer_index + 1, sizeof(skip));
+						move_buffer_index += 1 + sizeof(skip);
+						for (i += charsize; i < skip.offset; i += charsize) {
+								do_syntax_scheme(fb, cs, i);
+								charsize = fb_utf8_decode(fb, i, &u);
+								if (charsize == 0)
+										charsize = 1;
+						}
+						i = skip.offset;
+						x = skip.x, y = skip.y;
+						charsize = 0;
+						continue;
+				}
+				if (amount & MOVE_BUFFER_NEW_LINE) {
 						x = wn->minx;
 						y++;
-						amount &= ~(1<<7);
+						amount &= ~MOVE_BUFFER_NEW_LINE;
 				}
 				x += amount;
-
-				rune_t u;
-				charsize = utf8_decode_buffer(fb->contents + i, i - offset_start, &u);
-				if (charsize == 0)
-						charsize = 1;
 				move_buffer_index++;
 		}
 
@@ -223,13 +243,12 @@ do_syntax_scheme(struct file_buffer* fb, const struct syntax_scheme* cs, int off
 				return;
 		}
 
-		char* buf = fb->contents;
 		int buflen = fb->len;
 
 		if (end_condition && !color_next_word) {
 				if (buflen - offset <= end_condition_len)
 						return;
-				if (end_at_whitespace && buf[offset] == '\n') {
+				if (end_at_whitespace && fb_char(fb, offset) == '\n') {
 						// *_TO_LINE reached end of line
 						end_condition_len = 0;
 						end_condition = NULL;
@@ -285,9 +304,9 @@ do_syntax_scheme(struct file_buffer* fb, const struct syntax_scheme* cs, int off
 								continue;
 
 						int end_len = 0;
-						while (offset + end_len < fb->len && !str_contains_char(cs->word_seperators, buf[offset + end_len])) {
-								if (!isupper(buf[offset + end_len]) && buf[offset + end_len] != '_'
-									&& (!end_len || (buf[offset + end_len] < '0' || buf[offset + end_len] > '9')))
+						while (offset + end_len < fb->len && !str_contains_char(cs->word_seperators, fb_char(fb, offset + end_len))) {
+								if (!isupper(fb_char(fb, offset + end_len)) && fb_char(fb, offset + end_len) != '_'
+									&& (!end_len || (fb_char(fb, offset + end_len) < '0' || fb_char(fb, offset + end_len) > '9')))
 										goto not_upper_case;
 								end_len++;
 						}
@@ -307,7 +326,7 @@ do_syntax_scheme(struct file_buffer* fb, const struct syntax_scheme* cs, int off
 
 				if (mode == COLOR_WORD_BEFORE_STR || mode == COLOR_WORD_BEFORE_STR_STR || mode == COLOR_WORD_ENDING_WITH_STR) {
 						// check if this is a new word
-						if (str_contains_char(cs->word_seperators, buf[offset])) continue;
+						if (str_contains_char(cs->word_seperators, fb_char(fb, offset))) continue;
 
 						int offset_tmp = offset;
 						// find new word twice if it's BEFORE_STR_STR
@@ -427,56 +446,144 @@ do_syntax_scheme(struct file_buffer* fb, const struct syntax_scheme* cs, int off
 ////////////////////////
 // Auto indent
 //
-//
+// One engine decides the indent of a line from the indent scheme and the line
+// before it. fb_auto_indent writes it back for one line right away,
+// fb_reindent_lines goes through a range once without changing the buffer
+// and writes all of it back as one edit.
+// The rules only look at the text after the leading whitespace, so lines
+// that were re-indented but not written back only need their new indent
+// carried along for the rules that use columns.
+
+struct indent_state {
+		int first_line, line_count;
+		// for every line re-indented so far, the whitespace count of the new indent
+		// and the display column its text starts at
+		int* widths;
+		int* columns;
+};
 
-int
-fb_auto_indent(struct file_buffer* fb, int offset)
+struct indent_rule_line {
+		unsigned int line_offset;
+		int offset;
+		struct fb_span line;
+};
+
+// display column after the indent, counted like fb_offset_to_column does
+static int
+indent_display_column(const struct file_buffer* fb, int indents, int extra_spaces)
 {
-		const struct syntax_scheme* cs = fb_get_syntax_scheme(fb);
-		LIMIT(offset, 0, fb->len-1);
+		if (fb->indent_len)
+				return indents * fb->indent_len + extra_spaces;
+		int column = 0;
+		while (indents--) {
+				if (column <= 0)
+						column += 1;
+				while (column % tabspaces != 0)
+						column += 1;
+				column += 1;
+		}
+		return column + extra_spaces;
+}
+
+static int
+indent_string(const struct file_buffer* fb, int indents, int extra_spaces, char* dest)
+{
+		int len = 0;
+		if (fb->indent_len) {
+				len = indents * fb->indent_len;
+				memset(dest, ' ', len);
+		} else {
+				len = indents;
+				memset(dest, '\t', len);
+		}
+		memset(dest + len, ' ', extra_spaces);
+		return len + extra_spaces;
+}
 
+// the column of offset with the new indent of its line if it was re-indented
+static int
+indent_column(struct file_buffer* fb, const struct indent_state* state, int offset)
+{
+		int column = fb_offset_to_column(fb, offset);
+		int line = state ? fb_offset_to_line(fb, offset) - state->first_line : -1;
+		if (line < 0 || line >= state->line_count)
+				return column;
+		int line_start = fb_line_to_offset(fb, line + state->first_line);
+		struct fb_span span = fb_span_line(fb, line_start);
+		int text_start = span.start;
+		while (text_start < span.end && (fb_char(fb, text_start) == ' ' || fb_char(fb, text_start) == '\t'))
+				text_start++;
+		return column - fb_offset_to_column(fb, text_start) + state->columns[line];
+}
+
+static int
+indent_prev_line_width(struct file_buffer* fb, const struct indent_state* state, int prev_line_offset)
+{
+		int line = state ? fb_offset_to_line(fb, prev_line_offset) - state->first_line : -1;
+		if (line >= 0 && line < state->line_count)
+				return state->widths[line];
+		return get_line_leading_whitespace_count(fb, fb_span_line(fb, prev_line_offset));
+}
+
+// the indent of the line at offset, 0 is returned for the first line which
+// has nothing to be indented after
+static int
+indent_for_line(struct file_buffer* fb, const struct syntax_scheme* cs, int offset,
+				const struct indent_state* state, int* indents, int* extra_spaces)
+{
 		int indent_diff = 0;
 		int indent_keep_x = -1;
 		int keep_pos = 0;
 
 		int get_line_offset;
-		char* get_line = NULL;
+		struct fb_span get_line;
+
+		// the rules mostly look at the same two lines, those are only found once
+		struct indent_rule_line found[2];
+		int found_count = 0;
 
 		for (int i = 0; i < cs->indent_count; i++) {
 				const struct indent_scheme_entry indent = cs->indents[i];
 
-				get_line_offset = get_line_relative_offset(fb, offset, indent.line_offset);
-				if (get_line)
-						free(get_line);
-				get_line = fb_get_line_at_offset(fb, get_line_offset);
+				int f = 0;
+				while (f < found_count && found[f].line_offset != indent.line_offset)
+						f++;
+				if (f < found_count) {
+						get_line_offset = found[f].offset;
+						get_line = found[f].line;
+				} else {
+						get_line_offset = get_line_relative_offset(fb, offset, indent.line_offset);
+						get_line = fb_span_line(fb, get_line_offset);
+						if (found_count < LEN(found))
+								found[found_count++] = (struct indent_rule_line){indent.line_offset, get_line_offset, get_line};
+				}
 
 				switch(indent.mode) {
-						int temp_offset, len;
-						char* res;
+						int temp_offset, len, res;
 				case INDENT_LINE_CONTAINS_WORD:
 				case INDENT_LINE_ONLY_CONTAINS_STR:
 				case INDENT_LINE_CONTAINS_STR_MORE_THAN_STR:
-						res = strstr(get_line, indent.arg.start);
-						if (!res)
+						res = fb_span_find(fb, get_line, indent.arg.start);
+						if (res < 0)
 								continue;
 						if (INDENT_LINE_CONTAINS_WORD) {
-								if (res > get_line && !str_contains_char(cs->word_seperators, *(res-1)))
+								if (res > get_line.start && !str_contains_char(cs->word_seperators, fb_char(fb, res-1)))
 										continue;
 								res += strlen(indent.arg.start);
-								if (*res && !str_contains_char(cs->word_seperators, *res))
+								if (res < get_line.end && !str_contains_char(cs->word_seperators, fb_char(fb, res)))
 										continue;
 						} else if (INDENT_LINE_CONTAINS_STR_MORE_THAN_STR == indent.mode) {
-								char* start_last = get_line;
-								char* end_last = get_line;
+								struct fb_span start_last = get_line;
+								struct fb_span end_last = get_line;
 								for (int count = 0; count >= 0; ) {
-										if (start_last && (start_last = strstr(start_last, indent.arg.start))) {
-												start_last++;
+										if (start_last.start >= 0 && (start_last.start = fb_span_find(fb, start_last, indent.arg.start)) >= 0) {
+												start_last.start++;
 												count--;
 										} else {
 												goto indent_for_loop_continue;
 										}
-										if (end_last && (end_last = strstr(end_last, indent.arg.end))) {
-												end_last++;
+										if (end_last.start >= 0 && (end_last.start = fb_span_find(fb, end_last, indent.arg.end)) >= 0) {
+												end_last.start++;
 												count++;
 										}
 								}
@@ -500,7 +607,7 @@ fb_auto_indent(struct file_buffer* fb, int offset)
 						if (temp_offset < 0 ||
 							temp_offset < fb_seek_char_backwards(fb, get_line_offset, '\n'))
 								continue;
-						if (memcmp(fb->contents + get_line_offset, indent.arg.start, strlen(indent.arg.start)) == 0) {
+						if (fb_memcmp(fb, get_line_offset, indent.arg.start, strlen(indent.arg.start)) == 0) {
 								if (indent.mode == INDENT_LINE_DOES_NOT_END_WITH_STR)
 										continue;
 						} else {
@@ -514,8 +621,7 @@ fb_auto_indent(struct file_buffer* fb, int offset)
 						if (indent.type == INDENT_KEEP_OPENER) {
 								if (indent_keep_x >= 0)
 										continue;
-								int tmp;
-								fb_offset_to_xy(fb, keep_pos, 0, 0, &indent_keep_x, &tmp, &tmp);
+								indent_keep_x = indent_column(fb, state, keep_pos);
 						} else if (indent.type == INDENT_RETURN_TO_OPENER_BASE_INDENT) {
 								if (indent_keep_x >= 0)
 										continue;
@@ -525,8 +631,7 @@ fb_auto_indent(struct file_buffer* fb, int offset)
 										goto indent_for_loop_continue;
 								}
 								keep_pos = fb_seek_not_whitespace(fb, fb_seek_char_backwards(fb, opener, '\n'));
-								int tmp;
-								fb_offset_to_xy(fb, keep_pos, 0, 0, &indent_keep_x, &tmp, &tmp);
+								indent_keep_x = indent_column(fb, state, keep_pos);
 								//TODO: why does this miss by one?
 								if (indent_keep_x > 0)
 										indent_keep_x--;
@@ -540,27 +645,35 @@ fb_auto_indent(struct file_buffer* fb, int offset)
 				continue;
 		}
 
-		if (get_line)
-				free(get_line);
-
-		int indents = 0, extra_spaces = 0;
-
 		int prev_line_offset = fb_seek_char_backwards(fb, offset, '\n') - 1;
 		if (prev_line_offset < 0)
 				return 0;
-		char* prev_line = fb_get_line_at_offset(fb, prev_line_offset);
 
 		if (indent_keep_x >= 0) {
-				whitespace_count_to_indent_amount(fb->indent_len, indent_keep_x, &indents, &extra_spaces);
+				whitespace_count_to_indent_amount(fb->indent_len, indent_keep_x, indents, extra_spaces);
 		} else {
-				whitespace_count_to_indent_amount(fb->indent_len, get_line_leading_whitespace_count(prev_line), &indents, &extra_spaces);
+				whitespace_count_to_indent_amount(fb->indent_len, indent_prev_line_width(fb, state, prev_line_offset), indents, extra_spaces);
 		}
 		if (indent_diff != INDENT_KEEP) {
-				indents += indent_diff;
-				indents = MAX(indents, 0);
+				*indents += indent_diff;
+				*indents = MAX(*indents, 0);
 		}
+		return 1;
+}
+
+int
+fb_auto_indent(struct file_buffer* fb, int offset)
+{
+		const struct syntax_scheme* cs = fb_get_syntax_scheme(fb);
+		LIMIT(offset, 0, fb->len-1);
+
+		int indents, extra_spaces;
+		if (!indent_for_line(fb, cs, offset, NULL, &indents, &extra_spaces))
+				return 0;
+		int prev_line_offset = fb_seek_char_backwards(fb, offset, '\n') - 1;
 
 		// remove the lines existing indent
+		fb_begin_transaction(fb);
 		int removed = 0;
 		int line_code_start = MIN(fb_seek_not_whitespace(fb, prev_line_offset + 1), fb_seek_char(fb, prev_line_offset + 1, '\n'));
 		if (line_code_start - (prev_line_offset) >= 1) {
@@ -569,40 +682,96 @@ fb_auto_indent(struct file_buffer* fb, int offset)
 		}
 
 		if (indents + extra_spaces <= 0) {
-				free(prev_line);
+				fb_commit_transaction(fb, FB_CONTENT_NORMAL_EDIT);
 				return -removed;
 		}
 
-		unsigned int indent_str_len = 0;
-		while(indents--)
-				indent_str_len += fb->indent_len ? fb->indent_len : 1;
-		char indent_str[indent_str_len + extra_spaces];
+		char indent_str[indents * MAX(fb->indent_len, 1) + extra_spaces];
+		int indent_str_len = indent_string(fb, indents, extra_spaces, indent_str);
+
+		fb_insert(fb, indent_str, indent_str_len, prev_line_offset + 1, 0);
+		fb_commit_transaction(fb, FB_CONTENT_NORMAL_EDIT);
+
+		return indent_str_len - removed;
+}
+
+struct reindent_data {
+		struct file_buffer* fb;
+		const struct syntax_scheme* cs;
+		struct indent_state state;
+};
 
-		char space_tab = fb->indent_len > 0 ? ' ' : '\t';
-		int i = 0;
-		if (!fb->indent_len)
-				for (/* i = 0 */; i < indent_str_len; i++)
-						indent_str[i] = space_tab;
-		for (/* i = 0 or indent_str_len */ ; i < indent_str_len + extra_spaces; i++)
-				indent_str[i] = ' ';
+static int
+reindent_line(struct fb_text* out, const char* line, int len, int offset, void* data)
+{
+		struct reindent_data* r = data;
+		struct file_buffer* fb = r->fb;
+		int text_start = 0;
+		while (text_start < len && (line[text_start] == ' ' || line[text_start] == '\t'))
+				text_start++;
+
+		int indents, extra_spaces, changed = 1;
+		if (indent_for_line(fb, r->cs, MIN(offset, fb->len-1), &r->state, &indents, &extra_spaces)) {
+				// lines of only whitespace are left empty, the indent is still
+				// carried to the next line
+				if (text_start < len && indents + extra_spaces > 0) {
+						char indent_str[indents * MAX(fb->indent_len, 1) + extra_spaces];
+						fb_text_append(out, indent_str, indent_string(fb, indents, extra_spaces, indent_str));
+				}
+				fb_text_append(out, line + text_start, len - text_start);
+		} else {
+				whitespace_count_to_indent_amount(fb->indent_len, get_line_leading_whitespace_count(fb, fb_span_line(fb, offset)),
+												  &indents, &extra_spaces);
+				changed = 0;
+		}
 
-		fb_insert(fb, indent_str, indent_str_len + extra_spaces, prev_line_offset + 1, 0);
+		int i = r->state.line_count++;
+		r->state.widths[i] = indents * (fb->indent_len ? fb->indent_len : tabspaces) + extra_spaces;
+		r->state.columns[i] = indent_display_column(fb, indents, extra_spaces);
+		return changed;
+}
 
-		free(prev_line);
-		return indent_str_len + extra_spaces - removed;
+// re-indents the lines in one pass and writes them back as one edit,
+// returns the amount of lines that changed
+int
+fb_reindent_lines(struct file_buffer* fb, int first_line, int last_line)
+{
+		const struct syntax_scheme* cs = fb_get_syntax_scheme(fb);
+		if (!cs || !cs->indent_count) {
+				writef_to_status_bar("no indent scheme for this file type");
+				return 0;
+		}
+		if (last_line < first_line)
+				return 0;
+		int lines = last_line - first_line + 1;
+		struct reindent_data r = {
+				.fb = fb,
+				.cs = cs,
+				.state = {
+						.first_line = first_line,
+						.widths = xmalloc(lines * sizeof(int)),
+						.columns = xmalloc(lines * sizeof(int)),
+				},
+		};
+		int changed = fb_transform_lines(fb, first_line, last_line, reindent_line, &r);
+		free(r.state.widths);
+		free(r.state.columns);
+		return changed;
 }
 
-int get_line_leading_whitespace_count(const char* line)
+int get_line_leading_whitespace_count(const struct file_buffer* fb, struct fb_span line)
 {
 		int count = 0;
-		while(*line) {
-				if (*line == ' ')
-						count++;
-				else if (*line == '\t')
-						count += tabspaces - (count % tabspaces);
-				else
-						break;
-				line++;
+		const char* chunk;
+		for (int len; (chunk = fb_span_next(fb, &line, &len)); ) {
+				for (int i = 0; i < len; i++) {
+						if (chunk[i] == ' ')
+								count++;
+						else if (chunk[i] == '\t')
+								count += tabspaces - (count % tabspaces);
+						else
+								return count;
+				}
 		}
 		return count;
 }
@@ -622,26 +791,13 @@ whitespace_count_to_indent_amount(int indent_len, int count, int* indent_count,
 int
 get_line_relative_offset(struct file_buffer* fb, int offset, int count)
 {
-		offset = fb_seek_char(fb, offset, '\n');
+		int line = MAX(fb_offset_to_line(fb, offset) + count, 0);
+		// the '\n' at the end of the line
+		offset = fb_line_to_offset(fb, line+1) - 1;
 		if (offset < 0)
-				offset = fb->len;
-		if (count > 0) {
-				while(count-- && offset >= 0)
-						offset = fb_seek_char(fb, offset+1, '\n');
-				if (offset < 0)
-						offset = fb->len;
-		} else if (count < 0) {
-				offset = fb_seek_char_backwards(fb, offset, '\n');
-				while(count++ && offset >= 0)
-						offset = fb_seek_char_backwards(fb, offset-1, '\n');
-				if (offset < 0)
-						offset = 0;
-		}
-		offset = fb_seek_char(fb, offset, '\n');
-		if (offset > 0 && fb->contents[offset-1] != '\n')
+				return fb->len;
+		if (offset > 0 && fb_char(fb, offset-1) != '\n')
 				offset--;
-		if (offset < 0)
-				offset = fb->len;
 		return offset;
 }
 
@@ -193,20 +193,14 @@ buffers_search_keyword_next_item(const char* tmp, const char* search, int* offse
 			snprintf(item, LINE_MAX_LEN, "%s:%d: ", filename, y);
 			int itemlen = strlen(item);
 
-			char* line = fb_get_line_at_offset(fb, pos);
-			char* line_no_whitespace = line;
+			struct fb_span line = fb_span_line(fb, pos);
 			if (!isspace(*search))
-				while(isspace(*line_no_whitespace)) line_no_whitespace++;
+				while(line.start < line.end && isspace(fb_char(fb, line.start))) line.start++;
 
-			snprintf(item + itemlen, LINE_MAX_LEN - itemlen, "%s", line_no_whitespace);
+			fb_span_copy(fb, line, item + itemlen, LINE_MAX_LEN - itemlen);
 
-			int line_start = fb_seek_char_backwards(fb, pos, '\n') + (line_no_whitespace - line);
-			free(line);
-
-			if (line_start < 0)
-				line_start = 0;
 			if (offset)
-				*offset = (pos - line_start) + itemlen;
+				*offset = (pos - line.start) + itemlen;
 			if (data)
 				*(struct keyword_pos*)data = (struct keyword_pos){.offset = pos, .fb_index = wb.fb_index};
 			pos = fb_seek_char(fb, pos+1, '\n');
@@ -326,13 +320,12 @@ draw_dir(struct window_split_node* wn)
 	int focused = &wn->wb == focused_window;
 	struct file_buffer* fb = get_fb(&wn->wb);
 	char* folder = file_path_get_path(fb->file_path);
+	char* search = fb_get_string_between_offsets(fb, 0, fb->len);
 
-	fb_change(fb, "\0", 1, fb->len, 1);
-	if (fb->len > 0) fb->len--;
-
-	choose_one_of_selection(folder, fb->contents, " [Create New File]", file_browser_next_item,
+	choose_one_of_selection(folder, search, " [Create New File]", file_browser_next_item,
 							&wn->selected, wn->minx, wn->miny, wn->maxx, wn->maxy, focused);
 
+	free(search);
 	free(folder);
 	return 1;
 }
@@ -388,22 +381,21 @@ file_browser_actions(KeySym keysym, int modkey)
 	case XK_Return:
 	{
 		char* path = file_path_get_path(fb->file_path);
-		fb_change(fb, "\0", 1, fb->len, 1);
-		if (fb->len > 0) fb->len--;
+		char* search = fb_get_string_between_offsets(fb, 0, fb->len);
 
 		file_browser_next_item(NULL, NULL, NULL, NULL, NULL);
 		const char* filename;
-		for (int y = 0; (filename = file_browser_next_item(path, fb->contents, NULL, NULL, NULL)); y++) {
+		for (int y = 0; (filename = file_browser_next_item(path, search, NULL, NULL, NULL)); y++) {
 			strcpy(full_path, path);
 			strcat(full_path, filename);
 			if (y == focused_node->selected) {
 				if (path_is_folder(full_path)) {
 					strcpy(fb->file_path, full_path);
 
-					fb->len = 0;
-					fb->contents[0] = '\0';
+					fb_remove(fb, 0, fb->len, 1, 1);
 					focused_node->selected = 0;
 
+					free(search);
 					free(path);
 					file_browser_next_item(NULL, NULL, NULL, NULL, NULL);
 					*full_path = 0;
@@ -413,17 +405,20 @@ file_browser_actions(KeySym keysym, int modkey)
 			}
 		}
 
-		if (fb->contents[fb->len-1] == '/') {
+		if (fb_char(fb, fb->len-1) == '/') {
+			free(search);
 			free(path);
 			*full_path = 0;
 			return 1;
 		}
 
 		strcpy(full_path, path);
-		strcat(full_path, fb->contents);
+		strcat(full_path, search);
 open_file:
+		free(search);
 		new_fb = fb_new_entry(full_path);
 		destroy_fb_entry(focused_node, &root_node);
+		wb_clear_cursors(&focused_node->wb);
 		focused_node->wb = wb_new(new_fb);
 		free(path);
 		*full_path = 0;
@@ -459,12 +454,12 @@ file_browser_string_insert(const char* buf, int buflen)
 		focused_node->selected = 0;
 
 		if (*buf == '/') {
-			fb_change(fb, "\0", 1, fb->len, 0);
-			if (fb->len > 0) fb->len--;
 			char* path = file_path_get_path(fb->file_path);
+			char* search = fb_get_string_between_offsets(fb, 0, fb->len);
 			strcpy(full_path, path);
-			strcat(full_path, fb->contents);
+			strcat(full_path, search);
 
+			free(search);
 			free(path);
 
 			if (path_is_folder(full_path)) {
@@ -489,6 +484,7 @@ search_for_buffer_actions(KeySym keysym, int modkey)
 			buffers_search_keyword_next_item(NULL, NULL, NULL, NULL, NULL);
 			while (buffers_search_keyword_next_item("", focused_node->search, NULL, NULL, &kw)) {
 				if (n == focused_node->selected) {
+					wb_clear_cursors(focused_window);
 					*focused_window = wb_new(kw.fb_index);
 					focused_window->cursor_offset = kw.offset;
 					return 1;
@@ -502,6 +498,7 @@ search_for_buffer_actions(KeySym keysym, int modkey)
 			buffer_search_next_item(NULL, NULL, NULL, NULL, NULL);
 			while (buffer_search_next_item("", focused_node->search, NULL, NULL, &fb_index)) {
 				if (n == focused_node->selected) {
+					wb_clear_cursors(focused_window);
 					*focused_window = wb_new(fb_index);
 					return 1;
 				}
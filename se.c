@@ -45,10 +45,13 @@ writef_string(int y, int x1, int x2, const char* fmt, ...)
 char status_bar_contents[STATUS_BAR_MAX_LEN] = {0};
 static int status_bar_end;
 uint32_t status_bar_bg;
+int status_bar_muted;
 void
 writef_to_status_bar(const char* fmt, ...)
 {
 		if (fmt) {
+				if (status_bar_muted)
+						return;
 				if (status_bar_bg == error_color   ||
 					status_bar_bg == warning_color ||
 					status_bar_bg == ok_color)
@@ -114,20 +117,15 @@ window_node_draw_to_screen(struct window_split_node* wn)
 		if (wrap_buffer)
 				xscroll = 0;
 
+		fb_load_lines(fb, wb->y_scroll + maxy - miny);
+
 		// move to y_scroll
-		char* repl = fb->contents;
-		char* last = repl + fb->len;
-		char* new_repl;
-		int line = wb->y_scroll;
-		while ((new_repl = memchr(repl, '\n', last - repl))) {
-				if (--line < 0)
-						break;
-				else if (new_repl+1 < last)
-						repl = new_repl+1;
-				else
-						return;
-		}
-		int offset_start = repl - fb->contents - 1;
+		const int last = fb->len;
+		int line = MIN(wb->y_scroll, fb_offset_to_line(fb, last));
+		int repl = fb_line_to_offset(fb, line);
+		if (line > 0 && repl >= last)
+				return;
+		int offset_start = repl - 1;
 		int cursor_x = 0, cursor_y = 0;
 
 		// actually write to the screen
@@ -135,11 +133,11 @@ window_node_draw_to_screen(struct window_split_node* wn)
 		int search_found = 0;
 		int non_blocking_search_found = 0;
 
-		// TODO: verify that last - repl is the same as offset_last - offset_start
-		int move_buffer_len = last - repl + 2;
+		// grows if needed, parts of lines outside of the window are skipped
+		// so this is usually enough
+		int move_buffer_len = (maxx - minx + 2) * (maxy - miny + 2) + 64;
 		uint8_t* move_buffer = xmalloc(move_buffer_len);
 		memset(move_buffer, 0, move_buffer_len);
-		move_buffer[0] = 0;
 		int lastx = x, lasty = y;
 		int move_buffer_index = 0;
 
@@ -153,21 +151,47 @@ window_node_draw_to_screen(struct window_split_node* wn)
 				x = write_string(new_line_start, y, minx, maxx+1);
 				global_attr = old_attr;
 		}
+		int line_start = 1, skipped = 0;
 
 		int tmp = 0;
 		call_extension(wb_write_status_bar, &tmp, NULL, 0, 0, 0, 0, NULL, NULL);
 
 		for (int charsize = 1; repl < last && charsize; repl += charsize) {
-				if (y > lasty) {
-						move_buffer[move_buffer_index] = x - minx;
-						move_buffer[move_buffer_index] |= 1<<7;
-				} else {
-						move_buffer[move_buffer_index] = x - lastx;
+				char c = fb_char(fb, repl);
+				if (move_buffer_index + 1 + (int)sizeof(struct move_buffer_skip) > move_buffer_len) {
+						move_buffer_len *= 2;
+						move_buffer = xrealloc(move_buffer, move_buffer_len);
 				}
-				move_buffer_index++;
-				lastx = x, lasty = y;
 
-				if (!once && repl - fb->contents >= wb->cursor_offset) {
+				// parts of long lines outside of the window aren't walked
+				int skip_to = repl, skip_x = x;
+				if (!wrap_buffer && c != '\n') {
+						if (x - xscroll > maxx) {
+								skip_to = fb_seek_char(fb, repl, '\n');
+								if (skip_to < 0)
+										skip_to = last;
+								skip_x = x + skip_to - repl;
+						} else if (line_start && xscroll > 0 && x == minx) {
+								int column;
+								skip_to = fb_column_checkpoint(fb, repl, xscroll, &column);
+								int search_len = 0;
+								if (fb->mode & FB_SEARCH_BLOCKING_MASK && fb->search_term)
+										search_len = strlen(fb->search_term);
+								if (fb->mode & FB_SEARCH_NON_BLOCKING && fb->non_blocking_search_term)
+										search_len = MAX(search_len, strlen(fb->non_blocking_search_term));
+								if (search_len && skip_to > repl) {
+										// a match starting to the left of the window is still highlighted
+										skip_to = MAX(repl, skip_to - search_len * UTF_SIZ);
+										while (skip_to > repl && (fb_char(fb, skip_to) & 0xC0) == 0x80)
+												skip_to--;
+										column = fb_offset_to_column(fb, skip_to);
+								}
+								skip_x = minx + column;
+						}
+				}
+				line_start = 0;
+
+				if (!once && (repl >= wb->cursor_offset || skip_to > wb->cursor_offset)) {
 						// if the buffer being drawn is focused, set the cursor position global
 						once = 1;
 						cursor_x = x - xscroll;
@@ -176,17 +200,35 @@ window_node_draw_to_screen(struct window_split_node* wn)
 						LIMIT(cursor_y, miny, maxy);
 				}
 
-				if (!wrap_buffer && x - xscroll > maxx && *repl != '\n') {
-						charsize = 1;
-						x++;
+				if (skip_to > repl) {
+						struct move_buffer_skip skip = {skip_to, skip_x, y};
+						move_buffer[move_buffer_index++] = MOVE_BUFFER_SKIP;
+						memcpy(move_buffer + move_buffer_index, &skip, sizeof(skip));
+						move_buffer_index += sizeof(skip);
+						x = lastx = skip_x, lasty = y;
+						charsize = skip_to - repl;
+						skipped = 1;
 						continue;
 				}
 
-				if (*repl == '\n' || (wrap_buffer && x >= maxx)) {
+				// the skip already says where this char is
+				if (!skipped) {
+						if (y > lasty) {
+								move_buffer[move_buffer_index] = x - minx;
+								move_buffer[move_buffer_index] |= MOVE_BUFFER_NEW_LINE;
+						} else {
+								move_buffer[move_buffer_index] = x - lastx;
+						}
+						move_buffer_index++;
+				}
+				skipped = 0;
+				lastx = x, lasty = y;
+
+				if (c == '\n' || (wrap_buffer && x >= maxx)) {
 						x = minx;
 						if (++y >= maxy-1)
 								break;
-						if (wrap_buffer && *repl != '\n')
+						if (wrap_buffer && c != '\n')
 								continue;
 						charsize = 1;
 						char* new_line_start = NULL;
@@ -197,8 +239,9 @@ window_node_draw_to_screen(struct window_split_node* wn)
 								x = write_string(new_line_start, y, minx, maxx+1);
 								global_attr = old_attr;
 						}
+						line_start = 1;
 						continue;
-				} else if (*repl == '\t') {
+				} else if (c == '\t') {
 						charsize = 1;
 						if ((x - minx) <= 0) {
 								x += screen_set_char(' ', x - xscroll, y);
@@ -214,7 +257,7 @@ window_node_draw_to_screen(struct window_split_node* wn)
 				}
 
 				rune_t u;
-				charsize = utf8_decode_buffer(repl, last - repl, &u);
+				charsize = fb_utf8_decode(fb, repl, &u);
 
 				int width;
 				if (x - xscroll >= minx)
@@ -224,7 +267,7 @@ window_node_draw_to_screen(struct window_split_node* wn)
 
 				// drawing search highlight
 				if (fb->mode & FB_SEARCH_BLOCKING_MASK) {
-						if (!search_found && fb_offset_starts_with(fb, repl - fb->contents, fb->search_term))
+						if (!search_found && fb_offset_starts_with(fb, repl, fb->search_term))
 								search_found = strlen(fb->search_term);
 						if (search_found) {
 								screen_set_attr(x - xscroll, y)->bg = highlight_color;
@@ -233,7 +276,7 @@ window_node_draw_to_screen(struct window_split_node* wn)
 						}
 				}
 				if (fb->mode & FB_SEARCH_NON_BLOCKING) {
-						if (!non_blocking_search_found && fb_offset_starts_with(fb, repl - fb->contents, fb->non_blocking_search_term))
+						if (!non_blocking_search_found && fb_offset_starts_with(fb, repl, fb->non_blocking_search_term))
 								non_blocking_search_found = strlen(fb->search_term);
 						if (non_blocking_search_found) {
 								screen_set_attr(x - xscroll, y)->fg = highlight_color;
@@ -244,7 +287,7 @@ window_node_draw_to_screen(struct window_split_node* wn)
 
 				x += width;
 		}
-		int offset_end = repl - fb->contents;
+		int offset_end = repl;
 		global_attr = default_attributes;
 
 		if (wb->cursor_offset >= fb->len) {
@@ -252,7 +295,7 @@ window_node_draw_to_screen(struct window_split_node* wn)
 				cursor_y = MIN(y, maxy);
 		}
 
-		call_extension(window_written_to_screen, wn, offset_start, offset_end, move_buffer, move_buffer_len);
+		call_extension(window_written_to_screen, wn, offset_start, offset_end, move_buffer, move_buffer_index);
 
 		int status_end = minx;
 		int write_again;
@@ -285,6 +328,19 @@ window_node_draw_to_screen(struct window_split_node* wn)
 		}
 
 		wb_write_selection(wb, minx, miny, maxx, maxy);
+
+		// extra cursors
+		for (int i = 0; i < wb_cursor_count(wb); i++) {
+				int offset = wb_cursor_offset(wb, i);
+				if (offset < offset_start || offset > offset_end)
+						continue;
+				int cx, cy, tmp;
+				fb_offset_to_xy(fb, offset, maxx - minx, wb->y_scroll, &cx, &cy, &tmp);
+				cx += minx - xscroll;
+				cy += miny;
+				if (cx >= minx && cx <= maxx && cy >= miny && cy < maxy-1)
+						screen_set_attr(cx, cy)->mode ^= ATTR_REVERSE;
+		}
 		//do_syntax_scheme(NULL, &(struct syntax_scheme){0}, 0);
 
 		for (int i = miny; i < maxy; i++)
@@ -348,6 +404,39 @@ wb_write_selection(struct window_buffer* wb, int minx, int miny, int maxx, int m
 		if (!(fb->mode & FB_SELECTION_ON))
 				return;
 
+		if (fb->mode & FB_BLOCK_SELECT) {
+				int first_line, last_line, left, right, tmp, xscroll;
+				fb_get_block(fb, &first_line, &last_line, &left, &right);
+				fb_offset_to_xy(fb, wb->cursor_offset, maxx - minx, wb->y_scroll, &tmp, &tmp, &xscroll);
+				if (wrap_buffer)
+						xscroll = 0;
+
+				// only the lines on screen are looked at
+				int line = MAX(first_line, wb->y_scroll);
+				int line_start = fb_line_to_offset(fb, line);
+				for (; line <= last_line; line++) {
+						struct fb_span span = fb_block_span(fb, line_start, left, right, NULL, NULL);
+						line_start = fb_seek_char(fb, span.end, '\n') + 1;
+						int x, y, x2, y2;
+						fb_offset_to_xy(fb, span.start, maxx - minx, wb->y_scroll, &x, &y, &tmp);
+						if (y + miny >= maxy)
+								break;
+						if (span.start == span.end)
+								continue;
+						fb_offset_to_xy(fb, span.end, maxx - minx, wb->y_scroll, &x2, &y2, &tmp);
+						x += minx - xscroll, x2 += minx - xscroll;
+						y += miny, y2 += miny;
+						LIMIT(x, minx, maxx+1);
+						LIMIT(x2, minx, maxx+1);
+						for(; y < y2; y++, x = minx)
+								for(; x <= maxx; x++)
+										color_selection(screen_set_attr(x, y));
+						for(; x < x2; x++)
+								color_selection(screen_set_attr(x, y));
+				}
+				return;
+		}
+
 		int x, y, x2, y2, tmp, xscroll;
 		if (fb_is_selection_start_top_left(fb)) {
 				fb_offset_to_xy(fb, fb->s1o, maxx - minx, wb->y_scroll, &x, &y, &tmp);
@@ -16,8 +16,22 @@ int write_string(const char* string, int y, int minx, int maxx);
 extern char status_bar_contents[STATUS_BAR_MAX_LEN];
 extern uint32_t status_bar_bg;
 void writef_to_status_bar(const char* fmt, ...);
+// while non-zero writef_to_status_bar leaves the status bar as it is
+extern int status_bar_muted;
 void draw_status_bar();
 
 void window_node_draw_to_screen(struct window_split_node* wn);
 
+///////////////////////////////////
+// the move buffer passed to window_written_to_screen has one entry per char
+// drawn: how far x moved since the last char, or the x of the char with
+// MOVE_BUFFER_NEW_LINE set if it is the first char on a new line
+// MOVE_BUFFER_SKIP is followed by a struct move_buffer_skip, the chars
+// before skip.offset were not drawn and the next char is at skip.x, skip.y
+#define MOVE_BUFFER_NEW_LINE (1<<7)
+#define MOVE_BUFFER_SKIP 0x7F
+struct move_buffer_skip {
+		int offset, x, y;
+};
+
 #endif // _SE_H
@@ -66,9 +66,14 @@ inline int
 fb_seek_char(const struct file_buffer* fb, int offset, char byte)
 {
 		if (offset > fb->len) return -1;
-		char* new_buf = memchr(fb->contents + offset, byte, fb->len - offset);
-		if (!new_buf) return -1;
-		return new_buf - fb->contents;
+		if (offset < 0) offset = 0;
+		const char* chunk;
+		for (int len; (chunk = fb_chunk(fb, offset, &len)); offset += len) {
+				const char* new_buf = memchr(chunk, byte, len);
+				if (new_buf)
+						return offset + (new_buf - chunk);
+		}
+		return -1;
 }
 
 inline int
@@ -76,30 +81,40 @@ fb_seek_char_backwards(const struct file_buffer* fb, int offset, char byte)
 {
 		BOUNDS_CHECK(offset, 0, fb->len-1);
 		for (int n = offset-1; n >= 0; n--) {
-				if (fb->contents[n] == byte) {
+				if (fb_char(fb, n) == byte) {
 						return n+1;
 				}
 		}
 		return -1;
 }
 
+int
+fb_span_find(const struct file_buffer* fb, struct fb_span span, const char* string)
+{
+		int str_len = strlen(string);
+		span.start = MAX(span.start, 0);
+		span.end = MIN(span.end, fb->len);
+
+		const char* chunk;
+		for (int offset = span.start, len; (chunk = fb_span_next(fb, &span, &len)); offset += len) {
+				const char* res = memmem(chunk, len, string, str_len);
+				if (res)
+						return offset + (res - chunk);
+
+				// matches that start in this chunk and end in the next one
+				int next_chunk = offset + len;
+				for (int n = MAX(offset, next_chunk - str_len + 1); n < next_chunk && n + str_len <= span.end; n++)
+						if (!fb_memcmp(fb, n, string, str_len))
+								return n;
+		}
+		return -1;
+}
+
 inline int
 fb_seek_string(const struct file_buffer* fb, int offset, const char* string)
 {
 		BOUNDS_CHECK(offset, 0, fb->len-1);
-		int str_len = strlen(string);
-
-#if 0
-		for (int n = offset; n < fb->len - str_len; n++)
-				if (!memcmp(fb->contents + n, string, str_len))
-						return n;
-#else
-		char* res = memmem(fb->contents + offset, fb->len - offset,
-						   string, str_len);
-		if (res)
-				return res - fb->contents;
-#endif
-		return -1;
+		return fb_span_find(fb, (struct fb_span){.start = offset, .end = fb->len}, string);
 }
 
 inline int
@@ -110,7 +125,7 @@ fb_seek_string_backwards(const struct file_buffer* fb, int offset, const char* s
 		BOUNDS_CHECK(offset, 0, fb->len-1);
 
 		for (int n = offset - str_len; n >= 0; n--)
-				if (!memcmp(fb->contents + n, string, str_len))
+				if (fb_char(fb, n) == *string && !fb_memcmp(fb, n, string, str_len))
 						return n;
 		return -1;
 }
@@ -119,12 +134,21 @@ inline int
 wb_seek_string_wrap(const struct window_buffer* wb, int offset, const char* search)
 {
 		struct file_buffer* fb = get_fb(focused_window);
-		if (*search == 0 || !fb_count_string_instances(fb, search, 0, NULL))
+		if (*search == 0)
 				return -1;
 
 		int new_offset = fb_seek_string(fb, offset, search);
+		// stream through the parts of the file that aren't loaded yet
+		while (new_offset < 0 && fb->loader) {
+				int searched = MAX(offset, fb->len - (int)strlen(search) + 1);
+				if (!fb_load_chunk(fb))
+						break;
+				new_offset = fb_seek_string(fb, searched, search);
+		}
 		if (new_offset < 0)
 				new_offset = fb_seek_string(fb, 0, search);
+		if (new_offset < 0)
+				return -1;
 
 		if (!(fb->mode & FB_SEARCH_BLOCKING))
 				fb->mode |= FB_SEARCH_BLOCKING_IDLE;
@@ -135,12 +159,17 @@ inline int
 wb_seek_string_wrap_backwards(const struct window_buffer* wb, int offset, const char* search)
 {
 		struct file_buffer* fb = get_fb(focused_window);
-		if (*search == 0 || !fb_count_string_instances(fb, search, 0, NULL))
+		if (*search == 0)
 				return -1;
 
 		int new_offset = fb_seek_string_backwards(fb, offset, search);
-		if (new_offset < 0)
+		if (new_offset < 0) {
+				// wrapping around starts at the real end of the file
+				fb_load_all(fb);
 				new_offset = fb_seek_string_backwards(fb, fb->len, search);
+		}
+		if (new_offset < 0)
+				return -1;
 
 		if (!(fb->mode & FB_SEARCH_BLOCKING))
 				fb->mode |= FB_SEARCH_BLOCKING_IDLE;
@@ -151,7 +180,7 @@ int
 fb_is_on_a_word(const struct file_buffer* fb, int offset, const char* word_seperators)
 {
 		BOUNDS_CHECK(offset, 0, fb->len);
-		return !str_contains_char(word_seperators, fb->contents[offset]);
+		return !str_contains_char(word_seperators, fb_char(fb, offset));
 }
 
 inline int
@@ -159,7 +188,7 @@ fb_is_start_of_a_word(const struct file_buffer* fb, int offset, const char* word
 {
 		BOUNDS_CHECK(offset, 0, fb->len);
 		return fb_is_on_a_word(fb, offset, word_seperators) &&
-				(offset-1 <= 0 || str_contains_char(word_seperators, fb->contents[offset-1]));
+				(offset-1 <= 0 || str_contains_char(word_seperators, fb_char(fb, offset-1)));
 }
 
 inline int
@@ -178,11 +207,11 @@ inline int
 fb_offset_starts_with(const struct file_buffer* fb, int offset, const char* start)
 {
 		BOUNDS_CHECK(offset, 0, fb->len);
-		if (offset > 0 && fb->contents[offset-1] == '\\') return 0;
+		if (offset > 0 && fb_char(fb, offset-1) == '\\') return 0;
 
 		int len = strlen(start);
 		int mlen = MIN(len, fb->len - offset);
-		return memcmp(fb->contents + offset, start, mlen) == 0;
+		return fb_memcmp(fb, offset, start, mlen) == 0;
 }
 
 inline int
@@ -190,7 +219,7 @@ fb_seek_word(const struct file_buffer* fb, int offset, const char* word_seperato
 {
 		if (fb_is_on_a_word(fb, offset, word_seperators))
 				offset = fb_seek_word_end(fb, offset, word_seperators);
-		while (offset < fb->len && str_contains_char(word_seperators, fb->contents[offset])) offset++;
+		while (offset < fb->len && str_contains_char(word_seperators, fb_char(fb, offset))) offset++;
 		return offset;
 }
 
@@ -200,7 +229,7 @@ fb_seek_word_end(const struct file_buffer* fb, int offset, const char* word_sepe
 		BOUNDS_CHECK(offset, 0, fb->len);
 		if (!fb_is_on_a_word(fb, offset, word_seperators))
 				offset = fb_seek_word(fb, offset, word_seperators);
-		while (offset < fb->len && !str_contains_char(word_seperators, fb->contents[offset])) offset++;
+		while (offset < fb->len && !str_contains_char(word_seperators, fb_char(fb, offset))) offset++;
 		return offset;
 }
 
@@ -209,7 +238,7 @@ fb_seek_word_backwards(const struct file_buffer* fb, int offset, const char* wor
 {
 		BOUNDS_CHECK(offset, 0, fb->len);
 		if (!fb_is_on_a_word(fb, offset, word_seperators))
-				while (offset > 0 && str_contains_char(word_seperators, fb->contents[offset])) offset--;
+				while (offset > 0 && str_contains_char(word_seperators, fb_char(fb, offset))) offset--;
 		return offset;
 }
 
@@ -218,8 +247,8 @@ fb_seek_start_of_word_backwards(const struct file_buffer* fb, int offset, const
 {
 		BOUNDS_CHECK(offset, 0, fb->len);
 		if (!fb_is_on_a_word(fb, offset, word_seperators))
-				while (offset > 0 && str_contains_char(word_seperators, fb->contents[offset])) offset--;
-		while (offset > 0 && !str_contains_char(word_seperators, fb->contents[offset])) offset--;
+				while (offset > 0 && str_contains_char(word_seperators, fb_char(fb, offset))) offset--;
+		while (offset > 0 && !str_contains_char(word_seperators, fb_char(fb, offset))) offset--;
 		return offset+1;
 }
 
@@ -227,7 +256,7 @@ inline int
 fb_seek_whitespace(const struct file_buffer* fb, int offset)
 {
 		BOUNDS_CHECK(offset, 0, fb->len);
-		while (offset < fb->len && !isspace(fb->contents[offset])) offset++;
+		while (offset < fb->len && !isspace(fb_char(fb, offset))) offset++;
 		return offset;
 }
 
@@ -235,7 +264,7 @@ inline int
 fb_seek_whitespace_backwards(const struct file_buffer* fb, int offset)
 {
 		BOUNDS_CHECK(offset, 0, fb->len);
-		while (offset > 0 && !isspace(fb->contents[offset])) offset--;
+		while (offset > 0 && !isspace(fb_char(fb, offset))) offset--;
 		return offset;
 }
 
@@ -243,7 +272,7 @@ inline int
 fb_seek_not_whitespace(const struct file_buffer* fb, int offset)
 {
 		BOUNDS_CHECK(offset, 0, fb->len);
-		while (offset < fb->len && isspace(fb->contents[offset])) offset++;
+		while (offset < fb->len && isspace(fb_char(fb, offset))) offset++;
 		return offset;
 }
 
@@ -251,7 +280,7 @@ inline int
 fb_seek_not_whitespace_backwards(const struct file_buffer* fb, int offset)
 {
 		BOUNDS_CHECK(offset, 0, fb->len);
-		while (offset > 0 && isspace(fb->contents[offset])) offset--;
+		while (offset > 0 && isspace(fb_char(fb, offset))) offset--;
 		return offset;
 }
 
@@ -270,7 +299,7 @@ fb_count_string_instances(const struct file_buffer* fb, const char* string, int
 		int count =  0;
 		int once  =  1;
 		while((pos = fb_seek_string(fb, pos+1, string)) >= 0) {
-				if (pos > 0 && fb->contents[pos-2] == '\\')
+				if (pos > 0 && fb_char(fb, pos-2) == '\\')
 						continue;
 				if (once && pos > offset) {
 						*before_offset = count;
@@ -298,7 +327,7 @@ fb_seek_string_not_escaped(const struct file_buffer* fb, int offset, const char*
 {
 		for (;;) {
 				offset = fb_seek_string(fb, offset, string);
-				if (offset >= 0 && fb->contents[offset-1] == '\\')
+				if (offset >= 0 && fb_char(fb, offset-1) == '\\')
 						offset++;
 				else
 						break;
@@ -311,7 +340,7 @@ fb_seek_string_backwards_not_escaped(const struct file_buffer* fb, int offset, c
 {
 		for (;;) {
 				offset = fb_seek_string_backwards(fb, offset, string);
-				if (offset >= 0 && fb->contents[offset-1] == '\\')
+				if (offset >= 0 && fb_char(fb, offset-1) == '\\')
 						offset--;
 				else
 						break;
@@ -433,6 +462,19 @@ fb_get_delimiter(const struct file_buffer* fb, int offset, struct delimiter d, s
 				return fb_get_delimiter_equal_start_end(fb, offset, start_word, ignore, start, end);
 		int wanted_opener = fb_get_matched_delimiter_start(fb, offset, d);
 
+		// with nothing to ignore the search from the start of the file can
+		// only stop at the wanted opener, or right away on one at offset 0
+		if (!ignore) {
+				if (wanted_opener < 0 || fb_memcmp(fb, 0, start_word, strlen(start_word)) == 0)
+						return 0;
+				*start = wanted_opener;
+				int closer = fb_get_matched_delimiter_end(fb, wanted_opener+1, d);
+				if (closer <= offset)
+						return 0;
+				*end = closer;
+				return 1;
+		}
+
 		int ignore_index = 0;
 		int last_distance = 0;
 
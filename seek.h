@@ -29,6 +29,8 @@ int fb_seek_char(const struct file_buffer* fb, int offset, char byte);
 int fb_seek_char_backwards(const struct file_buffer* fb, int offset, char byte);
 
 int fb_seek_string(const struct file_buffer* fb, int offset, const char* string);
+// like fb_seek_string, but only finds matches that are inside of span
+int fb_span_find(const struct file_buffer* fb, struct fb_span span, const char* string);
 int fb_seek_string_not_escaped(const struct file_buffer* fb, int offset, const char* string);
 int fb_seek_string_backwards(const struct file_buffer* fb, int offset, const char* string);
 int fb_seek_string_backwards_not_escaped(const struct file_buffer* fb, int offset, const char* string);
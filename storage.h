@@ -0,0 +1,62 @@
+#ifndef STORAGE_H_
+#define STORAGE_H_
+
+/*
+** storage: the backing store behind the contents of a file buffer
+**
+** There are multiple backends, one is picked at build time with
+** STORAGE in config.mk. The rest of the program only talks to the
+** contents through this interface (or the fb_* wrappers in buffer.h),
+** so no code should assume the contents are one contiguous char*.
+**
+** Offsets are byte offsets. A pointer returned by storage_chunk()
+** is only valid until the storage is modified.
+*/
+
+struct fb_storage;
+
+///////////////////////////////////
+// takes ownership of data, it must be malloced (or NULL if len is 0)
+// depending on the backend data will never be written to
+struct fb_storage* storage_new(char* data, int len);
+// data is a read only mapping of a file (see mmap(2)), it is unmapped when
+// the storage is freed, edits go elsewhere so the file is never copied
+// in full unless the backend has no other choice
+struct fb_storage* storage_new_mapped(const char* data, int len);
+void storage_free(struct fb_storage* s);
+// a read only copy of s that later edits of s don't change
+// it shares everything it can with s, edits copy what they touch first
+// the snapshot can be read by another thread while s is edited, but it
+// has to be taken and freed on the thread that edits s
+struct fb_storage* storage_snapshot(struct fb_storage* s);
+
+int  storage_len(const struct fb_storage* s);
+void storage_insert(struct fb_storage* s, int offset, const char* data, int len);
+void storage_remove(struct fb_storage* s, int offset, int len);
+
+///////////////////////////////////
+// replaces many ranges at once, the edits are sorted by offset, don't
+// overlap and their offsets are from before any of them are applied
+struct storage_edit {
+		int offset, removed;
+		const char* data;
+		int len;
+};
+void storage_apply(struct fb_storage* s, const struct storage_edit* edits, int count);
+
+///////////////////////////////////
+// returns a pointer to the byte at offset and sets *len to the amount
+// of contiguous bytes that can be read from there
+// returns NULL if the offset is outside of the storage
+const char* storage_chunk(const struct fb_storage* s, int offset, int* len);
+void storage_copy(const struct fb_storage* s, int offset, int len, char* dest);
+
+///////////////////////////////////
+// lines are counted from 0, the offset of a line is the byte after its '\n'
+// storage_line_to_offset returns -1 if there aren't that many lines
+int storage_offset_to_line(const struct fb_storage* s, int offset);
+int storage_line_to_offset(const struct fb_storage* s, int line);
+// amount of utf8 chars before offset
+int storage_offset_to_char(const struct fb_storage* s, int offset);
+
+#endif // STORAGE_H_
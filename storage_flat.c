@@ -0,0 +1,281 @@
+/*
+** flat storage backend
+** the whole buffer is kept in one array, every edit moves everything after it
+** the offsets of all newlines are kept in a sorted array next to it
+** a mapped file is only copied into the array when it is first edited
+** snapshots share both arrays in the same way, the first edit after
+** taking one copies them
+*/
+
+#include "storage.h"
+#include "x.h"
+
+#include <string.h>
+#include <sys/mman.h>
+
+struct fb_storage {
+		char* contents; // !! NOT NULL TERMINATED !!
+		int len;
+		int capacity;
+		int mapped; // contents is a read only mapping of the file
+
+		int* newlines;
+		int newlines_len, newlines_capacity;
+
+		// if not NULL the arrays are shared with snapshots (or the storage
+		// the snapshot was taken of), it points to the amount of sharers
+		int* shared;
+};
+
+///////////////////////////////////
+// returns the index of the first newline at or after offset
+// this is also the amount of newlines before offset
+static int
+newlines_search(const struct fb_storage* s, int offset)
+{
+		int low = 0, high = s->newlines_len;
+		while (low < high) {
+				int mid = low + (high - low) / 2;
+				if (s->newlines[mid] < offset)
+						low = mid + 1;
+				else
+						high = mid;
+		}
+		return low;
+}
+
+static void
+newlines_insert(struct fb_storage* s, int offset, const char* data, int len)
+{
+		int index = newlines_search(s, offset);
+		for (int i = index; i < s->newlines_len; i++)
+				s->newlines[i] += len;
+
+		int count = 0;
+		const char* end = data + len;
+		for (const char* c = data; (c = memchr(c, '\n', end - c)); c++)
+				count++;
+		if (!count)
+				return;
+
+		if (s->newlines_len + count > s->newlines_capacity) {
+				s->newlines_capacity = (s->newlines_len + count) * 2;
+				s->newlines = xrealloc(s->newlines, s->newlines_capacity * sizeof(int));
+		}
+		memmove(s->newlines + index + count, s->newlines + index, (s->newlines_len - index) * sizeof(int));
+		s->newlines_len += count;
+		for (const char* c = data; (c = memchr(c, '\n', end - c)); c++)
+				s->newlines[index++] = offset + (c - data);
+}
+
+static void
+newlines_remove(struct fb_storage* s, int offset, int len)
+{
+		int start = newlines_search(s, offset);
+		int end = newlines_search(s, offset + len);
+		if (end > start)
+				memmove(s->newlines + start, s->newlines + end, (s->newlines_len - end) * sizeof(int));
+		s->newlines_len -= end - start;
+		for (int i = start; i < s->newlines_len; i++)
+				s->newlines[i] -= len;
+}
+
+struct fb_storage*
+storage_new(char* data, int len)
+{
+		struct fb_storage* s = xmalloc(sizeof(struct fb_storage));
+		s->len = len;
+		s->capacity = len;
+		s->contents = data;
+		if (!s->contents) {
+				s->capacity = 100;
+				s->contents = xmalloc(s->capacity);
+		}
+		s->mapped = 0;
+		s->shared = NULL;
+		s->newlines = NULL;
+		s->newlines_len = s->newlines_capacity = 0;
+		newlines_insert(s, 0, s->contents, s->len);
+		return s;
+}
+
+struct fb_storage*
+storage_new_mapped(const char* data, int len)
+{
+		struct fb_storage* s = storage_new((char*)data, len);
+		s->mapped = 1;
+		return s;
+}
+
+///////////////////////////////////
+// copy on write, a mapping or shared arrays are replaced by a copy
+// before they are modified
+static void
+storage_unmap(struct fb_storage* s)
+{
+		if (s->shared && *s->shared == 1) {
+				free(s->shared);
+				s->shared = NULL;
+		}
+		if (!s->mapped && !s->shared)
+				return;
+		char* contents = s->contents;
+		s->capacity = s->len + 256;
+		s->contents = xmalloc(s->capacity);
+		memcpy(s->contents, contents, s->len);
+
+		if (s->shared) {
+				int* newlines = s->newlines;
+				s->newlines_capacity = s->newlines_len + 16;
+				s->newlines = xmalloc(s->newlines_capacity * sizeof(int));
+				memcpy(s->newlines, newlines, s->newlines_len * sizeof(int));
+				(*s->shared)--;
+				s->shared = NULL;
+		} else {
+				munmap(contents, s->len);
+		}
+		s->mapped = 0;
+}
+
+struct fb_storage*
+storage_snapshot(struct fb_storage* s)
+{
+		if (!s->shared) {
+				s->shared = xmalloc(sizeof(int));
+				*s->shared = 1;
+		}
+		(*s->shared)++;
+		struct fb_storage* snapshot = xmalloc(sizeof(struct fb_storage));
+		*snapshot = *s;
+		return snapshot;
+}
+
+// lets go of the arrays, they are freed if nothing else shares them
+static void
+storage_release(struct fb_storage* s)
+{
+		if (s->shared && --(*s->shared) > 0)
+				return;
+		free(s->shared);
+		if (s->mapped)
+				munmap(s->contents, s->len);
+		else
+				free(s->contents);
+		free(s->newlines);
+}
+
+void
+storage_free(struct fb_storage* s)
+{
+		if (!s)
+				return;
+		storage_release(s);
+		free(s);
+}
+
+int
+storage_len(const struct fb_storage* s)
+{
+		return s->len;
+}
+
+void
+storage_insert(struct fb_storage* s, int offset, const char* data, int len)
+{
+		storage_unmap(s);
+		if (s->len + len >= s->capacity) {
+				s->capacity = s->len + len + 256;
+				s->contents = xrealloc(s->contents, s->capacity);
+		}
+		if (offset < s->len)
+				memmove(s->contents+offset+len, s->contents+offset, s->len-offset);
+		s->len += len;
+
+		memcpy(s->contents+offset, data, len);
+		newlines_insert(s, offset, data, len);
+}
+
+void
+storage_remove(struct fb_storage* s, int offset, int len)
+{
+		storage_unmap(s);
+		s->len -= len;
+		memmove(s->contents+offset, s->contents+offset+len, s->len-offset);
+		newlines_remove(s, offset, len);
+}
+
+void
+storage_apply(struct fb_storage* s, const struct storage_edit* edits, int count)
+{
+		// everything is moved once into a new array instead of once per edit
+		int len = s->len;
+		for (int i = 0; i < count; i++)
+				len += edits[i].len - edits[i].removed;
+		int capacity = len + 256;
+		char* contents = xmalloc(capacity);
+
+		int from = 0, to = 0;
+		for (int i = 0; i < count; i++) {
+				memcpy(contents + to, s->contents + from, edits[i].offset - from);
+				to += edits[i].offset - from;
+				if (edits[i].len)
+						memcpy(contents + to, edits[i].data, edits[i].len);
+				to += edits[i].len;
+				from = edits[i].offset + edits[i].removed;
+		}
+		memcpy(contents + to, s->contents + from, s->len - from);
+
+		storage_release(s);
+		s->contents = contents;
+		s->len = len;
+		s->capacity = capacity;
+		s->mapped = 0;
+		s->shared = NULL;
+		s->newlines = NULL;
+		s->newlines_len = s->newlines_capacity = 0;
+		newlines_insert(s, 0, s->contents, s->len);
+}
+
+const char*
+storage_chunk(const struct fb_storage* s, int offset, int* len)
+{
+		if (offset < 0 || offset >= s->len) {
+				*len = 0;
+				return NULL;
+		}
+		*len = s->len - offset;
+		return s->contents + offset;
+}
+
+void
+storage_copy(const struct fb_storage* s, int offset, int len, char* dest)
+{
+		memcpy(dest, s->contents + offset, len);
+}
+
+int
+storage_offset_to_line(const struct fb_storage* s, int offset)
+{
+		return newlines_search(s, offset);
+}
+
+int
+storage_line_to_offset(const struct fb_storage* s, int line)
+{
+		if (line <= 0)
+				return 0;
+		if (line > s->newlines_len)
+				return -1;
+		return s->newlines[line-1] + 1;
+}
+
+int
+storage_offset_to_char(const struct fb_storage* s, int offset)
+{
+		LIMIT(offset, 0, s->len);
+		int chars = 0;
+		for (int i = 0; i < offset; i++)
+				if ((s->contents[i] & 0xC0) != 0x80) // if byte doesn't start with 0b10
+						chars++;
+		return chars;
+}
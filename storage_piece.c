@@ -0,0 +1,558 @@
+/*
+** piece table storage backend
+**
+** The loaded file (the original buffer) is never written to, everything
+** that gets inserted is appended to the add buffer. The contents are
+** described by a sequence of pieces pointing into one of those buffers.
+**
+** The pieces are kept in a treap ordered by their position, every node
+** knows the amount of bytes and newlines in its subtree. Finding, splitting
+** and joining pieces is O(log pieces), so edits and line lookups don't
+** depend on the file size. Pieces are at most PIECE_MAX bytes, so counting
+** the newlines of a piece that gets cut in two stays cheap.
+**
+** The original buffer may be a mapping of the file, since it is never
+** written to edits don't copy anything out of it.
+**
+** Snapshots share the tree. A piece that is referenced by more than one
+** tree is never changed, edits copy it (and the path down to it) first.
+** The add buffer is only appended to, so snapshots can keep reading it,
+** when it has to grow while it is shared it is copied instead of realloced.
+*/
+
+#include "storage.h"
+#include "x.h"
+
+#include <string.h>
+#include <sys/mman.h>
+
+#define PIECE_MAX (1 << 15)
+
+struct piece {
+		struct piece *left, *right;
+		int refs; // amount of parents and roots pointing to this piece
+		unsigned int priority;
+		int add; // 1 if the piece points into the add buffer
+		int start, len;
+		int newlines;
+		int size;  // bytes in this subtree
+		int lines; // newlines in this subtree
+};
+
+// the text pieces point into, shared between a storage and its snapshots
+struct piece_text {
+		int refs;
+		char* data;
+		int len, capacity;
+		int mapped; // data is mmapped instead of malloced
+};
+
+struct fb_storage {
+		struct piece_text* original;
+		struct piece_text* add;
+
+		struct piece* root;
+
+		// the last piece handed out by storage_chunk
+		// sequential reads will hit this and won't have to walk the tree
+		const struct piece* cache;
+		int cache_offset;
+};
+
+static unsigned int
+piece_random(void)
+{
+		// xorshift32
+		static unsigned int state = 2463534242;
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state;
+}
+
+static inline int
+piece_size(const struct piece* p)
+{
+		return p ? p->size : 0;
+}
+
+static inline int
+piece_lines(const struct piece* p)
+{
+		return p ? p->lines : 0;
+}
+
+static inline void
+piece_update(struct piece* p)
+{
+		p->size = piece_size(p->left) + p->len + piece_size(p->right);
+		p->lines = piece_lines(p->left) + p->newlines + piece_lines(p->right);
+}
+
+static int
+count_newlines(const char* data, int len)
+{
+		int count = 0;
+		const char* end = data + len;
+		while ((data = memchr(data, '\n', end - data))) {
+				count++;
+				data++;
+		}
+		return count;
+}
+
+static inline const char*
+piece_data(const struct fb_storage* s, const struct piece* p)
+{
+		return (p->add ? s->add : s->original)->data + p->start;
+}
+
+static struct piece_text*
+piece_text_new(char* data, int len, int mapped)
+{
+		struct piece_text* t = xmalloc(sizeof(struct piece_text));
+		*t = (struct piece_text) {
+				.refs = 1,
+				.data = data,
+				.len = len,
+				.capacity = len,
+				.mapped = mapped,
+		};
+		return t;
+}
+
+static void
+piece_text_free(struct piece_text* t)
+{
+		if (--t->refs > 0)
+				return;
+		if (t->mapped)
+				munmap(t->data, t->capacity);
+		else
+				free(t->data);
+		free(t);
+}
+
+static struct piece*
+piece_new(const struct fb_storage* s, int add, int start, int len, int newlines)
+{
+		struct piece* p = xmalloc(sizeof(struct piece));
+		*p = (struct piece) {
+				.refs = 1,
+				.priority = piece_random(),
+				.add = add,
+				.start = start,
+				.len = len,
+				.newlines = newlines,
+		};
+		if (newlines < 0)
+				p->newlines = count_newlines(piece_data(s, p), len);
+		piece_update(p);
+		return p;
+}
+
+static void
+piece_free(struct piece* p)
+{
+		if (!p || --p->refs > 0)
+				return;
+		piece_free(p->left);
+		piece_free(p->right);
+		free(p);
+}
+
+///////////////////////////////////
+// returns a piece that can be changed in place of p
+// a piece shared with a snapshot is replaced by a copy
+static struct piece*
+piece_own(struct piece* p)
+{
+		if (!p || p->refs == 1)
+				return p;
+		struct piece* copy = xmalloc(sizeof(struct piece));
+		*copy = *p;
+		copy->refs = 1;
+		if (copy->left)
+				copy->left->refs++;
+		if (copy->right)
+				copy->right->refs++;
+		p->refs--;
+		return copy;
+}
+
+static struct piece*
+piece_merge(struct piece* l, struct piece* r)
+{
+		if (!l)
+				return r;
+		if (!r)
+				return l;
+		if (l->priority > r->priority) {
+				l = piece_own(l);
+				l->right = piece_merge(l->right, r);
+				piece_update(l);
+				return l;
+		}
+		r = piece_own(r);
+		r->left = piece_merge(l, r->left);
+		piece_update(r);
+		return r;
+}
+
+///////////////////////////////////
+// splits the tree so that *l contains the first offset bytes and *r the rest
+// a piece containing the split point is cut in two
+static void
+piece_split(const struct fb_storage* s, struct piece* p, int offset, struct piece** l, struct piece** r)
+{
+		if (!p) {
+				*l = *r = NULL;
+				return;
+		}
+		p = piece_own(p);
+
+		int left_size = piece_size(p->left);
+		if (offset <= left_size) {
+				piece_split(s, p->left, offset, l, &p->left);
+				piece_update(p);
+				*r = p;
+		} else if (offset >= left_size + p->len) {
+				piece_split(s, p->right, offset - left_size - p->len, &p->right, r);
+				piece_update(p);
+				*l = p;
+		} else {
+				int cut = offset - left_size;
+				int head_newlines = count_newlines(piece_data(s, p), cut);
+				struct piece* tail = piece_new(s, p->add, p->start + cut, p->len - cut,
+				                               p->newlines - head_newlines);
+				struct piece* right = p->right;
+
+				p->right = NULL;
+				p->len = cut;
+				p->newlines = head_newlines;
+				piece_update(p);
+
+				*l = p;
+				*r = piece_merge(tail, right);
+		}
+}
+
+struct fb_storage*
+storage_new(char* data, int len)
+{
+		struct fb_storage* s = xmalloc(sizeof(struct fb_storage));
+		*s = (struct fb_storage){0};
+		s->original = piece_text_new(data, len, 0);
+		s->add = piece_text_new(NULL, 0, 0);
+		for (int offset = 0; offset < len; offset += PIECE_MAX)
+				s->root = piece_merge(s->root, piece_new(s, 0, offset, MIN(PIECE_MAX, len - offset), -1));
+		return s;
+}
+
+struct fb_storage*
+storage_new_mapped(const char* data, int len)
+{
+		struct fb_storage* s = storage_new((char*)data, len);
+		s->original->mapped = 1;
+		return s;
+}
+
+struct fb_storage*
+storage_snapshot(struct fb_storage* s)
+{
+		struct fb_storage* snapshot = xmalloc(sizeof(struct fb_storage));
+		*snapshot = (struct fb_storage){0};
+		snapshot->original = s->original;
+		snapshot->add = s->add;
+		snapshot->root = s->root;
+		s->original->refs++;
+		s->add->refs++;
+		if (s->root)
+				s->root->refs++;
+		return snapshot;
+}
+
+void
+storage_free(struct fb_storage* s)
+{
+		if (!s)
+				return;
+		piece_free(s->root);
+		piece_text_free(s->original);
+		piece_text_free(s->add);
+		free(s);
+}
+
+int
+storage_len(const struct fb_storage* s)
+{
+		return piece_size(s->root);
+}
+
+// makes room for len more bytes at the end of the add buffer
+static struct piece_text*
+add_text_reserve(struct fb_storage* s, int len)
+{
+		struct piece_text* add = s->add;
+		if (add->len + len > add->capacity) {
+				add->capacity = (add->len + len) * 2;
+				if (add->refs > 1) {
+						// snapshots still read the old one
+						s->add = piece_text_new(xmalloc(add->capacity), add->len, 0);
+						s->add->capacity = add->capacity;
+						if (add->len > 0)
+								memcpy(s->add->data, add->data, add->len);
+						add->capacity = add->len;
+						piece_text_free(add);
+						add = s->add;
+				} else {
+						add->data = xrealloc(add->data, add->capacity);
+				}
+		}
+		return add;
+}
+
+void
+storage_insert(struct fb_storage* s, int offset, const char* data, int len)
+{
+		if (len <= 0)
+				return;
+		s->cache = NULL;
+
+		struct piece_text* add = add_text_reserve(s, len);
+		memcpy(add->data + add->len, data, len);
+
+		struct piece *l, *r;
+		piece_split(s, s->root, offset, &l, &r);
+
+		// the right edge of l was copied by piece_split if it was shared
+		struct piece* last = l;
+		while (last && last->right)
+				last = last->right;
+
+		if (last && last->add && last->start + last->len == add->len
+			&& last->len + len <= PIECE_MAX) {
+				// the text is inserted right after the previous insertion (typing)
+				// so the piece before it can simply be extended
+				int newlines = count_newlines(data, len);
+				for (struct piece* p = l; p; p = p->right) {
+						p->size += len;
+						p->lines += newlines;
+				}
+				last->len += len;
+				last->newlines += newlines;
+		} else {
+				for (int i = 0; i < len; i += PIECE_MAX)
+						l = piece_merge(l, piece_new(s, 1, add->len + i, MIN(PIECE_MAX, len - i), -1));
+		}
+		add->len += len;
+
+		s->root = piece_merge(l, r);
+}
+
+void
+storage_remove(struct fb_storage* s, int offset, int len)
+{
+		if (len <= 0)
+				return;
+		s->cache = NULL;
+
+		struct piece *l, *m, *r;
+		piece_split(s, s->root, offset, &l, &m);
+		piece_split(s, m, len, &m, &r);
+		piece_free(m);
+
+		s->root = piece_merge(l, r);
+}
+
+// appends the pieces of the tree at p to list in order
+static void
+piece_collect(const struct piece* p, const struct piece*** list, int* count, int* capacity)
+{
+		if (!p)
+				return;
+		piece_collect(p->left, list, count, capacity);
+		if (*count >= *capacity) {
+				*capacity *= 2;
+				*list = xrealloc(*list, *capacity * sizeof(struct piece*));
+		}
+		(*list)[(*count)++] = p;
+		piece_collect(p->right, list, count, capacity);
+}
+
+///////////////////////////////////
+// the pieces between the first and the last edit are replaced by a freshly built run,
+// that way the newlines of the text that is kept are counted once instead of once
+// for every edit that cuts a piece in two
+void
+storage_apply(struct fb_storage* s, const struct storage_edit* edits, int count)
+{
+		if (count <= 0)
+				return;
+		s->cache = NULL;
+		int start = edits[0].offset;
+		int end = edits[count-1].offset + edits[count-1].removed;
+
+		int inserted = 0;
+		for (int i = 0; i < count; i++)
+				inserted += edits[i].len;
+		struct piece_text* add = add_text_reserve(s, inserted);
+
+		struct piece *l, *m, *r;
+		piece_split(s, s->root, start, &l, &m);
+		piece_split(s, m, end - start, &m, &r);
+
+		int old_count = 0, old_capacity = 16;
+		const struct piece** old = xmalloc(old_capacity * sizeof(struct piece*));
+		piece_collect(m, &old, &old_count, &old_capacity);
+
+		struct piece* run = NULL;
+		int position = start;
+		int index = 0, index_offset = start; // old[index] starts at index_offset
+		for (int i = 0; i <= count; i++) {
+				// the text up to the edit keeps pointing where it did
+				int kept_end = i < count ? edits[i].offset : end;
+				while (position < kept_end) {
+						const struct piece* p = old[index];
+						int from = position - index_offset;
+						int to = MIN(p->len, kept_end - index_offset);
+						int newlines = from == 0 && to == p->len ? p->newlines :
+						               count_newlines(piece_data(s, p) + from, to - from);
+						run = piece_merge(run, piece_new(s, p->add, p->start + from, to - from, newlines));
+						position = index_offset + to;
+						if (to == p->len)
+								index_offset += old[index++]->len;
+				}
+				if (i == count)
+						break;
+
+				for (int n = 0; n < edits[i].len; n += PIECE_MAX) {
+						int len = MIN(PIECE_MAX, edits[i].len - n);
+						memcpy(add->data + add->len, edits[i].data + n, len);
+						run = piece_merge(run, piece_new(s, 1, add->len, len, -1));
+						add->len += len;
+				}
+
+				position = edits[i].offset + edits[i].removed;
+				while (index < old_count && index_offset + old[index]->len <= position)
+						index_offset += old[index++]->len;
+		}
+		free(old);
+		piece_free(m);
+
+		s->root = piece_merge(piece_merge(l, run), r);
+}
+
+const char*
+storage_chunk(const struct fb_storage* s, int offset, int* len)
+{
+		if (offset < 0 || offset >= piece_size(s->root)) {
+				*len = 0;
+				return NULL;
+		}
+
+		const struct piece* p = s->cache;
+		int piece_offset = s->cache_offset;
+		if (!p || offset < piece_offset || offset >= piece_offset + p->len) {
+				p = s->root;
+				piece_offset = 0;
+				for (;;) {
+						int left_size = piece_size(p->left);
+						if (offset < piece_offset + left_size) {
+								p = p->left;
+						} else if (offset >= piece_offset + left_size + p->len) {
+								piece_offset += left_size + p->len;
+								p = p->right;
+						} else {
+								piece_offset += left_size;
+								break;
+						}
+				}
+				// the cache is not part of the contents
+				((struct fb_storage*)s)->cache = p;
+				((struct fb_storage*)s)->cache_offset = piece_offset;
+		}
+
+		*len = p->len - (offset - piece_offset);
+		return piece_data(s, p) + (offset - piece_offset);
+}
+
+void
+storage_copy(const struct fb_storage* s, int offset, int len, char* dest)
+{
+		while (len > 0) {
+				int chunk_len;
+				const char* chunk = storage_chunk(s, offset, &chunk_len);
+				if (!chunk)
+						return;
+				chunk_len = chunk_len < len ? chunk_len : len;
+				memcpy(dest, chunk, chunk_len);
+				dest += chunk_len;
+				offset += chunk_len;
+				len -= chunk_len;
+		}
+}
+
+int
+storage_offset_to_line(const struct fb_storage* s, int offset)
+{
+		int line = 0;
+		const struct piece* p = s->root;
+		while (p) {
+				int left_size = piece_size(p->left);
+				if (offset < left_size) {
+						p = p->left;
+				} else if (offset < left_size + p->len) {
+						return line + piece_lines(p->left) + count_newlines(piece_data(s, p), offset - left_size);
+				} else {
+						line += piece_lines(p->left) + p->newlines;
+						offset -= left_size + p->len;
+						p = p->right;
+				}
+		}
+		return line;
+}
+
+int
+storage_line_to_offset(const struct fb_storage* s, int line)
+{
+		if (line <= 0)
+				return 0;
+		if (line > piece_lines(s->root))
+				return -1;
+
+		int offset = 0;
+		const struct piece* p = s->root;
+		for (;;) {
+				int left_lines = piece_lines(p->left);
+				if (line <= left_lines) {
+						p = p->left;
+				} else if (line <= left_lines + p->newlines) {
+						line -= left_lines;
+						offset += piece_size(p->left);
+						const char* data = piece_data(s, p);
+						const char* c = data;
+						while (line--)
+								c = (const char*)memchr(c, '\n', data + p->len - c) + 1;
+						return offset + (c - data);
+				} else {
+						line -= left_lines + p->newlines;
+						offset += piece_size(p->left) + p->len;
+						p = p->right;
+				}
+		}
+}
+
+int
+storage_offset_to_char(const struct fb_storage* s, int offset)
+{
+		int chars = 0;
+		const char* chunk;
+		for (int i = 0, len; i < offset && (chunk = storage_chunk(s, i, &len)); i += len) {
+				len = MIN(len, offset - i);
+				for (int j = 0; j < len; j++)
+						if ((chunk[j] & 0xC0) != 0x80) // if byte doesn't start with 0b10
+								chars++;
+		}
+		return chars;
+}
@@ -0,0 +1,564 @@
+/*
+** rope storage backend
+**
+** The contents are split up in leaves of at most ROPE_LEAF_MAX bytes that
+** hang in a B-tree, every leaf is at the same depth. Each node knows the
+** amount of bytes, newlines and utf8 chars below it, so edits, finding an
+** offset and converting between offsets and lines are all O(log n) no
+** matter how big the file is.
+**
+** Snapshots share the tree. A node that is referenced by more than one
+** parent or root is never changed, edits copy it (and the path down to
+** it) first, so a snapshot costs O(log n) copied nodes per later edit.
+*/
+
+#include "storage.h"
+#include "x.h"
+
+#include <string.h>
+#include <sys/mman.h>
+
+#define ROPE_LEAF_MAX 4096
+#define ROPE_NODE_MAX 16
+// nodes with less than this are merged with or filled up by a neighbour
+#define ROPE_LEAF_MIN (ROPE_LEAF_MAX / 4)
+#define ROPE_NODE_MIN (ROPE_NODE_MAX / 4)
+
+struct rope {
+		int refs; // amount of parents and roots pointing to this node
+		int bytes, newlines, chars;
+
+		// inner nodes have children, leaves have data
+		int count;
+		struct rope* children[ROPE_NODE_MAX + 1];
+		char* data;
+};
+
+struct fb_storage {
+		struct rope* root;
+
+		// the last leaf handed out by storage_chunk
+		// sequential reads will hit this and won't have to walk the tree
+		const struct rope* cache;
+		int cache_offset;
+};
+
+static inline int
+rope_is_leaf(const struct rope* r)
+{
+		return r->data != NULL;
+}
+
+static int
+count_newlines(const char* data, int len)
+{
+		int count = 0;
+		const char* end = data + len;
+		while ((data = memchr(data, '\n', end - data))) {
+				count++;
+				data++;
+		}
+		return count;
+}
+
+static int
+count_chars(const char* data, int len)
+{
+		int count = 0;
+		for (int i = 0; i < len; i++)
+				if ((data[i] & 0xC0) != 0x80) // if byte doesn't start with 0b10
+						count++;
+		return count;
+}
+
+static void
+rope_update(struct rope* r)
+{
+		if (rope_is_leaf(r)) {
+				r->bytes = r->count;
+				r->newlines = count_newlines(r->data, r->count);
+				r->chars = count_chars(r->data, r->count);
+				return;
+		}
+		r->bytes = r->newlines = r->chars = 0;
+		for (int i = 0; i < r->count; i++) {
+				r->bytes    += r->children[i]->bytes;
+				r->newlines += r->children[i]->newlines;
+				r->chars    += r->children[i]->chars;
+		}
+}
+
+static struct rope*
+rope_new_leaf(const char* data, int len)
+{
+		struct rope* r = xmalloc(sizeof(struct rope));
+		*r = (struct rope){0};
+		r->refs = 1;
+		r->data = xmalloc(ROPE_LEAF_MAX);
+		r->count = len;
+		if (len > 0)
+				memcpy(r->data, data, len);
+		rope_update(r);
+		return r;
+}
+
+static struct rope*
+rope_new_node(struct rope** children, int count)
+{
+		struct rope* r = xmalloc(sizeof(struct rope));
+		*r = (struct rope){0};
+		r->refs = 1;
+		r->count = count;
+		memcpy(r->children, children, count * sizeof(struct rope*));
+		rope_update(r);
+		return r;
+}
+
+static void
+rope_free(struct rope* r)
+{
+		if (!r || --r->refs > 0)
+				return;
+		if (rope_is_leaf(r))
+				free(r->data);
+		else
+				for (int i = 0; i < r->count; i++)
+						rope_free(r->children[i]);
+		free(r);
+}
+
+///////////////////////////////////
+// returns a node that can be changed in place of r
+// a node shared with a snapshot is replaced by a copy
+static struct rope*
+rope_own(struct rope* r)
+{
+		if (r->refs == 1)
+				return r;
+		struct rope* copy;
+		if (rope_is_leaf(r)) {
+				copy = rope_new_leaf(r->data, r->count);
+		} else {
+				copy = rope_new_node(r->children, r->count);
+				for (int i = 0; i < r->count; i++)
+						r->children[i]->refs++;
+		}
+		r->refs--;
+		return copy;
+}
+
+static int
+rope_is_underfull(const struct rope* r)
+{
+		return r->count < (rope_is_leaf(r) ? ROPE_LEAF_MIN : ROPE_NODE_MIN);
+}
+
+///////////////////////////////////
+// splits a node that has grown too big in two
+// returns the new right half
+static struct rope*
+rope_split(struct rope* r)
+{
+		int half = r->count / 2;
+		struct rope* right;
+		if (rope_is_leaf(r)) {
+				right = rope_new_leaf(r->data + half, r->count - half);
+		} else {
+				right = rope_new_node(r->children + half, r->count - half);
+		}
+		r->count = half;
+		rope_update(r);
+		return right;
+}
+
+///////////////////////////////////
+// inserts at most ROPE_LEAF_MAX/2 bytes
+// returns a new right sibling if the node had to be split
+static struct rope*
+rope_insert(struct rope* r, int offset, const char* data, int len)
+{
+		if (rope_is_leaf(r)) {
+				if (r->count + len > ROPE_LEAF_MAX) {
+						struct rope* right = rope_split(r);
+						if (offset > r->count)
+								rope_insert(right, offset - r->count, data, len);
+						else
+								rope_insert(r, offset, data, len);
+						return right;
+				}
+				memmove(r->data + offset + len, r->data + offset, r->count - offset);
+				memcpy(r->data + offset, data, len);
+				r->count += len;
+				r->bytes += len;
+				r->newlines += count_newlines(data, len);
+				r->chars += count_chars(data, len);
+				return NULL;
+		}
+
+		int i = 0;
+		for (; i < r->count - 1 && offset > r->children[i]->bytes; i++)
+				offset -= r->children[i]->bytes;
+
+		r->children[i] = rope_own(r->children[i]);
+		struct rope* new_child = rope_insert(r->children[i], offset, data, len);
+		if (new_child) {
+				memmove(r->children + i + 2, r->children + i + 1, (r->count - i - 1) * sizeof(struct rope*));
+				r->children[i+1] = new_child;
+				r->count++;
+		}
+		rope_update(r);
+
+		if (r->count > ROPE_NODE_MAX)
+				return rope_split(r);
+		return NULL;
+}
+
+///////////////////////////////////
+// merges children[i] with a neighbour or moves some of the
+// neighbour's contents over so that it isn't underfull anymore
+static void
+rope_fix_child(struct rope* r, int i)
+{
+		if (r->count < 2)
+				return;
+		if (i == r->count - 1)
+				i--;
+		struct rope* left = r->children[i] = rope_own(r->children[i]);
+		struct rope* right = r->children[i+1] = rope_own(r->children[i+1]);
+		int max = rope_is_leaf(left) ? ROPE_LEAF_MAX : ROPE_NODE_MAX;
+
+		if (left->count + right->count <= max) {
+				if (rope_is_leaf(left))
+						memcpy(left->data + left->count, right->data, right->count);
+				else
+						memcpy(left->children + left->count, right->children, right->count * sizeof(struct rope*));
+				left->count += right->count;
+				right->count = 0;
+				rope_free(right);
+				memmove(r->children + i + 1, r->children + i + 2, (r->count - i - 2) * sizeof(struct rope*));
+				r->count--;
+				rope_update(left);
+				return;
+		}
+
+		// share evenly
+		int total = left->count + right->count;
+		int new_left = total / 2;
+		if (rope_is_leaf(left)) {
+				char* buffer = xmalloc(total);
+				memcpy(buffer, left->data, left->count);
+				memcpy(buffer + left->count, right->data, right->count);
+				memcpy(left->data, buffer, new_left);
+				memcpy(right->data, buffer + new_left, total - new_left);
+				free(buffer);
+		} else {
+				struct rope* buffer[ROPE_NODE_MAX * 2 + 2];
+				memcpy(buffer, left->children, left->count * sizeof(struct rope*));
+				memcpy(buffer + left->count, right->children, right->count * sizeof(struct rope*));
+				memcpy(left->children, buffer, new_left * sizeof(struct rope*));
+				memcpy(right->children, buffer + new_left, (total - new_left) * sizeof(struct rope*));
+		}
+		left->count = new_left;
+		right->count = total - new_left;
+		rope_update(left);
+		rope_update(right);
+}
+
+static void
+rope_remove(struct rope* r, int offset, int len)
+{
+		if (rope_is_leaf(r)) {
+				memmove(r->data + offset, r->data + offset + len, r->count - offset - len);
+				r->count -= len;
+				rope_update(r);
+				return;
+		}
+
+		for (int i = 0; i < r->count && len > 0;) {
+				struct rope* child = r->children[i];
+				if (offset >= child->bytes) {
+						offset -= child->bytes;
+						i++;
+						continue;
+				}
+				int remove_len = MIN(len, child->bytes - offset);
+				len -= remove_len;
+				if (offset == 0 && remove_len == child->bytes) {
+						rope_free(child);
+						memmove(r->children + i, r->children + i + 1, (r->count - i - 1) * sizeof(struct rope*));
+						r->count--;
+						continue;
+				}
+				rope_remove(r->children[i] = rope_own(child), offset, remove_len);
+				offset = 0;
+				i++;
+		}
+
+		for (int i = 0; i < r->count && r->count > 1; i++) {
+				if (rope_is_underfull(r->children[i])) {
+						rope_fix_child(r, i);
+						i = -1;
+				}
+		}
+		rope_update(r);
+}
+
+///////////////////////////////////
+// finds the leaf containing offset, *leaf_offset is set to the offset of the leaf
+static const struct rope*
+rope_find_leaf(const struct rope* r, int offset, int* leaf_offset)
+{
+		*leaf_offset = 0;
+		while (!rope_is_leaf(r)) {
+				int i = 0;
+				for (; i < r->count - 1 && offset >= r->children[i]->bytes; i++) {
+						offset -= r->children[i]->bytes;
+						*leaf_offset += r->children[i]->bytes;
+				}
+				r = r->children[i];
+		}
+		return r;
+}
+
+static struct rope*
+rope_build(const char* data, int len)
+{
+		// fill the leaves 3/4 of the way so the first edits don't split everything
+		const int leaf_fill = ROPE_LEAF_MAX * 3 / 4;
+		const int node_fill = ROPE_NODE_MAX * 3 / 4;
+
+		int count = (len + leaf_fill - 1) / leaf_fill;
+		if (count == 0)
+				return rope_new_leaf(NULL, 0);
+		struct rope** level = xmalloc(count * sizeof(struct rope*));
+		for (int i = 0; i < count; i++) {
+				int offset = i * leaf_fill;
+				level[i] = rope_new_leaf(data + offset, MIN(leaf_fill, len - offset));
+		}
+
+		while (count > 1) {
+				int new_count = (count + node_fill - 1) / node_fill;
+				for (int i = 0; i < new_count; i++) {
+						int offset = i * node_fill;
+						level[i] = rope_new_node(level + offset, MIN(node_fill, count - offset));
+				}
+				count = new_count;
+		}
+
+		struct rope* root = level[0];
+		free(level);
+		return root;
+}
+
+struct fb_storage*
+storage_new(char* data, int len)
+{
+		struct fb_storage* s = xmalloc(sizeof(struct fb_storage));
+		*s = (struct fb_storage){0};
+		s->root = rope_build(data, len);
+		free(data);
+		return s;
+}
+
+struct fb_storage*
+storage_new_mapped(const char* data, int len)
+{
+		// the leaves own their data, so the mapping is only read once
+		struct fb_storage* s = xmalloc(sizeof(struct fb_storage));
+		*s = (struct fb_storage){0};
+		s->root = rope_build(data, len);
+		munmap((char*)data, len);
+		return s;
+}
+
+struct fb_storage*
+storage_snapshot(struct fb_storage* s)
+{
+		struct fb_storage* snapshot = xmalloc(sizeof(struct fb_storage));
+		*snapshot = (struct fb_storage){0};
+		snapshot->root = s->root;
+		s->root->refs++;
+		return snapshot;
+}
+
+void
+storage_free(struct fb_storage* s)
+{
+		if (!s)
+				return;
+		rope_free(s->root);
+		free(s);
+}
+
+int
+storage_len(const struct fb_storage* s)
+{
+		return s->root->bytes;
+}
+
+void
+storage_insert(struct fb_storage* s, int offset, const char* data, int len)
+{
+		s->cache = NULL;
+		while (len > 0) {
+				int insert_len = MIN(len, ROPE_LEAF_MAX / 2);
+				s->root = rope_own(s->root);
+				struct rope* new_child = rope_insert(s->root, offset, data, insert_len);
+				if (new_child)
+						s->root = rope_new_node((struct rope*[]){s->root, new_child}, 2);
+				offset += insert_len;
+				data += insert_len;
+				len -= insert_len;
+		}
+}
+
+void
+storage_remove(struct fb_storage* s, int offset, int len)
+{
+		if (len <= 0)
+				return;
+		s->cache = NULL;
+		s->root = rope_own(s->root);
+		rope_remove(s->root, offset, len);
+
+		while (!rope_is_leaf(s->root) && s->root->count <= 1) {
+				struct rope* root = s->root;
+				s->root = root->count ? root->children[0] : rope_new_leaf(NULL, 0);
+				root->count = 0;
+				rope_free(root);
+		}
+}
+
+void
+storage_apply(struct fb_storage* s, const struct storage_edit* edits, int count)
+{
+		if (count <= 0)
+				return;
+		int start = edits[0].offset;
+		int end = edits[count-1].offset + edits[count-1].removed;
+
+		// every edit recounts the leaf it is in, when there are more edits than
+		// leaves it is cheaper to rebuild everything between them in one go
+		if ((end - start) / count < ROPE_LEAF_MAX) {
+				int len = end - start;
+				for (int i = 0; i < count; i++)
+						len += edits[i].len - edits[i].removed;
+				char* text = xmalloc(MAX(len, 1));
+				int position = start, n = 0;
+				for (int i = 0; i < count; i++) {
+						if (edits[i].offset > position)
+								storage_copy(s, position, edits[i].offset - position, text + n);
+						n += edits[i].offset - position;
+						if (edits[i].len > 0)
+								memcpy(text + n, edits[i].data, edits[i].len);
+						n += edits[i].len;
+						position = edits[i].offset + edits[i].removed;
+				}
+				storage_remove(s, start, end - start);
+				storage_insert(s, start, text, len);
+				free(text);
+				return;
+		}
+
+		// from the back so the offsets of the edits before stay the same
+		for (int i = count-1; i >= 0; i--) {
+				storage_remove(s, edits[i].offset, edits[i].removed);
+				storage_insert(s, edits[i].offset, edits[i].data, edits[i].len);
+		}
+}
+
+const char*
+storage_chunk(const struct fb_storage* s, int offset, int* len)
+{
+		if (offset < 0 || offset >= s->root->bytes) {
+				*len = 0;
+				return NULL;
+		}
+
+		const struct rope* leaf = s->cache;
+		int leaf_offset = s->cache_offset;
+		if (!leaf || offset < leaf_offset || offset >= leaf_offset + leaf->count) {
+				leaf = rope_find_leaf(s->root, offset, &leaf_offset);
+				// the cache is not part of the contents
+				((struct fb_storage*)s)->cache = leaf;
+				((struct fb_storage*)s)->cache_offset = leaf_offset;
+		}
+
+		*len = leaf->count - (offset - leaf_offset);
+		return leaf->data + (offset - leaf_offset);
+}
+
+void
+storage_copy(const struct fb_storage* s, int offset, int len, char* dest)
+{
+		while (len > 0) {
+				int chunk_len;
+				const char* chunk = storage_chunk(s, offset, &chunk_len);
+				if (!chunk)
+						return;
+				chunk_len = MIN(chunk_len, len);
+				memcpy(dest, chunk, chunk_len);
+				dest += chunk_len;
+				offset += chunk_len;
+				len -= chunk_len;
+		}
+}
+
+int
+storage_offset_to_line(const struct fb_storage* s, int offset)
+{
+		LIMIT(offset, 0, s->root->bytes);
+		const struct rope* r = s->root;
+		int line = 0;
+		while (!rope_is_leaf(r)) {
+				int i = 0;
+				for (; i < r->count - 1 && offset >= r->children[i]->bytes; i++) {
+						offset -= r->children[i]->bytes;
+						line += r->children[i]->newlines;
+				}
+				r = r->children[i];
+		}
+		return line + count_newlines(r->data, offset);
+}
+
+int
+storage_line_to_offset(const struct fb_storage* s, int line)
+{
+		if (line <= 0)
+				return 0;
+		if (line > s->root->newlines)
+				return -1;
+
+		const struct rope* r = s->root;
+		int offset = 0;
+		while (!rope_is_leaf(r)) {
+				int i = 0;
+				for (; i < r->count - 1 && line > r->children[i]->newlines; i++) {
+						line -= r->children[i]->newlines;
+						offset += r->children[i]->bytes;
+				}
+				r = r->children[i];
+		}
+
+		const char* p = r->data;
+		while (line--)
+				p = (const char*)memchr(p, '\n', r->data + r->count - p) + 1;
+		return offset + (p - r->data);
+}
+
+int
+storage_offset_to_char(const struct fb_storage* s, int offset)
+{
+		LIMIT(offset, 0, s->root->bytes);
+		const struct rope* r = s->root;
+		int chars = 0;
+		while (!rope_is_leaf(r)) {
+				int i = 0;
+				for (; i < r->count - 1 && offset >= r->children[i]->bytes; i++) {
+						offset -= r->children[i]->bytes;
+						chars += r->children[i]->chars;
+				}
+				r = r->children[i];
+		}
+		return chars + count_chars(r->data, offset);
+}
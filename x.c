@@ -445,14 +445,15 @@ selnotify(XEvent *e)
                 }
 
                 struct file_buffer* fb = get_fb(focused_window);
-                if (fb->contents) {
+                if (fb->storage) {
+                        fb_begin_transaction(fb);
                         if (fb->mode & FB_SELECTION_ON) {
                                 fb_remove_selection(fb);
                                 wb_move_cursor_to_selection_start(focused_window);
                                 fb->mode &= ~(FB_SELECTION_ON);
                         }
                         call_extension(fb_paste, fb, (char*)data, nitems * format / 8);
-                        call_extension(fb_contents_updated, fb, focused_window->cursor_offset, FB_CONTENT_BIG_CHANGE);
+                        fb_commit_transaction(fb, FB_CONTENT_BIG_CHANGE);
                 }
                 XFree(data);
                 /* number of 32-bit chunks returned */
@@ -1475,6 +1476,10 @@ search_term_actions(KeySym keysym, int modkey)
         struct file_buffer* fb = get_fb(focused_window);
         if (keysym == XK_Return || keysym == XK_Escape) {
                 int count = fb_count_string_instances(fb, fb->search_term, 0, NULL);
+                // look through the part of the file that isn't loaded before giving up
+                if (!count && fb->loader &&
+                    wb_seek_string_wrap(focused_window, focused_window->cursor_offset, fb->search_term) >= 0)
+                        count = fb_count_string_instances(fb, fb->search_term, 0, NULL);
                 if (!count) {
                         fb->mode &= ~FB_SEARCH_BLOCKING_MASK;
                         writef_to_status_bar("no resulrs for \"%s\"", fb->search_term);
@@ -1621,6 +1626,10 @@ run(void)
                         }
                 }
 
+                // saves finish in the background
+                if (fb_finish_saves())
+                        xev = 1;
+
                 if (!xev) {
                         nanosleep(&(struct timespec){.tv_nsec = 1e6}, NULL);
                         continue;